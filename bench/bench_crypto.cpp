@@ -0,0 +1,187 @@
+// Crypto hot-path micro-benchmark. Prints one JSON document to stdout so
+// runs can be diffed across builds, cipher suites and CPUs.
+//
+//   vpn_bench_crypto [--min-time-ms N] [--suite NAME]
+
+#include "vpn/crypto.h"
+#include "vpn/tunnel.h"
+#include <Poco/JSON/Object.h>
+#include <Poco/JSON/Array.h>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static volatile std::size_t g_sink = 0;
+
+struct Measurement {
+	std::uint64_t iterations = 0;
+	double nsPerOp = 0;
+};
+
+// Runs op in chunks until minTime has passed; op returns a value that is
+// folded into a sink so the compiler cannot drop the work.
+template <typename Op>
+static Measurement measure(Op&& op, std::chrono::milliseconds minTime) {
+	std::size_t sink = 0;
+	for (int i = 0; i < 32; ++i) sink += op(); // warm-up
+	Measurement m;
+	const auto start = Clock::now();
+	Clock::duration elapsed{};
+	do {
+		for (int i = 0; i < 32; ++i) sink += op();
+		m.iterations += 32;
+		elapsed = Clock::now() - start;
+	} while (elapsed < minTime);
+	m.nsPerOp = std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(m.iterations);
+	g_sink = sink;
+	return m;
+}
+
+// As measure(), for ops that consume their input: prepare() restores the
+// inputs of the next chunk of kChunk ops outside the timed region, and
+// op(i) runs on input i.
+static const int kChunk = 32;
+template <typename Prepare, typename Op>
+static Measurement measureChunks(Prepare&& prepare, Op&& op, std::chrono::milliseconds minTime) {
+	std::size_t sink = 0;
+	prepare();
+	for (int i = 0; i < kChunk; ++i) sink += op(i); // warm-up
+	Measurement m;
+	Clock::duration elapsed{};
+	do {
+		prepare();
+		const auto start = Clock::now();
+		for (int i = 0; i < kChunk; ++i) sink += op(i);
+		elapsed += Clock::now() - start;
+		m.iterations += kChunk;
+	} while (elapsed < minTime);
+	m.nsPerOp = std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(m.iterations);
+	g_sink = sink;
+	return m;
+}
+
+static Poco::JSON::Object::Ptr result(const std::string& op, const std::string& api, const std::string& suite,
+                                      std::size_t size, const Measurement& m) {
+	Poco::JSON::Object::Ptr r = new Poco::JSON::Object(Poco::JSON_PRESERVE_KEY_ORDER);
+	r->set("op", op);
+	if (!api.empty()) r->set("api", api);
+	if (!suite.empty()) r->set("suite", suite);
+	if (size > 0) r->set("size", static_cast<Poco::UInt64>(size));
+	r->set("iterations", static_cast<Poco::UInt64>(m.iterations));
+	r->set("nsPerOp", m.nsPerOp);
+	if (size > 0) r->set("mbPerSec", static_cast<double>(size) * 1e3 / m.nsPerOp);
+	return r;
+}
+
+int main(int argc, char** argv) {
+	std::chrono::milliseconds minTime(200);
+	std::string suiteFilter;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--min-time-ms" && i + 1 < argc) {
+			const std::string value = argv[++i];
+			std::size_t parsed = 0;
+			long ms = -1;
+			try {
+				ms = std::stol(value, &parsed);
+			} catch (const std::exception&) {}
+			if (ms < 0 || parsed != value.size()) {
+				std::cerr << "invalid --min-time-ms: " << value << "\n";
+				std::cerr << "usage: vpn_bench_crypto [--min-time-ms N] [--suite NAME]\n";
+				return 2;
+			}
+			minTime = std::chrono::milliseconds(ms);
+		} else if (arg == "--suite" && i + 1 < argc) {
+			suiteFilter = argv[++i];
+		} else {
+			std::cerr << "usage: vpn_bench_crypto [--min-time-ms N] [--suite NAME]\n";
+			return 2;
+		}
+	}
+
+	const std::vector<std::size_t> sizes = {64, 128, 256, 512, 1024, 1500, 4096, 16384, 65536};
+	const std::size_t batchSize = 32;
+	std::vector<std::uint8_t> keySeed(32, 0x42);
+	std::vector<std::uint8_t> clientNonce(16, 0x11);
+	std::vector<std::uint8_t> serverNonce(16, 0x22);
+	const auto keys = vpn::deriveSessionKeys(keySeed, clientNonce, serverNonce);
+
+	Poco::JSON::Array::Ptr results = new Poco::JSON::Array;
+	for (auto suite : {vpn::CipherSuite::AES_256_CBC_HMAC_SHA256, vpn::CipherSuite::AES_256_GCM, vpn::CipherSuite::CHACHA20_POLY1305}) {
+		const std::string name = vpn::cipherSuiteName(suite);
+		if (!suiteFilter.empty() && suiteFilter != name) continue;
+		vpn::SessionCrypto sender(keys.encKey, keys.macKey, suite);
+		vpn::SessionCrypto receiver(keys.encKey, keys.macKey, suite);
+		const std::size_t headroom = vpn::Tunnel::kFrameHeaderLen + sender.headroom();
+
+		for (auto size : sizes) {
+			std::vector<std::uint8_t> plaintext(size, 0xA5);
+			results->add(result("encrypt", "vector", name, size,
+				measure([&] { return sender.encrypt(plaintext).size(); }, minTime)));
+			const auto frame = sender.encrypt(plaintext);
+			results->add(result("decrypt", "vector", name, size,
+				measure([&] { return receiver.decrypt(frame).size(); }, minTime)));
+
+			// in place: the payload refill is part of every iteration, as it is for a caller reusing one buffer
+			vpn::PacketBuffer buf(headroom, size, sender.tailroom());
+			results->add(result("encrypt", "inplace", name, size,
+				measure([&] {
+					buf.reset(headroom);
+					buf.assign(plaintext.data(), plaintext.size());
+					sender.encryptInPlace(buf);
+					return buf.size();
+				}, minTime)));
+			// decryption overwrites the frame: restore a chunk of copies between timed runs
+			std::vector<std::vector<std::uint8_t>> scratch(kChunk, frame);
+			results->add(result("decrypt", "inplace", name, size,
+				measureChunks([&] {
+					for (auto& copy : scratch) std::memcpy(copy.data(), frame.data(), frame.size());
+				}, [&](int i) {
+					auto& copy = scratch[static_cast<std::size_t>(i)];
+					return receiver.decryptInPlace(vpn::ByteView{copy.data(), copy.size()}).size;
+				}, minTime)));
+
+			std::vector<vpn::PacketBuffer> burst(batchSize, vpn::PacketBuffer(headroom, size, sender.tailroom()));
+			auto batch = measure([&] {
+				for (auto& b : burst) {
+					b.reset(headroom);
+					b.assign(plaintext.data(), plaintext.size());
+				}
+				sender.encryptBatch(burst);
+				return burst.back().size();
+			}, minTime);
+			batch.iterations *= batchSize;
+			batch.nsPerOp /= static_cast<double>(batchSize);
+			results->add(result("encrypt", "batch", name, size, batch));
+		}
+	}
+
+	// Per-handshake key schedule cost
+	results->add(result("hkdfSha256", "", "", 0,
+		measure([&] { return vpn::hkdfSha256(keySeed, clientNonce, serverNonce, 64).size(); }, minTime)));
+	results->add(result("deriveSessionKeys", "", "", 0,
+		measure([&] { return vpn::deriveSessionKeys(keySeed, clientNonce, serverNonce).encKey.size(); }, minTime)));
+
+	Poco::JSON::Object::Ptr report = new Poco::JSON::Object(Poco::JSON_PRESERVE_KEY_ORDER);
+	report->set("benchmark", std::string("vpn_bench_crypto"));
+	report->set("version", std::string(CUSTOMVPN_VERSION));
+	report->set("buildType", std::string(CUSTOMVPN_BUILD_TYPE));
+#if defined(__clang__)
+	report->set("compiler", std::string("clang ") + __clang_version__);
+#elif defined(__GNUC__)
+	report->set("compiler", std::string("gcc ") + __VERSION__);
+#elif defined(_MSC_VER)
+	report->set("compiler", std::string("msvc ") + std::to_string(_MSC_VER));
+#endif
+	report->set("aesHardware", vpn::hasAesHardware());
+	report->set("preferredSuite", std::string(vpn::cipherSuiteName(vpn::defaultCipherSuites().front())));
+	report->set("minTimeMs", static_cast<Poco::Int64>(minTime.count()));
+	report->set("results", results);
+	report->stringify(std::cout, 2);
+	std::cout << std::endl;
+	return 0;
+}
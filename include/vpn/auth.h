@@ -1,34 +1,147 @@
 #pragma once
 
+#include "vpn/kdf_pool.h"
+#include <Poco/Mutex.h>
+#include <Poco/Thread.h>
+#include <Poco/Event.h>
+#include <Poco/File.h>
+#include <Poco/Timestamp.h>
 #include <string>
 #include <vector>
-#include <unordered_map>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <array>
 
 namespace vpn {
 
+// Password hashing schemes of a credential file ("kdf" field)
+static const char* const kKdfScrypt = "scrypt";               // cost = N, r = 8, p = 1
+static const char* const kKdfPbkdf2Sha256 = "pbkdf2-sha256";  // cost = iterations
+static const std::uint64_t kDefaultScryptCost = 1 << 15;      // 32 MiB per hash
+static const std::uint64_t kDefaultPbkdf2Iterations = 600000;
+
 struct UserRecord {
 	std::string username;
+	std::string kdf;        // empty: legacy single salted SHA-256
+	std::uint64_t cost = 0; // see kKdfScrypt, kKdfPbkdf2Sha256
 	std::vector<std::uint8_t> salt;
 	std::vector<std::uint8_t> hash;
 	std::string passwordPlain;
 };
 
+// The users of one credential file version: parsed JSON, or a mapped
+// binary index (see credential_index.h)
+class UserTable {
+public:
+	virtual ~UserTable() = default;
+	// The record for username or nullptr; a table that stores no UserRecord
+	// objects decodes it into scratch
+	virtual const UserRecord* find(const std::string& username, UserRecord& scratch) const = 0;
+	virtual std::size_t size() const = 0;
+};
+
+enum class VerifyResult { ACCEPTED, REJECTED, BUSY };
+
+struct VerifyOptions {
+	unsigned kdfThreads = 2;
+	// verifyAsync calls waiting for a KDF thread beyond this are answered BUSY
+	std::size_t maxQueued = 256;
+	// How long a successful login skips the KDF when repeated with the same
+	// password; 0 disables the cache
+	std::chrono::seconds cacheTtl{30};
+};
+
+struct VerifyStats {
+	std::uint64_t cacheHits = 0;
+	std::uint64_t kdfRuns = 0;
+	std::uint64_t busy = 0; // verifyAsync calls refused because the queue was full
+};
+
+// Users loaded from a JSON credential file or a compiled index of one. The
+// users are an immutable snapshot; reload() (or the watcher thread) loads a
+// new file version and swaps it in while verify() calls keep running on the
+// old one.
 class CredentialStore {
 public:
 	using Ptr = std::shared_ptr<CredentialStore>;
+	using VerifyCallback = std::function<void(VerifyResult)>;
 
 	static Ptr loadFromFile(const std::string& path);
 
+	CredentialStore();
+	~CredentialStore();
+
+	CredentialStore(const CredentialStore&) = delete;
+	CredentialStore& operator=(const CredentialStore&) = delete;
+
+	// Runs the KDF on the calling thread. Takes no lock unless a reload
+	// happened since this thread's last call.
 	bool verify(const std::string& username, const std::string& password) const;
+	// Runs the KDF on the store's pool and calls done once with the result: on
+	// a pool thread, or before returning for cached logins, cheap records and BUSY
+	void verifyAsync(const std::string& username, const std::string& password, VerifyCallback done) const;
+	// Call before the first verifyAsync
+	void setVerifyOptions(const VerifyOptions& options);
+	VerifyStats verifyStats() const;
+
+	// Re-reads the file; throws and keeps the current users if it does not parse
+	void reload();
+	// Polls the file every interval from a background thread and reloads it when
+	// its modification time or size changes; 0 stops watching
+	void watch(std::chrono::milliseconds interval);
+	std::uint64_t version() const { return _version; } // bumped by every load
 
 private:
-	std::unordered_map<std::string, UserRecord> _records;
+	using CacheKey = std::array<std::uint64_t, 2>;
+	struct CacheSlot;
+
+	static std::shared_ptr<const UserTable> loadUsers(const std::string& path);
+	void install(std::shared_ptr<const UserTable> users);
+	std::shared_ptr<const UserTable> snapshot(std::uint64_t& version) const;
+	bool check(const UserRecord& record, const std::string& password) const;
+	CacheKey cacheKey(const std::string& username, const std::string& password) const;
+	bool cacheLookup(const CacheKey& key, std::uint64_t version) const;
+	void cacheInsert(const CacheKey& key, std::uint64_t version) const;
+	KdfPool& pool() const;
+	void watchLoop(std::chrono::milliseconds interval);
+
+	const std::uint64_t _id; // tells stores apart in the per-thread snapshot cache
+	std::string _path;
+	std::shared_ptr<const UserTable> _users; // replaced under _mutex, never modified
+	mutable Poco::FastMutex _mutex;
+	std::atomic<std::uint64_t> _version{0};
+	Poco::Thread _watcher;
+	Poco::Event _stopWatching;
+	Poco::Timestamp _fileModified; // watcher thread only
+	Poco::File::FileSize _fileSize = 0;
+
+	VerifyOptions _verifyOptions;
+	mutable std::once_flag _poolOnce;
+	mutable std::unique_ptr<KdfPool> _pool;
+	std::string _cacheSecret; // keys the cache's hashes of (user, password)
+	std::unique_ptr<CacheSlot[]> _cache;
+	mutable std::atomic<std::uint64_t> _cacheHits{0};
+	mutable std::atomic<std::uint64_t> _kdfRuns{0};
+	mutable std::atomic<std::uint64_t> _busy{0};
 };
 
+// Records of a JSON credential file, with their KDF costs checked
+std::vector<UserRecord> parseCredentialJson(const std::string& path);
+
+// The cost to use for kdf: the scheme's default for 0, otherwise cost itself;
+// throws for unknown schemes and costs out of bounds
+std::uint64_t checkedKdfCost(const std::string& kdf, std::uint64_t cost);
+
+// Hash of password as stored in a credential file, for the given "kdf" and cost
+std::vector<std::uint8_t> derivePasswordHash(const std::string& kdf, std::uint64_t cost,
+                                             const std::vector<std::uint8_t>& salt,
+                                             const std::string& password);
+
 std::vector<std::uint8_t> computePasswordHash(const std::vector<std::uint8_t>& salt,
                                               const std::string& password);
 
 } // namespace vpn
-
-
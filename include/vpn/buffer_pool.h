@@ -0,0 +1,88 @@
+#pragma once
+
+#include <Poco/AutoPtr.h>
+#include <Poco/Mutex.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace vpn {
+
+class BufferPool;
+
+// Fixed-size memory block with an intrusive reference count. When the last
+// reference goes away the block returns to the pool it came from, or is freed
+// if it was allocated outside a pool. Header and data share one allocation.
+class BufferBlock {
+public:
+	using Ptr = Poco::AutoPtr<BufferBlock>;
+
+	std::uint8_t* data() { return reinterpret_cast<std::uint8_t*>(this + 1); }
+	const std::uint8_t* data() const { return reinterpret_cast<const std::uint8_t*>(this + 1); }
+	std::size_t capacity() const { return _capacity; }
+	bool pooled() const { return _sizeClass >= 0; }
+
+	// Poco::AutoPtr protocol
+	void duplicate() { _refs.fetch_add(1, std::memory_order_relaxed); }
+	void release();
+	int referenceCount() const { return _refs.load(std::memory_order_relaxed); }
+
+	// Unpooled block for sizes no pool class covers
+	static Ptr allocate(std::size_t capacity);
+	// Block of at least capacity from the same pool as this one (for growing a buffer)
+	Ptr sibling(std::size_t capacity) const;
+
+private:
+	friend class BufferPool;
+	struct PoolState;
+
+	BufferBlock(std::shared_ptr<PoolState> pool, int sizeClass, std::size_t capacity);
+	~BufferBlock() = default;
+	static BufferBlock* create(std::shared_ptr<PoolState> pool, int sizeClass, std::size_t capacity);
+	static void destroy(BufferBlock* block);
+	static Ptr acquire(const std::shared_ptr<PoolState>& pool, std::size_t capacity);
+
+	std::atomic<int> _refs{1};
+	std::shared_ptr<PoolState> _pool; // keeps the free lists alive while blocks are out
+	int _sizeClass;
+	std::size_t _capacity;
+};
+
+struct BufferPoolStats {
+	std::uint64_t hits = 0;      // acquisitions served from the free list
+	std::uint64_t misses = 0;    // acquisitions that had to allocate
+	std::size_t inUse = 0;       // blocks currently handed out
+	std::size_t highWater = 0;   // largest inUse seen
+	std::size_t free = 0;        // blocks waiting on the free list
+};
+
+// Pool of reusable blocks in two size classes: 2 KB for MTU-sized packets and
+// 64 KB for bulk frames. Larger requests get unpooled blocks (counted as
+// misses on the bulk class). Blocks may be released from any thread.
+class BufferPool {
+public:
+	enum SizeClass { SMALL = 0, BULK = 1, CLASS_COUNT = 2 };
+	static const std::size_t kSmallBlockSize = 2 * 1024;
+	static const std::size_t kBulkBlockSize = 64 * 1024;
+
+	// maxFree caps the free list of each class; surplus blocks are freed
+	explicit BufferPool(std::size_t maxFree = 256);
+	~BufferPool();
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	// Block with at least the requested capacity
+	BufferBlock::Ptr acquire(std::size_t capacity);
+	BufferPoolStats stats(SizeClass sizeClass) const;
+
+	// Pool owned by the calling thread; server worker threads share it across connections
+	static BufferPool& forThread();
+
+private:
+	std::shared_ptr<BufferBlock::PoolState> _state;
+};
+
+} // namespace vpn
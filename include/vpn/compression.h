@@ -0,0 +1,68 @@
+#pragma once
+
+#include "vpn/packet_buffer.h"
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace vpn {
+
+// Payload codecs negotiated in HELLO (wire values)
+enum class CompressionCodec : std::uint8_t {
+	NONE = 0,
+	ZLIB = 1 // raw deflate, one independent stream per frame
+};
+
+const char* compressionCodecName(CompressionCodec codec);
+
+struct CompressionStats {
+	std::uint64_t compressed = 0;   // payloads sent compressed
+	std::uint64_t rejected = 0;     // attempts that did not shrink enough
+	std::uint64_t skipped = 0;      // payloads not tried (too small or backing off)
+	std::uint64_t bytesIn = 0;      // plaintext bytes of compressed payloads
+	std::uint64_t bytesOut = 0;     // their size on the wire
+};
+
+// Per-session payload compression, applied before encryption. Compression
+// is adaptive: tiny payloads are never tried, and after a payload fails to
+// shrink the compressor skips an exponentially growing number of payloads
+// (up to kMaxBackoff) before it tries again, so incompressible traffic such
+// as media or already-encrypted data costs almost nothing.
+class PayloadCompressor {
+public:
+	static const std::size_t kMinCompressSize = 128;
+	static const unsigned kMaxBackoff = 64;
+	static const std::size_t kMaxDecompressedSize = 16 * 1024 * 1024;
+
+	explicit PayloadCompressor(CompressionCodec codec = CompressionCodec::ZLIB, int level = 1);
+	~PayloadCompressor();
+
+	PayloadCompressor(const PayloadCompressor&) = delete;
+	PayloadCompressor& operator=(const PayloadCompressor&) = delete;
+
+	// Replaces buf's payload with its compressed form if that saves at least
+	// 1/16 of it; returns whether it did. Headroom is kept.
+	bool compress(PacketBuffer& buf);
+	// Inflates a compressed payload into an internal buffer valid until the next call
+	ByteView decompress(ByteView in);
+	// Lowers the decompressed size cap (kMaxDecompressedSize by default)
+	void setMaxDecompressedSize(std::size_t maxSize);
+
+	CompressionCodec codec() const { return _codec; }
+	const CompressionStats& stats() const { return _stats; }
+
+private:
+	struct Streams;
+
+	CompressionCodec _codec;
+	std::unique_ptr<Streams> _streams; // zlib state stays out of the header
+	std::vector<std::uint8_t> _deflated;
+	std::vector<std::uint8_t> _inflated;
+	std::size_t _maxDecompressedSize = kMaxDecompressedSize;
+	unsigned _backoff = 0;
+	unsigned _skip = 0;
+	CompressionStats _stats;
+};
+
+} // namespace vpn
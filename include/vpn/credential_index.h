@@ -0,0 +1,50 @@
+#pragma once
+
+#include "vpn/auth.h"
+#include <Poco/SharedMemory.h>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace vpn {
+
+// Read-only view of a compiled credential file. The file is mapped, not
+// read: opening it checks the header only, and each lookup binary-searches
+// the sorted entry table and decodes the one record it finds. Server
+// processes mapping the same file share its pages in the page cache.
+//
+// Layout, big-endian:
+//   header   "VPNCRED1" [count:4] [reserved:4]
+//   entries  count x [usernameHash:8] [offset:4] [length:4], sorted by hash, then username
+//   records  [nameLen:2] [name] [kdf:1] [cost:8] [saltLen:1] [salt] [hashLen:1] [hash] [plainLen:2] [plain]
+// Offsets are from the start of the record area.
+//
+// A mapped file must be replaced by renaming a new one over it (as
+// writeCredentialIndex does), never rewritten in place.
+class CredentialIndex : public UserTable {
+public:
+	explicit CredentialIndex(const std::string& path);
+
+	// True if the file at path starts with the index magic
+	static bool isIndexFile(const std::string& path);
+
+	const UserRecord* find(const std::string& username, UserRecord& scratch) const override;
+	std::size_t size() const override { return _count; }
+
+private:
+	bool decode(std::uint32_t offset, std::uint32_t length, const std::string& username, UserRecord& record) const;
+
+	Poco::SharedMemory _mapping;
+	const std::uint8_t* _entries = nullptr;
+	const std::uint8_t* _recordsBegin = nullptr;
+	std::size_t _recordsSize = 0;
+	std::size_t _count = 0;
+};
+
+// Writes records as an index to path, through a temporary file renamed over it
+void writeCredentialIndex(const std::vector<UserRecord>& records, const std::string& path);
+
+// Compiles a JSON credential file into an index
+void compileCredentialIndex(const std::string& jsonPath, const std::string& indexPath);
+
+} // namespace vpn
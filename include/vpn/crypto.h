@@ -1,11 +1,33 @@
 #pragma once
 
+#include <Poco/HMACEngine.h>
+#include <Poco/SHA2Engine.h>
+#include "vpn/packet_buffer.h"
 #include <vector>
 #include <string>
+#include <memory>
 #include <cstdint>
 
+struct evp_cipher_ctx_st; // OpenSSL EVP_CIPHER_CTX
+
 namespace vpn {
 
+// Data-plane cipher suites, negotiated during HELLO/HELLO_ACK
+enum class CipherSuite : std::uint8_t {
+	AES_256_CBC_HMAC_SHA256 = 0, // legacy encrypt-then-MAC, fallback for older peers
+	AES_256_GCM = 1,
+	CHACHA20_POLY1305 = 2
+};
+
+const char* cipherSuiteName(CipherSuite suite);
+
+// True if the CPU has AES instructions (AES-NI, ARMv8 AES)
+bool hasAesHardware();
+
+// Locally supported suites in preference order: AES-GCM first when AES is
+// hardware accelerated, ChaCha20-Poly1305 first otherwise, CBC+HMAC last.
+std::vector<CipherSuite> defaultCipherSuites();
+
 struct DerivedKeys {
 	std::vector<std::uint8_t> encKey; // 32 bytes
 	std::vector<std::uint8_t> macKey; // 32 bytes
@@ -22,21 +44,70 @@ DerivedKeys deriveSessionKeys(const std::vector<std::uint8_t>& keySeed,
                               const std::vector<std::uint8_t>& clientNonce,
                               const std::vector<std::uint8_t>& serverNonce);
 
+// Cipher and MAC state is keyed once per session and reused for every
+// packet; only the IV/nonce changes. encrypt() and decrypt() use separate
+// state and may run concurrently, but neither may be called concurrently
+// with itself.
 class SessionCrypto {
 public:
+	// AEAD suites only use encKey; macKey is kept for the CBC+HMAC fallback
 	SessionCrypto(const std::vector<std::uint8_t>& encKey,
-	              const std::vector<std::uint8_t>& macKey);
+	              const std::vector<std::uint8_t>& macKey,
+	              CipherSuite suite = CipherSuite::AES_256_CBC_HMAC_SHA256);
+	~SessionCrypto();
+
+	SessionCrypto(const SessionCrypto&) = delete;
+	SessionCrypto& operator=(const SessionCrypto&) = delete;
 
-	// Encrypt-then-MAC
-	// ciphertext frame format: [ivLen:1][iv][ciphertext][hmac(32)]
+	// ciphertext frame format:
+	//   CBC+HMAC (encrypt-then-MAC): [ivLen:1][iv(16)][ciphertext][hmac(32)]
+	//   AEAD:                        [ivLen:1][nonce(12)][ciphertext][tag(16)]
 	std::vector<std::uint8_t> encrypt(const std::vector<std::uint8_t>& plaintext) const;
 	std::vector<std::uint8_t> decrypt(const std::vector<std::uint8_t>& frame) const;
 
+	// Zero-copy variants. encryptInPlace() turns buf's payload into a cipher
+	// frame, writing [ivLen][iv] into headroom() bytes of the buffer's headroom
+	// and padding/tag/MAC into up to tailroom() bytes behind it.
+	// decryptInPlace() opens a cipher frame, e.g. a view into a receive
+	// buffer, and returns the plaintext as a view into the same memory.
+	void encryptInPlace(PacketBuffer& buf) const;
+	ByteView decryptInPlace(ByteView frame) const;
+	std::size_t headroom() const;
+	std::size_t tailroom() const;
+
+	// Batch variants for bursts: one RNG draw covers every IV/nonce, and the
+	// per-packet loop stays on already-keyed contexts. encryptBatch() encrypts
+	// each buffer in place; decryptBatch() replaces each frame view with its
+	// plaintext view and throws on the first frame that fails verification.
+	void encryptBatch(std::vector<PacketBuffer>& bufs) const;
+	void decryptBatch(std::vector<ByteView>& frames) const;
+
+	CipherSuite suite() const { return _suite; }
+
 private:
-	std::vector<std::uint8_t> _encKey;
-	std::vector<std::uint8_t> _macKey;
-};
+	struct CipherCtxDeleter {
+		void operator()(evp_cipher_ctx_st* ctx) const;
+	};
+	using CipherCtxPtr = std::unique_ptr<evp_cipher_ctx_st, CipherCtxDeleter>;
 
-} // namespace vpn
+	// seal: frame receives the cipher frame, plain may alias frame + headroom().
+	// open: plainOut receives the plaintext, may alias frame + headroom().
+	// Both return the number of bytes written. sealWithIv() expects [ivLen][iv]
+	// already in place at frame; seal() generates them.
+	std::size_t seal(const std::uint8_t* plain, std::size_t plainLen, std::uint8_t* frame) const;
+	std::size_t sealWithIv(const std::uint8_t* plain, std::size_t plainLen, std::uint8_t* frame) const;
+	std::size_t open(const std::uint8_t* frame, std::size_t frameLen, std::uint8_t* plainOut) const;
+	std::size_t sealCbcHmac(const std::uint8_t* plain, std::size_t plainLen, std::uint8_t* frame) const;
+	std::size_t openCbcHmac(const std::uint8_t* frame, std::size_t frameLen, std::uint8_t* plainOut) const;
+	std::size_t sealAead(const std::uint8_t* plain, std::size_t plainLen, std::uint8_t* frame) const;
+	std::size_t openAead(const std::uint8_t* frame, std::size_t frameLen, std::uint8_t* plainOut) const;
 
+	CipherSuite _suite;
+	mutable CipherCtxPtr _encCtx;
+	mutable CipherCtxPtr _decCtx;
+	mutable Poco::HMACEngine<Poco::SHA2Engine> _encMac;
+	mutable Poco::HMACEngine<Poco::SHA2Engine> _decMac;
+	mutable std::vector<std::uint8_t> _batchIvs;
+};
 
+} // namespace vpn
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Poco/NotificationQueue.h>
+#include <Poco/Thread.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <atomic>
+
+namespace vpn {
+
+// Fixed set of threads for expensive password hashing. Jobs beyond
+// maxQueued are refused rather than queued, so a login storm is turned
+// away early instead of waiting behind minutes of key derivation.
+class KdfPool {
+public:
+	using Job = std::function<void()>;
+
+	KdfPool(unsigned threads, std::size_t maxQueued);
+	~KdfPool(); // runs the jobs already queued, then joins
+
+	KdfPool(const KdfPool&) = delete;
+	KdfPool& operator=(const KdfPool&) = delete;
+
+	// Queues job to run on a pool thread; false, without running it, when the
+	// queue is full. Jobs report their own failures: one that throws is a bug
+	// and terminates the process.
+	bool trySubmit(Job job);
+	std::size_t queued() const { return _queued; }
+
+private:
+	void run();
+
+	Poco::NotificationQueue _queue;
+	std::vector<std::unique_ptr<Poco::Thread>> _threads;
+	const std::size_t _maxQueued;
+	std::atomic<std::size_t> _queued{0};
+};
+
+} // namespace vpn
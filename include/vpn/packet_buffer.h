@@ -0,0 +1,63 @@
+#pragma once
+
+#include "vpn/buffer_pool.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace vpn {
+
+// Non-owning view into memory owned elsewhere
+struct ByteView {
+	std::uint8_t* data = nullptr;
+	std::size_t size = 0;
+};
+
+// Contiguous packet buffer with headroom in front of the payload and tailroom
+// behind it, so frame headers, IVs and MACs can be added around a payload
+// without moving it. Reusing a buffer via reset() does not allocate.
+// Storage is a reference-counted BufferBlock, taken from a BufferPool when one
+// is given; copies are deep, moves hand the block over.
+class PacketBuffer {
+public:
+	PacketBuffer() = default;
+	PacketBuffer(std::size_t headroom, std::size_t capacity, std::size_t tailroom = 0);
+	PacketBuffer(BufferPool& pool, std::size_t headroom, std::size_t capacity, std::size_t tailroom = 0);
+	PacketBuffer(const PacketBuffer& other);
+	PacketBuffer& operator=(const PacketBuffer& other);
+	PacketBuffer(PacketBuffer&& other) noexcept;
+	PacketBuffer& operator=(PacketBuffer&& other) noexcept;
+
+	std::uint8_t* data() { return storage() + _offset; }
+	const std::uint8_t* data() const { return storage() + _offset; }
+	std::size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+	std::size_t headroom() const { return _offset; }
+	std::size_t tailroom() const { return capacity() - _offset - _size; }
+	ByteView view() { return ByteView{data(), _size}; }
+
+	// Empty the payload and place its start headroom bytes into the storage
+	void reset(std::size_t headroom);
+	// Grow the payload n bytes to the front, into the headroom; returns the new start
+	std::uint8_t* push(std::size_t n);
+	// Drop n bytes from the front of the payload
+	void pull(std::size_t n);
+	// Grow the payload n bytes at the end; returns the start of the new region.
+	// Reallocates (invalidating pointers) only when the tailroom is too small.
+	std::uint8_t* put(std::size_t n);
+	// Shrink the payload to len bytes
+	void trim(std::size_t len);
+	// Replace the payload with a copy of [p, p + len)
+	void assign(const std::uint8_t* p, std::size_t len);
+
+private:
+	std::uint8_t* storage() const { return _block ? _block->data() : nullptr; }
+	std::size_t capacity() const { return _block ? _block->capacity() : 0; }
+	void grow(std::size_t capacity);
+
+	BufferBlock::Ptr _block;
+	std::size_t _offset = 0;
+	std::size_t _size = 0;
+};
+
+} // namespace vpn
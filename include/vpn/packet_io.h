@@ -0,0 +1,96 @@
+#pragma once
+
+#include "vpn/packet_buffer.h"
+#include <Poco/Mutex.h>
+#include <Poco/Event.h>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace vpn {
+
+// Source and sink of the IP packets a VpnClient tunnels: a TUN device, or
+// MemoryPacketIO in tests. read() and wakeUp() are called from one reader
+// thread and its owner, write() from the client's I/O thread.
+class PacketIO {
+public:
+	virtual ~PacketIO() = default;
+
+	// Fills packets with what is ready, at most packets.size(), after waiting
+	// up to timeout for the first one. Each buffer keeps its headroom and gets
+	// one packet of up to mtu() bytes as its payload. Returns the count; 0 on
+	// timeout or wakeUp().
+	virtual std::size_t read(std::vector<PacketBuffer>& packets, std::chrono::milliseconds timeout) = 0;
+	virtual void write(ByteView packet) = 0;
+	// Makes a waiting read() return
+	virtual void wakeUp() = 0;
+	virtual std::size_t mtu() const = 0;
+};
+
+// Packets in memory: inject() plays what local applications send, which
+// read() returns; what the tunnel writes is kept for takeWritten()
+class MemoryPacketIO : public PacketIO {
+public:
+	explicit MemoryPacketIO(std::size_t mtu = 1500);
+
+	std::size_t read(std::vector<PacketBuffer>& packets, std::chrono::milliseconds timeout) override;
+	void write(ByteView packet) override;
+	void wakeUp() override;
+	std::size_t mtu() const override { return _mtu; }
+
+	void inject(std::vector<std::uint8_t> packet);
+	// The packets written so far, after waiting up to timeout for count of them
+	std::vector<std::vector<std::uint8_t>> takeWritten(std::size_t count, std::chrono::milliseconds timeout);
+
+private:
+	const std::size_t _mtu;
+	Poco::FastMutex _mutex;
+	std::deque<std::vector<std::uint8_t>> _inbound;
+	std::vector<std::vector<std::uint8_t>> _written;
+	bool _woken = false;
+	Poco::Event _readable;
+	Poco::Event _writtenReady;
+};
+
+#if defined(__linux__)
+
+// A Linux TUN interface (/dev/net/tun, IFF_TUN | IFF_NO_PI): raw IP packets
+// without a link header. Reads are non-blocking and drain every packet that
+// is ready, up to the batch, per wakeup.
+// With multiQueue each TunDevice of the same name is one queue of the
+// interface, so several readers (e.g. one client connection each) can share
+// it; kernels without IFF_MULTI_QUEUE fall back to a single queue.
+// Opening a device needs CAP_NET_ADMIN.
+class TunDevice : public PacketIO {
+public:
+	// An empty name lets the kernel pick one, like "tun0"
+	explicit TunDevice(const std::string& name = "", bool multiQueue = false, std::size_t mtu = 1500);
+	~TunDevice();
+
+	TunDevice(const TunDevice&) = delete;
+	TunDevice& operator=(const TunDevice&) = delete;
+
+	std::size_t read(std::vector<PacketBuffer>& packets, std::chrono::milliseconds timeout) override;
+	void write(ByteView packet) override;
+	void wakeUp() override;
+	std::size_t mtu() const override { return _mtu; }
+
+	const std::string& name() const { return _name; }
+	bool multiQueue() const { return _multiQueue; }
+	// Sets the interface MTU, adds addresses like VpnClient::virtualAddresses()
+	// ("10.8.0.2/24", "fd00::2/64") and brings the interface up
+	void configure(const std::vector<std::string>& addresses);
+
+private:
+	int _fd = -1;
+	int _wakeFd = -1; // eventfd behind wakeUp()
+	std::string _name;
+	bool _multiQueue = false;
+	std::size_t _mtu;
+};
+
+#endif
+
+} // namespace vpn
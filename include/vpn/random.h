@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace vpn {
+
+// Cryptographically secure random bytes from a per-thread ChaCha20 DRBG.
+// Each thread seeds once from the OS, then serves requests from a keystream
+// buffer, so IVs and nonces do not cost a syscall. The key is replaced on
+// every refill (fast key erasure), and OS entropy is mixed in again every
+// kRandomReseedInterval bytes and in the child after fork().
+const std::size_t kRandomReseedInterval = 1024 * 1024;
+
+void secureRandom(std::uint8_t* out, std::size_t len);
+std::vector<std::uint8_t> secureRandomBytes(std::size_t len);
+
+// Random (version 4) UUID string, used for session IDs
+std::string randomSessionId();
+
+} // namespace vpn
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "vpn/session_registry.h"
+#include <Poco/Mutex.h>
+#include <Poco/Net/IPAddress.h>
+#include <array>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <cstdint>
+
+namespace vpn {
+
+// Longest-prefix match from IPv4 and IPv6 destinations to sessions. Each
+// family is a trie with 8-bit strides: an IPv4 lookup reads at most four
+// 256-slot nodes, a route covering part of a stride fills every slot it
+// covers. A change copies only the nodes on its path into a new snapshot
+// and publishes it; lookups run on the calling thread's cached snapshot
+// and take no lock unless the table changed since that thread's last one.
+// The cache is weak, so an idle thread keeps no removed session alive.
+class RoutingTable {
+public:
+	RoutingTable();
+	~RoutingTable();
+
+	RoutingTable(const RoutingTable&) = delete;
+	RoutingTable& operator=(const RoutingTable&) = delete;
+
+	// Routes prefix/length to target, replacing a route for the same prefix
+	void add(const Poco::Net::IPAddress& prefix, unsigned length, SessionRegistry::EntryPtr target);
+	// False if there was no route for exactly this prefix
+	bool remove(const Poco::Net::IPAddress& prefix, unsigned length);
+
+	// The session of the most specific route covering a 4-byte (IPv4) or
+	// 16-byte (IPv6) address, or nullptr
+	SessionRegistry::EntryPtr lookup(const std::uint8_t* address, bool v6) const;
+	std::size_t size() const;
+	std::uint64_t version() const { return _version; } // bumped by every change
+
+private:
+	struct Node;
+	struct Snapshot;
+	using Bytes = std::array<std::uint8_t, 16>;
+	using RouteKey = std::tuple<bool, Bytes, unsigned>; // v6, prefix masked to length, length
+	struct Route {
+		SessionRegistry::EntryPtr target;
+		unsigned length = 0;
+	};
+
+	static RouteKey routeKey(const Poco::Net::IPAddress& prefix, unsigned length);
+	Route coveringRoute(bool v6, const Bytes& address, unsigned longest, unsigned shortest) const;
+	void update(const RouteKey& key);
+	std::shared_ptr<const Snapshot> snapshot() const;
+
+	const std::uint64_t _id; // tells tables apart in the per-thread snapshot cache
+	mutable Poco::FastMutex _writeMutex; // serializes changes; guards _routes
+	std::map<RouteKey, SessionRegistry::EntryPtr> _routes;
+	mutable Poco::FastMutex _mutex; // guards _snapshot
+	std::shared_ptr<const Snapshot> _snapshot;
+	std::atomic<std::uint64_t> _version{0};
+};
+
+struct ForwardStats {
+	std::uint64_t malformed = 0;   // not an IPv4 or IPv6 packet
+	std::uint64_t spoofed = 0;     // source is not an address of the sending session
+	std::uint64_t unroutable = 0;  // no route for the destination
+	std::uint64_t queueFull = 0;   // the target session had kMaxDelivered packets waiting
+};
+
+// The server's virtual network: every authenticated session gets an
+// address from each configured pool, routed to it, and IP packets it sends
+// are forwarded to the session owning their destination.
+class VirtualNetwork {
+public:
+	using Ptr = std::shared_ptr<VirtualNetwork>;
+
+	// Networks like "10.8.0.0/24" and "fd00:8::/112"; either may be empty.
+	// The first address of each (.1) is left for the server.
+	VirtualNetwork(const std::string& network4, const std::string& network6);
+	~VirtualNetwork();
+
+	VirtualNetwork(const VirtualNetwork&) = delete;
+	VirtualNetwork& operator=(const VirtualNetwork&) = delete;
+
+	// Gives entry its addresses and routes them to it; call before the entry
+	// is shared. Throws if a pool is exhausted.
+	void attach(const SessionRegistry::EntryPtr& entry);
+	// Removes the entry's routes and returns its addresses to the pools
+	void detach(const SessionEntry& entry);
+
+	// Hands one IP packet sent by source to the session owning its
+	// destination; false if it was dropped (see ForwardStats)
+	bool forward(const SessionEntry& source, ByteView packet);
+	ForwardStats stats() const;
+	RoutingTable& routes() { return _routes; }
+
+private:
+	class AddressPool;
+
+	std::unique_ptr<AddressPool> _pool4;
+	std::unique_ptr<AddressPool> _pool6;
+	RoutingTable _routes;
+	std::atomic<std::uint64_t> _malformed{0};
+	std::atomic<std::uint64_t> _spoofed{0};
+	std::atomic<std::uint64_t> _unroutable{0};
+	std::atomic<std::uint64_t> _queueFull{0};
+};
+
+} // namespace vpn
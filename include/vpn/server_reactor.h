@@ -0,0 +1,81 @@
+#pragma once
+
+#include "vpn/vpn_server.h"
+#include "vpn/session_registry.h"
+#include "vpn/routing.h"
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/Thread.h>
+#include <Poco/Event.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace vpn {
+
+// Event-driven server for many mostly idle sessions, in two stages. New
+// connections go to a few handshake workers that step them through the TLS
+// handshake, HELLO and AUTH; authenticated sessions move on to the data
+// workers, which only carry traffic, so a burst of handshakes cannot delay
+// established sessions. Every worker polls its non-blocking sockets and
+// steps each connection as data arrives: an idle session holds no thread
+// and, after a second, no receive or write buffers.
+// Connections come from an acceptor thread, or, given several listeners,
+// each data worker owns one and accepts its own; its sessions come back to
+// it after the handshake.
+class ServerReactor {
+public:
+	static const std::size_t kMaxWriteBacklog = 1024 * 1024; // stop reading from a peer that does not drain its replies
+
+	// reactorThreadCount(config) data workers fed by one acceptor thread
+	ServerReactor(const Poco::Net::ServerSocket& socket, CredentialStore::Ptr store, const ServerConfig& config,
+	              SessionRegistry::Ptr sessions = nullptr, VirtualNetwork::Ptr network = nullptr);
+	// One data worker per listener, e.g. SO_REUSEPORT shards of one address
+	ServerReactor(const std::vector<Poco::Net::ServerSocket>& listeners, CredentialStore::Ptr store, const ServerConfig& config,
+	              SessionRegistry::Ptr sessions = nullptr, VirtualNetwork::Ptr network = nullptr);
+	~ServerReactor();
+
+	ServerReactor(const ServerReactor&) = delete;
+	ServerReactor& operator=(const ServerReactor&) = delete;
+
+	void start();
+	void stop(); // closes every connection
+	std::size_t connectionCount() const; // in either stage
+	std::size_t handshakeCount() const { return _handshaking; } // admitted, not yet authenticated
+
+private:
+	class Worker;
+	struct Connection;
+
+	void createHandshakers();
+	void acceptLoop();
+	// Admission to the handshake stage, at most ServerConfig::maxPendingHandshakes at a time
+	bool tryAdmit();
+	void releaseAdmission();
+	bool admitting() const { return _handshaking < _config.maxPendingHandshakes; }
+	// Hand-offs between the stages; called with an admission slot held
+	void beginHandshake(Poco::Net::StreamSocket& socket, Worker* home);
+	void beginData(std::unique_ptr<Connection> connection);
+
+	Poco::Net::ServerSocket _socket;
+	CredentialStore::Ptr _store;
+	SessionRegistry::Ptr _sessions;
+	VirtualNetwork::Ptr _network;
+	ServerConfig _config;
+	std::vector<std::unique_ptr<Worker>> _workers; // data plane
+	std::vector<std::unique_ptr<Worker>> _handshakers;
+	Poco::Thread _acceptor;
+	std::atomic<bool> _stopping{false};
+	bool _running = false;
+	bool _sharded = false; // data workers accept for themselves
+	std::atomic<unsigned> _handshaking{0};
+	std::atomic<std::size_t> _nextHandshaker{0};
+	std::atomic<std::size_t> _nextWorker{0};
+	Poco::Event _slotFree; // set when the handshake stage stops being full
+};
+
+// ServerConfig::reactorThreads, or the number of cores when it is 0
+unsigned reactorThreadCount(const ServerConfig& config);
+// ServerConfig::handshakeThreads, or half the cores when it is 0
+unsigned handshakeThreadCount(const ServerConfig& config);
+
+} // namespace vpn
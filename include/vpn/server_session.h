@@ -0,0 +1,96 @@
+#pragma once
+
+#include "vpn/vpn_server.h"
+#include "vpn/tunnel.h"
+#include "vpn/stream_mux.h"
+#include "vpn/crypto.h"
+#include "vpn/compression.h"
+#include "vpn/auth.h"
+#include "vpn/session_registry.h"
+#include "vpn/routing.h"
+#include <memory>
+#include <string>
+#include <chrono>
+#include <functional>
+
+namespace vpn {
+
+// Server side of one VPN session, driven by received frames: HELLO, then
+// AUTH, then data. It never waits on the socket itself, so the same state
+// machine serves a thread per connection and the reactor's worker threads.
+// Passwords are checked on the credential store's KDF pool; while that runs
+// (waiting()) the driver feeds no frames and calls resume() once woken.
+// Authenticated sessions are listed in the server's SessionRegistry, through
+// which they can be asked to close; the driver then sees false from
+// handleFrame(), resume() or expire(). With a VirtualNetwork, a session gets
+// virtual addresses and its packets are forwarded to the sessions they are
+// addressed to instead of echoed; packets forwarded to it wake the driver,
+// and resume() sends them.
+class ServerSession {
+public:
+	enum class State { HELLO, AUTH, VERIFYING, DATA, CLOSED };
+
+	static constexpr std::chrono::milliseconds kHelloTimeout{5000};
+	static constexpr std::chrono::milliseconds kAuthTimeout{10000};
+
+	// Configures the tunnel's handshake options and coalescing; config must outlive the session
+	ServerSession(Tunnel& tunnel, CredentialStore::Ptr store, const ServerConfig& config,
+	              SessionRegistry::Ptr registry = nullptr, VirtualNetwork::Ptr network = nullptr);
+	~ServerSession();
+
+	ServerSession(const ServerSession&) = delete;
+	ServerSession& operator=(const ServerSession&) = delete;
+
+	// Applies one received frame and queues any reply; returns false once the
+	// session is over. Throws on protocol violations.
+	bool handleFrame(const FrameView& frame);
+	// Ends a session that is still in HELLO or AUTH after its deadline, or
+	// was asked to close; returns whether it did
+	bool expire(std::chrono::steady_clock::time_point now);
+
+	// Called on another thread when a password check finishes or the session
+	// is asked to close; set before the first frame, and again by a new driver
+	void setWakeup(std::function<void()> wakeup);
+	bool waiting() const { return _state == State::VERIFYING; }
+	// Applies a finished password check, if any, and sends packets forwarded
+	// to the session; returns false once the session is over
+	bool resume();
+
+	State state() const { return _state; }
+	const std::string& sessionId() const { return _serverSessionId; }
+	// The registry's entry for this session, once authenticated
+	const SessionRegistry::EntryPtr& entry() const { return _entry; }
+
+private:
+	struct PendingVerify;
+
+	void handleHello(const FrameView& frame);
+	bool handleAuth(const FrameView& frame);
+	bool handleData(const FrameView& frame);
+	void reject(const std::string& message);
+	void registerSession();
+	bool closeRequested();
+	void sendPacket(ByteView plain, bool encrypted);
+	void sendPacket(PacketBuffer& buffer, bool encrypted);
+	void sendDelivered();
+	static ByteView decompress(PayloadCompressor* compressor, ByteView payload);
+
+	Tunnel& _tunnel;
+	CredentialStore::Ptr _store;
+	const ServerConfig& _config;
+	SessionRegistry::Ptr _registry;
+	VirtualNetwork::Ptr _network;
+	SessionRegistry::EntryPtr _entry; // created once authenticated
+	State _state = State::HELLO;
+	std::chrono::steady_clock::time_point _deadline; // for the current HELLO or AUTH phase
+	std::string _serverSessionId;
+	std::shared_ptr<SessionCrypto> _crypto; // shared with the registry entry
+	std::unique_ptr<PayloadCompressor> _compressor;
+	std::unique_ptr<StreamMux> _streams; // created by the first stream frame
+	std::function<void()> _wakeup;
+	std::shared_ptr<PendingVerify> _pending; // shared with the KDF job
+	std::string _username;
+	bool _tlsOnlyData = false;
+};
+
+} // namespace vpn
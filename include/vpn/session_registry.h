@@ -0,0 +1,124 @@
+#pragma once
+
+#include "vpn/crypto.h"
+#include "vpn/tunnel.h"
+#include <Poco/Mutex.h>
+#include <Poco/Net/IPAddress.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+namespace vpn {
+
+// An address given to a session on the server's virtual network
+struct VirtualAddress {
+	Poco::Net::IPAddress address;
+	unsigned prefixLength = 0; // of the network it belongs to
+};
+
+// One authenticated session as seen from outside the thread that drives it.
+// The driver publishes its counters; anyone holding the entry may read them
+// or ask the session to close.
+class SessionEntry {
+public:
+	SessionEntry(std::string sessionId, std::string username, std::shared_ptr<SessionCrypto> crypto);
+
+	const std::string& sessionId() const { return _sessionId; }
+	const std::string& username() const { return _username; }
+	std::chrono::system_clock::time_point established() const { return _established; }
+	// Keys of the session, for resumption and rekeying; only the session's
+	// driver may use them while it runs
+	const std::shared_ptr<SessionCrypto>& crypto() const { return _crypto; }
+
+	// Wire counters as of the session's last frame
+	TunnelStats stats() const;
+	void publish(const TunnelStats& stats);
+
+	// Makes the session send CLOSE and end, from any thread; its driver
+	// notices at its next wakeup
+	void requestClose();
+	bool closeRequested() const { return _closeRequested.load(std::memory_order_acquire); }
+	// Set by the driver while the session runs; cleared before it goes away
+	void setWakeup(std::function<void()> wakeup);
+
+	// Assigned by VirtualNetwork::attach() before the entry is shared
+	const std::vector<VirtualAddress>& virtualAddresses() const { return _virtualAddresses; }
+	void setVirtualAddresses(std::vector<VirtualAddress> addresses) { _virtualAddresses = std::move(addresses); }
+	// Whether the 4- or 16-byte address is one of this session's
+	bool ownsAddress(const std::uint8_t* address, bool v6) const;
+
+	// Queues a packet routed here from another session and wakes the driver;
+	// false, dropping it, once kMaxDelivered are waiting. The packet is copied
+	// once, into a block from the calling thread's pool with room for the
+	// frame header and this session's cipher around it.
+	bool deliver(ByteView packet);
+	// Moves the queued packets onto the end of out; for the driver, which
+	// may frame and encrypt them in place
+	void takeDelivered(std::vector<PacketBuffer>& out);
+	bool hasDelivered() const { return _deliveredCount.load(std::memory_order_acquire) > 0; }
+
+	static const std::size_t kMaxDelivered = 256;
+
+private:
+	const std::string _sessionId;
+	const std::string _username;
+	const std::chrono::system_clock::time_point _established;
+	const std::shared_ptr<SessionCrypto> _crypto;
+	std::atomic<std::uint64_t> _framesSent{0};
+	std::atomic<std::uint64_t> _framesReceived{0};
+	std::atomic<std::uint64_t> _bytesSent{0};
+	std::atomic<std::uint64_t> _bytesReceived{0};
+	std::atomic<bool> _closeRequested{false};
+	Poco::FastMutex _wakeupMutex;
+	std::function<void()> _wakeup;
+	std::vector<VirtualAddress> _virtualAddresses;
+	Poco::FastMutex _deliveredMutex;
+	std::vector<PacketBuffer> _delivered;
+	std::atomic<std::size_t> _deliveredCount{0};
+};
+
+// Server-wide table of authenticated sessions, by session ID and by user.
+// Both indexes are split over shards with a lock each, picked by key hash,
+// so lookups from many threads rarely meet on a lock and no call holds more
+// than one.
+class SessionRegistry {
+public:
+	using Ptr = std::shared_ptr<SessionRegistry>;
+	using EntryPtr = std::shared_ptr<SessionEntry>;
+
+	static const std::size_t kDefaultShards = 64;
+
+	explicit SessionRegistry(std::size_t shards = kDefaultShards);
+	~SessionRegistry();
+
+	SessionRegistry(const SessionRegistry&) = delete;
+	SessionRegistry& operator=(const SessionRegistry&) = delete;
+
+	// False, without adding it, if the session ID is taken
+	bool add(const EntryPtr& entry);
+	void remove(const SessionEntry& entry);
+
+	EntryPtr find(const std::string& sessionId) const;
+	std::vector<EntryPtr> findByUser(const std::string& username) const;
+	std::size_t sessionsOfUser(const std::string& username) const;
+	std::size_t size() const { return _size.load(std::memory_order_relaxed); }
+	// Calls fn for every session, one shard locked at a time; fn must not
+	// call back into the registry
+	void forEach(const std::function<void(const EntryPtr&)>& fn) const;
+
+private:
+	struct Shard;
+
+	Shard& shardOf(const std::string& key) const;
+
+	const std::size_t _shardCount;
+	std::unique_ptr<Shard[]> _shards;
+	std::atomic<std::size_t> _size{0};
+};
+
+} // namespace vpn
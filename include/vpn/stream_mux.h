@@ -0,0 +1,89 @@
+#pragma once
+
+#include "vpn/tunnel.h"
+#include "vpn/crypto.h"
+#include "vpn/packet_buffer.h"
+#include <map>
+#include <vector>
+#include <cstdint>
+
+namespace vpn {
+
+// Independent byte streams over one tunnel, carried in STREAM_* frames:
+//   STREAM_OPEN           [streamId:4]
+//   STREAM_DATA           [streamId:4][sealed data]  (plain in TLS-only mode)
+//   STREAM_CLOSE          [streamId:4]               (half-close: no more data from the sender)
+//   STREAM_WINDOW_UPDATE  [streamId:4][increment:4]
+// Flow control is credit based per stream and direction: a sender starts with
+// kInitialWindow bytes of credit and the receiver returns credit as the
+// application reads. Writes are queued per stream and sent round-robin one
+// chunk at a time, so a bulk transfer cannot hold back an interactive stream.
+class StreamMux {
+public:
+	static const std::uint32_t kInitialWindow = 64 * 1024;  // credit every new stream starts with
+	static const std::uint32_t kDefaultWindow = 256 * 1024; // receive window we grant per stream
+	static const std::size_t kMaxChunk = 16 * 1024;         // largest STREAM_DATA payload
+	static const std::size_t kDefaultMaxStreams = 64;       // peer-opened streams open at once
+
+	// crypto is null when data is TLS-only. The initiator (client) uses odd
+	// stream ids, the other side even ones. window must be >= kInitialWindow.
+	// A STREAM_OPEN beyond maxStreams open peer streams is a protocol error.
+	StreamMux(Tunnel& tunnel, const SessionCrypto* crypto, bool initiator, std::uint32_t window = kDefaultWindow,
+	          std::size_t maxStreams = kDefaultMaxStreams);
+
+	static bool isStreamFrame(FrameType type);
+
+	std::uint32_t open();
+	// Applies a STREAM_* frame and returns its stream id; throws on protocol violations
+	std::uint32_t handleFrame(const FrameView& frame);
+
+	// Queues data on the stream and sends what the stream's credit allows
+	void write(std::uint32_t id, const std::uint8_t* data, std::size_t len);
+	// Copies up to max received bytes out; returns credit to the peer as it goes
+	std::size_t read(std::uint32_t id, std::uint8_t* out, std::size_t max);
+	// Half-closes the stream once its queued data has been sent
+	void close(std::uint32_t id);
+	// Sends queued data as credit allows, one chunk per stream per round
+	void pump();
+
+	bool exists(std::uint32_t id) const;
+	std::size_t readable(std::uint32_t id) const;
+	std::size_t pending(std::uint32_t id) const;     // queued, not yet sent
+	std::size_t sendCredit(std::uint32_t id) const;
+	bool remoteClosed(std::uint32_t id) const;       // peer sent STREAM_CLOSE
+	// Streams the peer opened since the last call
+	std::vector<std::uint32_t> acceptStreams();
+
+private:
+	struct Stream {
+		std::uint32_t sendCredit = kInitialWindow;
+		std::uint32_t recvWindow = kInitialWindow; // bytes the peer may still send
+		std::uint32_t consumed = 0;                // read since the last window update
+		std::vector<std::uint8_t> rx;
+		std::size_t rxOffset = 0;
+		std::vector<std::uint8_t> tx;
+		std::size_t txOffset = 0;
+		bool closePending = false;
+		bool localClosed = false;
+		bool remoteClosed = false;
+	};
+
+	Stream& stream(std::uint32_t id);
+	const Stream* find(std::uint32_t id) const;
+	void sendControl(FrameType type, std::uint32_t id, const std::uint32_t* value);
+	bool sendChunk(std::uint32_t id, Stream& s);
+	void grantCredit(std::uint32_t id, Stream& s, std::uint32_t increment);
+	void retireIfDone(std::uint32_t id);
+
+	Tunnel& _tunnel;
+	const SessionCrypto* _crypto;
+	std::uint32_t _window;
+	std::size_t _maxStreams;
+	std::uint32_t _nextId;
+	std::map<std::uint32_t, Stream> _streams;
+	std::vector<std::uint32_t> _accepted;
+	PacketBuffer _txChunk; // reused for every STREAM_DATA frame
+	PacketBuffer _control; // reused for control frames
+};
+
+} // namespace vpn
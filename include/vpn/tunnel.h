@@ -1,7 +1,10 @@
 #pragma once
 
-#include <Poco/Net/SecureStreamSocket.h>
+#include <Poco/Net/StreamSocket.h>
 #include <Poco/Types.h>
+#include "vpn/crypto.h"
+#include "vpn/compression.h"
+#include "vpn/packet_buffer.h"
 #include <vector>
 #include <string>
 #include <cstdint>
@@ -17,7 +20,12 @@ enum class FrameType : std::uint8_t {
 	CLOSE = 5,
 	ENCRYPTED_DATA = 6,
 	AUTH = 7,
-	AUTH_RESULT = 8
+	AUTH_RESULT = 8,
+	// Multiplexed streams, see StreamMux
+	STREAM_OPEN = 9,
+	STREAM_DATA = 10,
+	STREAM_CLOSE = 11,
+	STREAM_WINDOW_UPDATE = 12
 };
 
 struct Frame {
@@ -25,13 +33,96 @@ struct Frame {
 	std::vector<std::uint8_t> payload;
 };
 
+// Set in the type byte of DATA/ENCRYPTED_DATA frames whose plaintext is compressed
+static const std::uint8_t kCompressedFlag = 0x80;
+// Set on every fragment of a message except the last; see HelloExtension::MAX_FRAME_SIZE
+static const std::uint8_t kMoreFragmentsFlag = 0x40;
+
+// Frame size limits (len field: type byte plus payload). The default lets a
+// frame and its length prefix fit one pooled receive block.
+static const std::size_t kDefaultMaxFrameLen = BufferPool::kBulkBlockSize - 4;
+static const std::size_t kMinMaxFrameLen = 1024;           // smallest limit a peer may announce
+static const std::size_t kDefaultMaxMessageLen = 1024 * 1024; // largest reassembled payload
+
+// Frame whose payload points into the tunnel's receive buffer, or into its
+// reassembly buffer for fragmented messages; valid until the next receive
+struct FrameView {
+	FrameType type; // flags stripped
+	ByteView payload;
+	bool compressed = false;
+};
+
+// Optional HELLO/HELLO_ACK fields, appended after the fixed part as [type:1][len:1][value]
+enum class HelloExtension : std::uint8_t {
+	CIPHER_SUITES = 1, // HELLO: offered suites in preference order; HELLO_ACK: selected suite
+	TLS_ONLY_DATA = 2, // empty; HELLO: client accepts plain DATA frames; HELLO_ACK: server enables them
+	COMPRESSION = 3,   // HELLO: offered codecs in preference order; HELLO_ACK: selected codec
+	// [maxFrameLen:4][maxMessageLen:4]: the largest frame and reassembled message
+	// the sender accepts. Both sides announce their own; a peer that announced
+	// limits gets larger messages split into kMoreFragmentsFlag fragments.
+	MAX_FRAME_SIZE = 4
+};
+
+// Local handshake policy: what the client offers, or what the server accepts
+struct HandshakeOptions {
+	std::vector<CipherSuite> cipherSuites = defaultCipherSuites(); // preference order
+	// Carry data as plain DATA frames protected only by TLS. Client: accept if
+	// the server asks. Server: ask when the client accepts. Auth stays encrypted.
+	bool tlsOnlyData = false;
+	// Payload compression. Client: codecs to offer; server: codecs it accepts. Empty disables it.
+	std::vector<CompressionCodec> compression;
+	// Receive limits, announced to the peer and enforced on every frame (also
+	// before the handshake). maxMessageLen bounds fragment reassembly memory.
+	std::size_t maxFrameLen = kDefaultMaxFrameLen;
+	std::size_t maxMessageLen = kDefaultMaxMessageLen;
+};
+
+// Small-frame coalescing: frames collect in a write queue that is flushed when
+// it reaches flushBytes, when the oldest queued frame is maxDelay old (checked
+// on each send and by flushIfDue()), on flush(), and before any blocking receive.
+struct CoalescingOptions {
+	std::size_t flushBytes = 0; // 0 disables coalescing: every frame is written at once
+	std::chrono::microseconds maxDelay{200};
+};
+
+// Wire counters of one tunnel, kept for its lifetime; fragments count as frames
+struct TunnelStats {
+	std::uint64_t framesSent = 0;
+	std::uint64_t framesReceived = 0;
+	std::uint64_t bytesSent = 0;     // including frame headers
+	std::uint64_t bytesReceived = 0;
+	std::uint64_t writes = 0;        // socket writes
+	std::uint64_t reads = 0;         // socket reads that returned data
+};
+
+// Outcome of the HELLO/HELLO_ACK exchange. Peers that send no extensions get the legacy defaults.
+struct HandshakeResult {
+	CipherSuite cipherSuite = CipherSuite::AES_256_CBC_HMAC_SHA256;
+	bool tlsOnlyData = false;
+	CompressionCodec compression = CompressionCodec::NONE;
+	// The peer's receive limits; 0 if it announced none (whole frames up to Tunnel::kMaxFrameLen)
+	std::size_t peerMaxFrameLen = 0;
+	std::size_t peerMaxMessageLen = 0;
+};
+
 class Tunnel {
 public:
-	explicit Tunnel(Poco::Net::SecureStreamSocket& socket);
+	static const std::size_t kFrameHeaderLen = 5; // [len:4][type:1]
+	static const std::size_t kReceiveBufferSize = BufferPool::kBulkBlockSize; // grows for larger frames
+	static const std::size_t kMaxFrameLen = 16 * 1024 * 1024; // cap on any limit, local or announced
+	static const std::size_t kTlsRecordSize = 16 * 1024; // max TLS record plaintext
+
+	// Any stream socket works; in production this is a SecureStreamSocket
+	explicit Tunnel(Poco::Net::StreamSocket& socket);
+	~Tunnel(); // flushes queued frames, ignoring errors
 
 	// Handshake (extended):
-	// Client sends HELLO: [idLen:1][id][clientNonce:16]
-	// Server replies HELLO_ACK: [idLen:1][id][serverNonce:16][keySeed:32]
+	// Client sends HELLO: [idLen:1][id][clientNonce:16][extensions]
+	// Server replies HELLO_ACK: [idLen:1][id][serverNonce:16][keySeed:32][extensions]
+	// Throws std::invalid_argument for frame limits outside [kMinMaxFrameLen, kMaxFrameLen]
+	// or a message limit below the largest single-frame payload
+	void setHandshakeOptions(const HandshakeOptions& options);
+	const HandshakeResult& handshakeResult() const { return _handshakeResult; }
 	void clientHandshake(const std::string& clientSessionId,
 	                     std::vector<std::uint8_t>& outClientNonce,
 	                     std::string& outServerSessionId,
@@ -42,6 +133,13 @@ public:
 	                     std::vector<std::uint8_t>& outClientNonce,
 	                     std::vector<std::uint8_t>& outServerNonce,
 	                     std::vector<std::uint8_t>& outKeySeed);
+	// Answers a HELLO the caller already received (event-driven servers)
+	void serverHandshake(const FrameView& hello,
+	                     const std::string& serverSessionId,
+	                     std::string& outClientSessionId,
+	                     std::vector<std::uint8_t>& outClientNonce,
+	                     std::vector<std::uint8_t>& outServerNonce,
+	                     std::vector<std::uint8_t>& outKeySeed);
 
 	// Data
 	void sendData(const std::vector<std::uint8_t>& data);
@@ -53,6 +151,49 @@ public:
 	void sendAuthResult(bool success, const std::string& message);
 	bool receiveAuthResult(std::chrono::milliseconds timeout, bool& successOut, std::string& messageOut);
 
+	// Zero-copy data path: the frame header is written into kFrameHeaderLen bytes
+	// of the buffer's headroom and header plus payload go out in one write
+	// compressed sets kCompressedFlag in the type byte
+	void sendFrame(FrameType type, PacketBuffer& buf, bool compressed = false);
+	void sendEncrypted(PacketBuffer& cipherFrame, bool compressed = false);
+	// Payloads larger than the peer's frame limit are sent as fragments; a
+	// payload above its message limit throws before anything is sent.
+	// Frames are parsed out of a receive buffer filled by large reads, so one
+	// read can yield many frames. A timeout keeps partial frames buffered.
+	// Fragments are reassembled as they arrive and returned as one frame.
+	bool receiveFrame(FrameView& outFrame, std::chrono::milliseconds timeout);
+	// True once the peer has closed the connection; receives then keep failing
+	bool closed() const { return _closed; }
+	// True if a complete frame is buffered, so receiveFrame returns without reading the socket
+	bool frameBuffered() const;
+	bool receiveEncrypted(ByteView& outCipherFrame, std::chrono::milliseconds timeout);
+	// Sends every buffer as a frame of the given type in a single socket write.
+	// Small payloads are copied into the write queue on purpose: TLS cannot
+	// gather, and one SSL write per packet would cost a record (header, MAC,
+	// syscall) each. Payloads of a full record or more are written from the
+	// buffer itself. compressed, if not empty, flags each payload individually
+	void sendFrameBatch(FrameType type, const std::vector<PacketBuffer>& payloads,
+	                    const std::vector<bool>& compressed = {});
+	void sendEncryptedBatch(const std::vector<PacketBuffer>& cipherFrames, const std::vector<bool>& compressed = {});
+
+	// Write queue
+	void setCoalescing(const CoalescingOptions& options);
+	void flush();
+	bool flushIfDue(); // flushes if the oldest queued frame reached maxDelay
+	std::size_t pendingBytes() const { return _txQueue.size(); }
+
+	// For a socket in non-blocking mode: every frame goes through the write
+	// queue, flush() writes what the socket accepts and keeps the rest
+	// (pendingBytes() > 0 means wait for writability), and a receive that
+	// would block returns false without waiting; the timeout is ignored.
+	void setNonBlocking(bool nonBlocking) { _nonBlocking = nonBlocking; }
+	// Returns the receive block to its pool and frees the write queue when
+	// neither holds data, so an idle connection keeps no buffers. Invalidates
+	// frame views.
+	void releaseBuffers();
+
+	const TunnelStats& stats() const { return _stats; }
+
 	// Heartbeat
 	void sendHeartbeat();
 	bool receiveHeartbeat(std::chrono::milliseconds timeout);
@@ -65,8 +206,40 @@ private:
 	bool receiveFrame(Frame& outFrame, std::chrono::milliseconds timeout);
 	static void writeUint32(std::vector<std::uint8_t>& buf, std::uint32_t v);
 	static std::uint32_t readUint32(const std::uint8_t* p);
+	static void writeExtension(std::vector<std::uint8_t>& buf, HelloExtension type, const std::vector<std::uint8_t>& value);
+	void writeFrameLimits(std::vector<std::uint8_t>& payload) const;
+	void readFrameLimits(const std::vector<std::uint8_t>& value);
+	static void parseExtensions(const std::vector<std::uint8_t>& payload, std::size_t offset,
+	                            std::vector<std::pair<HelloExtension, std::vector<std::uint8_t>>>& out);
+
+	void sendAll(const std::uint8_t* data, std::size_t len);
+	void queueFrame(FrameType type, const std::uint8_t* payload, std::size_t len);
+	void queueFragment(FrameType type, const std::uint8_t* payload, std::size_t len);
+	void appendFrame(FrameType type, const std::uint8_t* payload, std::size_t len);
+	std::size_t maxSendPayload(std::size_t len) const;
+	static void putUint32(std::uint8_t* p, std::uint32_t v);
+	bool nextBufferedFrame(FrameView& outFrame, bool& more);
+	bool reassemble(FrameView& frame, bool more);
+	bool fillReceiveBuffer(std::chrono::milliseconds timeout);
 
-	Poco::Net::SecureStreamSocket& _socket;
+	Poco::Net::StreamSocket& _socket;
+	BufferBlock::Ptr _rxBuffer; // taken from the thread's pool on first read; bytes [_rxHead, _rxTail) are received but not yet parsed
+	std::size_t _rxHead = 0;
+	std::size_t _rxTail = 0;
+	std::chrono::milliseconds _rxTimeout{-1}; // last timeout applied to the socket
+	bool _closed = false;
+	bool _nonBlocking = false;
+	std::vector<std::uint8_t> _rxMessage; // fragments of the message being reassembled
+	FrameType _rxMessageType = FrameType::DATA;
+	bool _rxMessageCompressed = false;
+	bool _reassembling = false;
+	bool _rxMessageDone = false; // _rxMessage was handed out; released on the next receive
+	std::vector<std::uint8_t> _txQueue; // encoded frames not yet written
+	std::chrono::steady_clock::time_point _txQueuedAt; // when the oldest queued frame was added
+	CoalescingOptions _coalescing;
+	HandshakeOptions _handshakeOptions;
+	HandshakeResult _handshakeResult;
+	TunnelStats _stats;
 };
 
 } // namespace vpn
@@ -6,14 +6,25 @@
 #include <Poco/Net/SSLManager.h>
 #include <Poco/Net/PrivateKeyPassphraseHandler.h>
 #include <Poco/Net/InvalidCertificateHandler.h>
+#include <Poco/Net/PollSet.h>
+#include <Poco/Thread.h>
+#include <Poco/Mutex.h>
+#include <Poco/Event.h>
 #include <memory>
 #include <string>
 #include <vector>
+#include "vpn/crypto.h"
+#include "vpn/packet_buffer.h"
+#include "vpn/stream_mux.h"
+#include "vpn/packet_io.h"
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <atomic>
 
 namespace vpn {
 
-class SessionCrypto;
-
 struct ClientConfig {
 	std::string serverHost = "127.0.0.1";
 	unsigned short serverPort = 44350;
@@ -23,11 +34,28 @@ struct ClientConfig {
 	bool verifyServer = true;
 	std::string username = "vpnuser";
 	std::string password = "ChangeMe";
+	std::vector<CipherSuite> cipherSuites = defaultCipherSuites(); // offered data-plane suites, preference order
+	bool allowTlsOnlyData = true; // accept plain DATA frames if the server's policy asks for them
+	// Offer zlib compression of packet payloads (before encryption). Saves WAN
+	// bandwidth on text-like traffic; leave off when secrets and attacker-chosen
+	// data share a packet, since compressed sizes can leak content.
+	bool compression = false;
+	// Coalesce small sends into one write of up to this many bytes; queued
+	// frames go out on flush(), with the first send after sendCoalesceDelay,
+	// or before the next receive. 0 writes every send at once.
+	std::size_t sendCoalesceBytes = 0;
+	std::chrono::microseconds sendCoalesceDelay{200};
 };
 
 class VpnClient {
 public:
+	static const std::size_t kPacketBatch = 64;
+	static const std::size_t kMaxQueuedPackets = 1024; // the reader stops taking packets from its PacketIO beyond this
+	// Receives each decrypted packet on the I/O thread; the view is valid only during the call
+	using PacketHandler = std::function<void(ByteView packet)>;
+
 	explicit VpnClient(const ClientConfig& config);
+	~VpnClient();
 
 	void connect();
 	void disconnect();
@@ -36,12 +64,107 @@ public:
 	void send(const std::vector<unsigned char>& data);
 	std::vector<unsigned char> receive();
 
+	// Zero-copy send: fill the payload of a buffer from createPacket(); it is
+	// encrypted in place and framed in its headroom. The buffer can be reused.
+	PacketBuffer createPacket(std::size_t payloadCapacity) const;
+	void send(PacketBuffer& packet);
+	// Encrypts a burst of packets in one pass and writes all frames at once
+	void sendBatch(std::vector<PacketBuffer>& packets);
+	// Writes frames held back by send coalescing
+	void flush();
+	// Counters of the pool behind createPacket(), for sizing
+	BufferPoolStats bufferPoolStats(BufferPool::SizeClass sizeClass) const { return _bufferPool.stats(sizeClass); }
+	// True when the server enabled TLS-only data: payloads skip SessionCrypto
+	bool tlsOnlyData() const { return _tlsOnlyData; }
+	// Addresses the server assigned on its virtual network, like "10.8.0.2/24";
+	// empty if it runs none, in which case packets are echoed back
+	const std::vector<std::string>& virtualAddresses() const { return _virtualAddresses; }
+	// Counters of the connection's tunnel; zero while disconnected. In async
+	// mode this is the I/O thread's last snapshot.
+	TunnelStats tunnelStats() const;
+	// Null unless compression was negotiated
+	const PayloadCompressor* compressor() const { return _compressor.get(); }
+
+	// Multiplexed streams with their own flow control, so a bulk transfer on
+	// one stream does not hold back interactive traffic on another
+	std::uint32_t openStream();
+	void sendStream(std::uint32_t streamId, const std::vector<unsigned char>& data);
+	// Returns what has arrived, waiting up to timeout; empty on timeout or once finished
+	std::vector<unsigned char> receiveStream(std::uint32_t streamId, std::chrono::milliseconds timeout);
+	void closeStream(std::uint32_t streamId);
+	// The server closed the stream and everything it sent has been read
+	bool streamFinished(std::uint32_t streamId) const;
+
+	// Full-duplex mode: after connect(), an I/O thread owns the tunnel. It
+	// sends what sendAsync() queues and delivers every received packet to
+	// handler, or, without one, to a queue that receive() waits on. The
+	// blocking send overloads still work, at the cost of a copy and a wait
+	// (never call them from the handler); stream calls are not available.
+	// disconnect() stops the thread.
+	void startAsync(PacketHandler handler = PacketHandler());
+	bool asyncRunning() const { return _ioThread != nullptr; }
+	// Queues a packet and returns at once; the future completes when the
+	// packet has been written, or carries the error that stopped the I/O thread
+	std::future<void> sendAsync(std::vector<unsigned char> data);
+	// Carries IP packets between io, e.g. a TunDevice, and the server in async
+	// mode: a reader thread takes whatever io has ready, up to kPacketBatch per
+	// wakeup, and the I/O thread encrypts each batch in place and writes it at
+	// once; decrypted packets go to io.write() on the I/O thread. A failed
+	// io.read() fails the connection like an I/O thread error. io must
+	// outlive the connection; disconnect() stops both threads.
+	void startPacketIO(PacketIO& io);
+
 private:
+	struct PendingSend {
+		std::vector<unsigned char> data;
+		std::promise<void> done;
+	};
+
+	PacketBuffer createPacket(BufferPool& pool, std::size_t payloadCapacity) const;
+	void sendPackets(std::vector<PacketBuffer>& packets);
+	void handleIncoming(const FrameView& frame);
+	void deliverPacket(ByteView packet);
+	void runAsync();
+	void sendQueued();
+	void stopAsync();
+	void readPackets(PacketIO& io);
+	void requireSyncMode() const;
+
+	// Receives one frame and routes it to the streams or the packet queue; false on timeout
+	bool processIncoming(std::chrono::steady_clock::time_point deadline);
+
 	ClientConfig _config;
 	std::shared_ptr<Poco::Net::Context> _sslContext;
 	std::unique_ptr<Poco::Net::SecureStreamSocket> _socket;
+	std::unique_ptr<Tunnel> _tunnel;
 	std::unique_ptr<SessionCrypto> _sessionCrypto;
+	std::unique_ptr<StreamMux> _streams;
+	std::unique_ptr<PayloadCompressor> _compressor;
+	std::deque<std::vector<unsigned char>> _rxQueue; // packets received while serving streams
+	mutable BufferPool _bufferPool; // handing out buffers does not change the client
+	PacketBuffer _txPacket;
+	bool _tlsOnlyData = false;
+	std::vector<std::string> _virtualAddresses;
 	bool _connected = false;
+
+	// Asynchronous mode; _asyncMutex guards the send queue, the receive queue,
+	// the error and the stats snapshot while the I/O thread runs
+	std::unique_ptr<Poco::Thread> _ioThread;
+	Poco::Net::PollSet _pollSet; // the TLS socket; sendAsync() wakes it
+	std::atomic<bool> _asyncStop{false};
+	PacketHandler _packetHandler;
+	mutable Poco::FastMutex _asyncMutex;
+	std::deque<PendingSend> _sendQueue;
+	std::string _asyncError; // why the I/O thread stopped
+	TunnelStats _asyncStats;
+	Poco::Event _rxReady;
+	std::vector<PacketBuffer> _asyncBatch; // I/O thread only
+	// startPacketIO(): packets read from the PacketIO wait in _packetQueue,
+	// guarded by _asyncMutex, for the I/O thread's next round
+	PacketIO* _packetIO = nullptr;
+	std::unique_ptr<Poco::Thread> _packetReader;
+	std::vector<PacketBuffer> _packetQueue;
+	Poco::Event _packetSpace; // set when the I/O thread drains _packetQueue
 };
 
 } // namespace vpn
@@ -12,11 +12,24 @@
 #include <Poco/Util/ServerApplication.h>
 #include <Poco/AutoPtr.h>
 #include "vpn/auth.h"
+#include "vpn/crypto.h"
+#include "vpn/tunnel.h"
+#include "vpn/session_registry.h"
+#include "vpn/routing.h"
 #include <memory>
 #include <string>
+#include <chrono>
 
 namespace vpn {
 
+// How connections are served. THREADED: one pooled thread per connection for
+// its whole life (at most 16 at a time). REACTOR: a few worker threads poll
+// non-blocking sockets and step each session as data arrives, for many
+// concurrent, mostly idle sessions. SHARDED: like REACTOR, but every worker
+// has its own SO_REUSEPORT listener on the same address and accepts for
+// itself, so reconnect storms are spread over all cores (Linux, BSD).
+enum class ServerMode { THREADED, REACTOR, SHARDED };
+
 struct ServerConfig {
 	std::string address = "0.0.0.0";
 	unsigned short port = 44350;
@@ -25,8 +38,50 @@ struct ServerConfig {
 	std::string caFile = "certs/ca.crt";
 	bool requireClientAuth = true;
 	std::string credentialFile = "config/users.json";
+	// How often credentialFile is checked for changes, which are loaded without
+	// a restart or dropping sessions; 0 loads it once at start
+	std::chrono::milliseconds credentialReloadInterval{2000};
+	// Password hashes are checked on kdfThreads; logins waiting beyond
+	// maxQueuedLogins are turned away as busy. A successful login is
+	// remembered for loginCacheTtl so quick reconnects skip the hash.
+	unsigned kdfThreads = 2;
+	std::size_t maxQueuedLogins = 256;
+	std::chrono::seconds loginCacheTtl{30};
+	std::vector<CipherSuite> cipherSuites = defaultCipherSuites(); // accepted data-plane suites, preference order
+	// Send data as plain DATA frames, relying on mTLS alone, with clients that
+	// accept it. Only for trusted links; requires requireClientAuth.
+	bool tlsOnlyData = false;
+	// Small replies are coalesced into full TLS records; 0 writes every frame at once
+	std::size_t sendCoalesceBytes = 16 * 1024;
+	std::chrono::microseconds sendCoalesceDelay{200};
+	// Accept payload compression when a client asks for it (see ClientConfig::compression)
+	bool allowCompression = true;
+	// Per-connection receive limits announced to clients: larger payloads arrive
+	// fragmented and are reassembled up to maxMessageSize, which also caps
+	// decompressed payloads. Frames or messages beyond them drop the connection.
+	std::size_t maxFrameSize = kDefaultMaxFrameLen;
+	std::size_t maxMessageSize = kDefaultMaxMessageLen;
+	// Streams a client may have open at once; opening more drops the connection
+	std::size_t maxStreams = 64;
+	ServerMode mode = ServerMode::THREADED;
+	unsigned reactorThreads = 0; // REACTOR and SHARDED; 0 = one per core
+	// REACTOR and SHARDED: TLS handshakes and logins run on their own threads
+	// (0 = half the cores) and are handed to the data workers once
+	// authenticated. At most maxPendingHandshakes are in progress; further
+	// connections wait in the listen backlog.
+	unsigned handshakeThreads = 0;
+	unsigned maxPendingHandshakes = 256;
+	// Each authenticated session gets an address from these networks, e.g.
+	// "10.8.0.0/24" and "fd00:8::/112", and the IP packets it sends are
+	// forwarded to the session owning their destination. Both empty: every
+	// session echoes its packets back.
+	std::string virtualNetwork;
+	std::string virtualNetwork6;
 };
 
+class ConnectionFactory;
+class ServerReactor;
+
 class VpnServer {
 public:
 	explicit VpnServer(const ServerConfig& config);
@@ -34,14 +89,27 @@ public:
 
 	void start();
 	void stop();
+	// Reloads credentialFile now, e.g. on SIGHUP; throws and keeps the current users on errors
+	void reloadCredentials();
+	// Authenticated sessions of every mode, e.g. to look up or close a user's sessions
+	SessionRegistry& sessions() { return *_sessions; }
+	// Null unless ServerConfig::virtualNetwork or virtualNetwork6 is set
+	const VirtualNetwork* virtualNetwork() const { return _network.get(); }
+	// The port listened on, which the OS picks when ServerConfig::port is 0
+	unsigned short port() const { return _port; }
 
 private:
 	class Connection;
+	friend class ConnectionFactory;
 
 	ServerConfig _config;
 	std::unique_ptr<Poco::Net::TCPServer> _tcpServer;
+	std::unique_ptr<ServerReactor> _reactor;
 	std::shared_ptr<Poco::Net::Context> _sslContext;
 	CredentialStore::Ptr _credentialStore;
+	SessionRegistry::Ptr _sessions;
+	VirtualNetwork::Ptr _network;
+	unsigned short _port = 0;
 	bool _running = false;
 };
 
@@ -1,4 +1,5 @@
 #include "vpn/auth.h"
+#include "vpn/credential_index.h"
 
 #include <Poco/File.h>
 #include <Poco/JSON/Object.h>
@@ -7,9 +8,17 @@
 #include <Poco/StreamCopier.h>
 #include <Poco/Base64Decoder.h>
 #include <Poco/SHA2Engine.h>
+#include <Poco/HMACEngine.h>
+#include <Poco/Logger.h>
+#include <Poco/Format.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include "vpn/random.h"
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
+#include <cstring>
+#include <unordered_map>
 
 namespace vpn {
 
@@ -33,7 +42,116 @@ std::vector<std::uint8_t> computePasswordHash(const std::vector<std::uint8_t>& s
 	return std::vector<std::uint8_t>(digest.begin(), digest.end());
 }
 
+static const std::uint64_t kScryptMaxCost = 1 << 20;
+static const std::uint64_t kScryptR = 8;
+static const std::uint64_t kScryptP = 1;
+// scrypt's working memory at the largest N: 128 * r * (N + 2) for V plus
+// 128 * r * p for B, just over 1 GiB
+static const std::uint64_t kScryptMaxMemory = 128 * kScryptR * (kScryptMaxCost + 2) + 128 * kScryptR * kScryptP;
+static const std::size_t kDerivedHashLen = 32;
+
+std::vector<std::uint8_t> derivePasswordHash(const std::string& kdf, std::uint64_t cost,
+                                             const std::vector<std::uint8_t>& salt,
+                                             const std::string& password) {
+	if (kdf.empty()) return computePasswordHash(salt, password);
+	if (kdf == kKdfScrypt) {
+		std::vector<std::uint8_t> out(kDerivedHashLen);
+		if (EVP_PBE_scrypt(password.data(), password.size(), salt.data(), salt.size(),
+		                   cost, kScryptR, kScryptP, kScryptMaxMemory, out.data(), out.size()) != 1) {
+			throw std::runtime_error("scrypt failed");
+		}
+		return out;
+	}
+	if (kdf == kKdfPbkdf2Sha256) {
+		std::vector<std::uint8_t> out(kDerivedHashLen);
+		if (PKCS5_PBKDF2_HMAC(password.data(), static_cast<int>(password.size()), salt.data(), static_cast<int>(salt.size()),
+		                      static_cast<int>(cost), EVP_sha256(), static_cast<int>(out.size()), out.data()) != 1) {
+			throw std::runtime_error("pbkdf2 failed");
+		}
+		return out;
+	}
+	throw std::invalid_argument("unknown kdf: " + kdf);
+}
+
+std::uint64_t checkedKdfCost(const std::string& kdf, std::uint64_t cost) {
+	if (kdf.empty()) return 0;
+	if (kdf == kKdfScrypt) {
+		if (cost == 0) return kDefaultScryptCost;
+		if (cost < 2 || cost > kScryptMaxCost || (cost & (cost - 1)) != 0) {
+			throw std::runtime_error("scrypt cost must be a power of two from 2 to 2^20");
+		}
+		return cost;
+	}
+	if (kdf == kKdfPbkdf2Sha256) {
+		if (cost == 0) return kDefaultPbkdf2Iterations;
+		if (cost > 100000000) throw std::runtime_error("pbkdf2 iteration count too large");
+		return cost;
+	}
+	throw std::runtime_error("unknown kdf: " + kdf);
+}
+
+static bool isExpensive(const UserRecord& record) {
+	return !record.kdf.empty() && !record.hash.empty() && !record.salt.empty();
+}
+
+// Users of a JSON credential file, held in memory
+class JsonUserTable : public UserTable {
+public:
+	JsonUserTable() = default;
+	explicit JsonUserTable(std::vector<UserRecord> records) {
+		_records.reserve(records.size());
+		for (auto& rec : records) {
+			std::string username = rec.username;
+			_records.emplace(std::move(username), std::move(rec));
+		}
+	}
+
+	const UserRecord* find(const std::string& username, UserRecord&) const override {
+		auto it = _records.find(username);
+		return it == _records.end() ? nullptr : &it->second;
+	}
+	std::size_t size() const override { return _records.size(); }
+
+private:
+	std::unordered_map<std::string, UserRecord> _records;
+};
+
+// Direct-mapped cache of recent successful logins. Each slot is a seqlock:
+// readers never wait, and a writer that finds the slot busy drops its entry.
+struct CredentialStore::CacheSlot {
+	std::atomic<std::uint32_t> seq{0}; // odd while being written
+	std::atomic<std::uint64_t> key0{0};
+	std::atomic<std::uint64_t> key1{0};
+	std::atomic<std::uint64_t> version{0};
+	std::atomic<std::int64_t> expires{0}; // steady_clock ticks
+};
+
+static const std::size_t kCacheSlots = 1024;
+
+static std::atomic<std::uint64_t> nextStoreId{1};
+
+CredentialStore::CredentialStore()
+	: _id(nextStoreId++)
+	, _users(std::make_shared<const JsonUserTable>()) {
+	const auto secret = secureRandomBytes(32);
+	_cacheSecret.assign(secret.begin(), secret.end());
+	_cache.reset(new CacheSlot[kCacheSlots]);
+}
+
+CredentialStore::~CredentialStore() {
+	watch(std::chrono::milliseconds(0));
+	// finishes the queued checks while the rest of the store is still intact
+	_pool.reset();
+}
+
 CredentialStore::Ptr CredentialStore::loadFromFile(const std::string& path) {
+	auto store = std::make_shared<CredentialStore>();
+	store->_path = path;
+	store->install(loadUsers(path));
+	return store;
+}
+
+std::vector<UserRecord> parseCredentialJson(const std::string& path) {
 	Poco::File file(path);
 	if (!file.exists()) {
 		throw std::runtime_error("Credential file not found: " + path);
@@ -47,11 +165,16 @@ CredentialStore::Ptr CredentialStore::loadFromFile(const std::string& path) {
 	auto obj = result.extract<Poco::JSON::Object::Ptr>();
 	auto users = obj->getArray("users");
 	if (!users) throw std::runtime_error("Credential file missing 'users' array");
-	auto store = std::make_shared<CredentialStore>();
+	std::vector<UserRecord> records;
+	records.reserve(users->size());
 	for (size_t i = 0; i < users->size(); ++i) {
 		auto userObj = users->getObject(i);
 		UserRecord rec;
 		rec.username = userObj->getValue<std::string>("username");
+		if (userObj->has("kdf")) {
+			rec.kdf = userObj->getValue<std::string>("kdf");
+		}
+		rec.cost = checkedKdfCost(rec.kdf, userObj->has("cost") ? userObj->getValue<Poco::UInt64>("cost") : 0);
 		if (userObj->has("salt")) {
 			rec.salt = base64Decode(userObj->getValue<std::string>("salt"));
 		}
@@ -61,24 +184,221 @@ CredentialStore::Ptr CredentialStore::loadFromFile(const std::string& path) {
 		if (userObj->has("password")) {
 			rec.passwordPlain = userObj->getValue<std::string>("password");
 		}
-		store->_records.emplace(rec.username, std::move(rec));
+		records.push_back(std::move(rec));
 	}
-	return store;
+	return records;
 }
 
-bool CredentialStore::verify(const std::string& username, const std::string& password) const {
-	auto it = _records.find(username);
-	if (it == _records.end()) return false;
-	if (!it->second.hash.empty() && !it->second.salt.empty()) {
-		auto computed = computePasswordHash(it->second.salt, password);
-		return computed == it->second.hash;
+std::shared_ptr<const UserTable> CredentialStore::loadUsers(const std::string& path) {
+	if (CredentialIndex::isIndexFile(path)) return std::make_shared<const CredentialIndex>(path);
+	return std::make_shared<const JsonUserTable>(parseCredentialJson(path));
+}
+
+void CredentialStore::install(std::shared_ptr<const UserTable> users) {
+	Poco::FastMutex::ScopedLock lock(_mutex);
+	_users = std::move(users);
+	_version.fetch_add(1, std::memory_order_release);
+}
+
+// Each thread remembers the snapshot it last used and only goes to the mutex
+// after a reload bumped the version, so verify() takes no lock in the common
+// case. The per-thread reference is weak: a call holds its snapshot only while
+// it runs, and an old snapshot is freed once no call uses it, even if the
+// threads that used it go idle.
+std::shared_ptr<const UserTable> CredentialStore::snapshot(std::uint64_t& version) const {
+	struct Cached {
+		std::uint64_t store = 0;
+		std::uint64_t version = 0;
+		std::weak_ptr<const UserTable> users;
+	};
+	thread_local Cached cached;
+	if (cached.store == _id && cached.version == _version.load(std::memory_order_acquire)) {
+		if (auto users = cached.users.lock()) {
+			version = cached.version;
+			return users;
+		}
+	}
+	Poco::FastMutex::ScopedLock lock(_mutex);
+	cached.store = _id;
+	cached.version = _version.load(std::memory_order_relaxed);
+	cached.users = _users;
+	version = cached.version;
+	return _users;
+}
+
+bool CredentialStore::check(const UserRecord& record, const std::string& password) const {
+	if (!record.hash.empty() && !record.salt.empty()) {
+		if (!record.kdf.empty()) ++_kdfRuns;
+		const auto computed = derivePasswordHash(record.kdf, record.cost, record.salt, password);
+		return computed.size() == record.hash.size() &&
+		       CRYPTO_memcmp(computed.data(), record.hash.data(), computed.size()) == 0;
 	}
-	if (!it->second.passwordPlain.empty()) {
-		return password == it->second.passwordPlain;
+	if (!record.passwordPlain.empty()) {
+		return password == record.passwordPlain;
 	}
 	return false;
 }
 
+bool CredentialStore::verify(const std::string& username, const std::string& password) const {
+	std::uint64_t version = 0;
+	UserRecord scratch;
+	const auto users = snapshot(version);
+	const UserRecord* record = users->find(username, scratch);
+	if (!record) return false;
+	if (!isExpensive(*record)) return check(*record, password);
+	const CacheKey key = cacheKey(username, password);
+	if (cacheLookup(key, version)) return true;
+	const bool ok = check(*record, password);
+	if (ok) cacheInsert(key, version);
+	return ok;
+}
+
+void CredentialStore::verifyAsync(const std::string& username, const std::string& password, VerifyCallback done) const {
+	std::uint64_t version = 0;
+	UserRecord scratch;
+	std::shared_ptr<const UserTable> users;
+	const UserRecord* record = nullptr;
+	try {
+		users = snapshot(version);
+		record = users->find(username, scratch);
+	} catch (const std::exception& ex) {
+		Poco::Logger::get("VpnServer").warning(Poco::format("Looking up %s failed: %s", username, std::string(ex.what())));
+	}
+	if (!record) {
+		done(VerifyResult::REJECTED);
+		return;
+	}
+	if (!isExpensive(*record)) {
+		done(check(*record, password) ? VerifyResult::ACCEPTED : VerifyResult::REJECTED);
+		return;
+	}
+	const CacheKey key = cacheKey(username, password);
+	if (cacheLookup(key, version)) {
+		done(VerifyResult::ACCEPTED);
+		return;
+	}
+	// the record is copied: this thread's snapshot may be replaced before the job runs
+	auto job = [this, record = *record, password, key, version, done]() {
+		bool ok = false;
+		try {
+			ok = check(record, password);
+		} catch (const std::exception& ex) {
+			// the caller is waiting on done: a record we cannot check is a failed login
+			Poco::Logger::get("VpnServer").warning(Poco::format("Password check for %s failed: %s",
+				record.username, std::string(ex.what())));
+		}
+		if (ok) cacheInsert(key, version);
+		done(ok ? VerifyResult::ACCEPTED : VerifyResult::REJECTED);
+	};
+	if (!pool().trySubmit(std::move(job))) {
+		++_busy;
+		done(VerifyResult::BUSY);
+	}
+}
+
+void CredentialStore::setVerifyOptions(const VerifyOptions& options) {
+	if (options.kdfThreads == 0 || options.maxQueued == 0) throw std::invalid_argument("KDF pool needs at least one thread and queue slot");
+	if (_pool) throw std::logic_error("verify options must be set before the first verifyAsync");
+	_verifyOptions = options;
+}
+
+VerifyStats CredentialStore::verifyStats() const {
+	VerifyStats stats;
+	stats.cacheHits = _cacheHits;
+	stats.kdfRuns = _kdfRuns;
+	stats.busy = _busy;
+	return stats;
+}
+
+KdfPool& CredentialStore::pool() const {
+	std::call_once(_poolOnce, [this]() {
+		_pool = std::make_unique<KdfPool>(_verifyOptions.kdfThreads, _verifyOptions.maxQueued);
+	});
+	return *_pool;
+}
+
+CredentialStore::CacheKey CredentialStore::cacheKey(const std::string& username, const std::string& password) const {
+	// keyed, so the cache never holds a plain fast hash of a password
+	Poco::HMACEngine<Poco::SHA2Engine> hmac(_cacheSecret);
+	hmac.update(username);
+	hmac.update("", 1); // separator
+	hmac.update(password);
+	const auto& digest = hmac.digest();
+	CacheKey key;
+	std::memcpy(key.data(), digest.data(), sizeof(key));
+	return key;
+}
+
+bool CredentialStore::cacheLookup(const CacheKey& key, std::uint64_t version) const {
+	if (_verifyOptions.cacheTtl.count() == 0) return false;
+	const CacheSlot& slot = _cache[key[0] % kCacheSlots];
+	const std::uint32_t seq = slot.seq.load(std::memory_order_acquire);
+	if (seq & 1) return false;
+	const bool match = slot.key0.load(std::memory_order_relaxed) == key[0] &&
+	                   slot.key1.load(std::memory_order_relaxed) == key[1] &&
+	                   slot.version.load(std::memory_order_relaxed) == version &&
+	                   slot.expires.load(std::memory_order_relaxed) > std::chrono::steady_clock::now().time_since_epoch().count();
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot.seq.load(std::memory_order_relaxed) != seq || !match) return false;
+	++_cacheHits;
+	return true;
+}
+
+void CredentialStore::cacheInsert(const CacheKey& key, std::uint64_t version) const {
+	if (_verifyOptions.cacheTtl.count() == 0) return;
+	CacheSlot& slot = _cache[key[0] % kCacheSlots];
+	std::uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+	if ((seq & 1) || !slot.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) return;
+	std::atomic_thread_fence(std::memory_order_release);
+	const auto expires = std::chrono::steady_clock::now() + _verifyOptions.cacheTtl;
+	slot.key0.store(key[0], std::memory_order_relaxed);
+	slot.key1.store(key[1], std::memory_order_relaxed);
+	slot.version.store(version, std::memory_order_relaxed);
+	slot.expires.store(expires.time_since_epoch().count(), std::memory_order_relaxed);
+	slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+void CredentialStore::reload() {
+	if (_path.empty()) throw std::runtime_error("Credential store was not loaded from a file");
+	auto users = loadUsers(_path);
+	const std::size_t count = users->size();
+	install(std::move(users));
+	Poco::Logger::get("VpnServer").information(Poco::format("Reloaded %z users from %s", count, _path));
+}
+
+void CredentialStore::watch(std::chrono::milliseconds interval) {
+	if (_watcher.isRunning()) {
+		_stopWatching.set();
+		_watcher.join();
+	}
+	if (interval.count() <= 0) return;
+	if (_path.empty()) throw std::runtime_error("Credential store was not loaded from a file");
+	Poco::File file(_path);
+	_fileModified = file.getLastModified();
+	_fileSize = file.getSize();
+	_stopWatching.reset();
+	_watcher.startFunc([this, interval]() { watchLoop(interval); });
+}
+
+void CredentialStore::watchLoop(std::chrono::milliseconds interval) {
+	while (!_stopWatching.tryWait(static_cast<long>(interval.count()))) {
+		try {
+			Poco::File file(_path);
+			if (!file.exists()) continue; // mid-rename: keep the current users
+			const Poco::Timestamp modified = file.getLastModified();
+			const Poco::File::FileSize size = file.getSize();
+			if (modified == _fileModified && size == _fileSize) continue;
+			// remembered even if parsing fails, so a bad file is reported once
+			_fileModified = modified;
+			_fileSize = size;
+			reload();
+		} catch (const std::exception& ex) {
+			Poco::Logger::get("VpnServer").warning(Poco::format("Credential reload failed, keeping current users: %s",
+				std::string(ex.what())));
+		}
+	}
+}
+
 } // namespace vpn
 
 
@@ -0,0 +1,119 @@
+#include "vpn/buffer_pool.h"
+
+#include <new>
+
+namespace vpn {
+
+struct BufferBlock::PoolState {
+	Poco::FastMutex mutex;
+	std::vector<BufferBlock*> free[BufferPool::CLASS_COUNT];
+	BufferPoolStats stats[BufferPool::CLASS_COUNT];
+	std::size_t maxFree = 0;
+	bool closed = false; // pool destroyed: returning blocks are freed
+};
+
+static const std::size_t g_classSizes[BufferPool::CLASS_COUNT] = {
+	BufferPool::kSmallBlockSize,
+	BufferPool::kBulkBlockSize
+};
+
+BufferBlock::BufferBlock(std::shared_ptr<PoolState> pool, int sizeClass, std::size_t capacity)
+	: _pool(std::move(pool))
+	, _sizeClass(sizeClass)
+	, _capacity(capacity) {}
+
+BufferBlock* BufferBlock::create(std::shared_ptr<PoolState> pool, int sizeClass, std::size_t capacity) {
+	void* mem = ::operator new(sizeof(BufferBlock) + capacity);
+	return new (mem) BufferBlock(std::move(pool), sizeClass, capacity);
+}
+
+void BufferBlock::destroy(BufferBlock* block) {
+	block->~BufferBlock();
+	::operator delete(block);
+}
+
+BufferBlock::Ptr BufferBlock::allocate(std::size_t capacity) {
+	return Ptr(create(nullptr, -1, capacity));
+}
+
+void BufferBlock::release() {
+	if (_refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+	if (!_pool) {
+		destroy(this);
+		return;
+	}
+	// take over the block's reference: free-listed blocks must not keep the state alive
+	std::shared_ptr<PoolState> state = std::move(_pool);
+	Poco::FastMutex::ScopedLock lock(state->mutex);
+	auto& stats = state->stats[_sizeClass];
+	--stats.inUse;
+	auto& list = state->free[_sizeClass];
+	if (state->closed || list.size() >= state->maxFree) {
+		destroy(this);
+	} else {
+		_refs.store(1, std::memory_order_relaxed);
+		list.push_back(this);
+		stats.free = list.size();
+	}
+}
+
+BufferPool::BufferPool(std::size_t maxFree)
+	: _state(std::make_shared<BufferBlock::PoolState>()) {
+	_state->maxFree = maxFree;
+	for (auto& list : _state->free) list.reserve(maxFree);
+}
+
+BufferPool::~BufferPool() {
+	// blocks still handed out keep the state alive and free themselves on release
+	Poco::FastMutex::ScopedLock lock(_state->mutex);
+	_state->closed = true;
+	for (auto& list : _state->free) {
+		for (auto* block : list) BufferBlock::destroy(block);
+		list.clear();
+	}
+}
+
+BufferBlock::Ptr BufferBlock::sibling(std::size_t capacity) const {
+	if (!_pool) return allocate(capacity);
+	return acquire(_pool, capacity);
+}
+
+BufferBlock::Ptr BufferBlock::acquire(const std::shared_ptr<PoolState>& pool, std::size_t capacity) {
+	const int sizeClass = capacity <= BufferPool::kSmallBlockSize ? BufferPool::SMALL : BufferPool::BULK;
+	Poco::FastMutex::ScopedLock lock(pool->mutex);
+	auto& stats = pool->stats[sizeClass];
+	if (pool->closed || capacity > BufferPool::kBulkBlockSize) {
+		++stats.misses;
+		return allocate(capacity);
+	}
+	BufferBlock* block = nullptr;
+	auto& list = pool->free[sizeClass];
+	if (!list.empty()) {
+		block = list.back();
+		list.pop_back();
+		stats.free = list.size();
+		block->_pool = pool;
+		++stats.hits;
+	} else {
+		block = create(pool, sizeClass, g_classSizes[sizeClass]);
+		++stats.misses;
+	}
+	if (++stats.inUse > stats.highWater) stats.highWater = stats.inUse;
+	return Ptr(block);
+}
+
+BufferBlock::Ptr BufferPool::acquire(std::size_t capacity) {
+	return BufferBlock::acquire(_state, capacity);
+}
+
+BufferPoolStats BufferPool::stats(SizeClass sizeClass) const {
+	Poco::FastMutex::ScopedLock lock(_state->mutex);
+	return _state->stats[sizeClass];
+}
+
+BufferPool& BufferPool::forThread() {
+	thread_local BufferPool pool;
+	return pool;
+}
+
+} // namespace vpn
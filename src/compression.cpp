@@ -0,0 +1,111 @@
+#include "vpn/compression.h"
+
+#include <zlib.h>
+#include <stdexcept>
+#include <algorithm>
+
+namespace vpn {
+
+const std::size_t PayloadCompressor::kMinCompressSize;
+const unsigned PayloadCompressor::kMaxBackoff;
+const std::size_t PayloadCompressor::kMaxDecompressedSize;
+
+const char* compressionCodecName(CompressionCodec codec) {
+	switch (codec) {
+	case CompressionCodec::NONE: return "none";
+	case CompressionCodec::ZLIB: return "zlib";
+	}
+	return "unknown";
+}
+
+struct PayloadCompressor::Streams {
+	z_stream deflater{};
+	z_stream inflater{};
+};
+
+PayloadCompressor::PayloadCompressor(CompressionCodec codec, int level)
+	: _codec(codec)
+	, _streams(new Streams) {
+	if (codec != CompressionCodec::ZLIB) throw std::invalid_argument("unsupported compression codec");
+	// raw deflate (negative window bits): no zlib header or checksum, the AEAD/MAC covers integrity
+	if (deflateInit2(&_streams->deflater, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		throw std::runtime_error("deflateInit2 failed");
+	}
+	if (inflateInit2(&_streams->inflater, -15) != Z_OK) {
+		deflateEnd(&_streams->deflater);
+		throw std::runtime_error("inflateInit2 failed");
+	}
+}
+
+PayloadCompressor::~PayloadCompressor() {
+	deflateEnd(&_streams->deflater);
+	inflateEnd(&_streams->inflater);
+}
+
+bool PayloadCompressor::compress(PacketBuffer& buf) {
+	const std::size_t len = buf.size();
+	if (len < kMinCompressSize) {
+		++_stats.skipped;
+		return false;
+	}
+	if (_skip > 0) {
+		--_skip;
+		++_stats.skipped;
+		return false;
+	}
+	// each frame is an independent deflate stream; the state is reset, not reallocated
+	z_stream& z = _streams->deflater;
+	deflateReset(&z);
+	const std::size_t limit = len - len / 16;
+	_deflated.resize(deflateBound(&z, static_cast<uLong>(len)));
+	z.next_in = buf.data();
+	z.avail_in = static_cast<uInt>(len);
+	z.next_out = _deflated.data();
+	z.avail_out = static_cast<uInt>(_deflated.size());
+	const int rc = deflate(&z, Z_FINISH);
+	if (rc != Z_STREAM_END) throw std::runtime_error("deflate failed");
+	const std::size_t outLen = _deflated.size() - z.avail_out;
+	if (outLen > limit) {
+		// incompressible: back off 1, 2, 4 ... kMaxBackoff payloads before the next attempt
+		_backoff = _backoff == 0 ? 1 : std::min(_backoff * 2, kMaxBackoff);
+		_skip = _backoff;
+		++_stats.rejected;
+		return false;
+	}
+	_backoff = 0;
+	++_stats.compressed;
+	_stats.bytesIn += len;
+	_stats.bytesOut += outLen;
+	buf.assign(_deflated.data(), outLen);
+	return true;
+}
+
+ByteView PayloadCompressor::decompress(ByteView in) {
+	z_stream& z = _streams->inflater;
+	inflateReset(&z);
+	if (_inflated.size() < 4 * in.size + 256) _inflated.resize(std::min(4 * in.size + 256, _maxDecompressedSize));
+	z.next_in = in.data;
+	z.avail_in = static_cast<uInt>(in.size);
+	std::size_t produced = 0;
+	for (;;) {
+		z.next_out = _inflated.data() + produced;
+		z.avail_out = static_cast<uInt>(_inflated.size() - produced);
+		const int rc = inflate(&z, Z_FINISH);
+		produced = _inflated.size() - z.avail_out;
+		if (rc == Z_STREAM_END) break;
+		if (rc != Z_BUF_ERROR && rc != Z_OK) throw std::runtime_error("corrupt compressed payload");
+		if (z.avail_in == 0 && z.avail_out != 0) throw std::runtime_error("truncated compressed payload");
+		// output full: grow, but never past the cap (guards against decompression bombs)
+		if (_inflated.size() >= _maxDecompressedSize) throw std::runtime_error("decompressed payload too large");
+		_inflated.resize(std::min(_inflated.size() * 2, _maxDecompressedSize));
+	}
+	return ByteView{_inflated.data(), produced};
+}
+
+void PayloadCompressor::setMaxDecompressedSize(std::size_t maxSize) {
+	if (maxSize == 0 || maxSize > kMaxDecompressedSize) throw std::invalid_argument("decompressed size cap out of range");
+	_maxDecompressedSize = maxSize;
+	if (_inflated.capacity() > maxSize) std::vector<std::uint8_t>().swap(_inflated);
+}
+
+} // namespace vpn
@@ -0,0 +1,194 @@
+#include "vpn/credential_index.h"
+
+#include <Poco/File.h>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <limits>
+
+namespace vpn {
+
+static const char kIndexMagic[8] = {'V', 'P', 'N', 'C', 'R', 'E', 'D', '1'};
+static const std::size_t kHeaderSize = 16;
+static const std::size_t kEntrySize = 16;
+
+// kdf byte of a record
+enum : std::uint8_t { kKdfNone = 0, kKdfIdScrypt = 1, kKdfIdPbkdf2Sha256 = 2 };
+
+static std::uint64_t usernameHash(const char* data, std::size_t size) {
+	// FNV-1a
+	std::uint64_t h = 14695981039346656037ULL;
+	for (std::size_t i = 0; i < size; ++i) {
+		h ^= static_cast<std::uint8_t>(data[i]);
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static std::uint64_t readUint(const std::uint8_t* p, std::size_t bytes) {
+	std::uint64_t v = 0;
+	for (std::size_t i = 0; i < bytes; ++i) v = (v << 8) | p[i];
+	return v;
+}
+
+static void putUint(std::string& out, std::uint64_t v, std::size_t bytes) {
+	for (std::size_t i = bytes; i > 0; --i) {
+		out.push_back(static_cast<char>((v >> (8 * (i - 1))) & 0xFF));
+	}
+}
+
+static std::uint8_t kdfId(const std::string& kdf) {
+	if (kdf.empty()) return kKdfNone;
+	if (kdf == kKdfScrypt) return kKdfIdScrypt;
+	if (kdf == kKdfPbkdf2Sha256) return kKdfIdPbkdf2Sha256;
+	throw std::invalid_argument("unknown kdf: " + kdf);
+}
+
+bool CredentialIndex::isIndexFile(const std::string& path) {
+	std::ifstream ifs(path, std::ios::binary);
+	char magic[sizeof(kIndexMagic)] = {};
+	return ifs.read(magic, sizeof(magic)) && std::memcmp(magic, kIndexMagic, sizeof(magic)) == 0;
+}
+
+CredentialIndex::CredentialIndex(const std::string& path) {
+	Poco::File file(path);
+	if (!file.exists()) throw std::runtime_error("Credential index not found: " + path);
+	// an empty file cannot be mapped
+	if (file.getSize() < kHeaderSize) throw std::runtime_error("Credential index truncated: " + path);
+	_mapping = Poco::SharedMemory(file, Poco::SharedMemory::AM_READ);
+	const auto* begin = reinterpret_cast<const std::uint8_t*>(_mapping.begin());
+	const std::size_t size = static_cast<std::size_t>(_mapping.end() - _mapping.begin());
+	if (size < kHeaderSize || std::memcmp(begin, kIndexMagic, sizeof(kIndexMagic)) != 0) {
+		throw std::runtime_error("Not a credential index: " + path);
+	}
+	_count = static_cast<std::size_t>(readUint(begin + 8, 4));
+	if (_count > (size - kHeaderSize) / kEntrySize) throw std::runtime_error("Credential index truncated: " + path);
+	_entries = begin + kHeaderSize;
+	_recordsBegin = _entries + _count * kEntrySize;
+	_recordsSize = size - kHeaderSize - _count * kEntrySize;
+}
+
+const UserRecord* CredentialIndex::find(const std::string& username, UserRecord& scratch) const {
+	const std::uint64_t hash = usernameHash(username.data(), username.size());
+	std::size_t lo = 0;
+	std::size_t hi = _count;
+	while (lo < hi) {
+		const std::size_t mid = lo + (hi - lo) / 2;
+		if (readUint(_entries + mid * kEntrySize, 8) < hash) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < _count; ++lo) {
+		const std::uint8_t* entry = _entries + lo * kEntrySize;
+		if (readUint(entry, 8) != hash) break;
+		const auto offset = static_cast<std::uint32_t>(readUint(entry + 8, 4));
+		const auto length = static_cast<std::uint32_t>(readUint(entry + 12, 4));
+		if (decode(offset, length, username, scratch)) return &scratch;
+	}
+	return nullptr;
+}
+
+// Fills record if the record at offset belongs to username; every length is
+// checked against the record, so a corrupt file cannot read past the mapping
+bool CredentialIndex::decode(std::uint32_t offset, std::uint32_t length, const std::string& username, UserRecord& record) const {
+	if (offset > _recordsSize || length > _recordsSize - offset) throw std::runtime_error("Corrupt credential index");
+	const std::uint8_t* p = _recordsBegin + offset;
+	const std::uint8_t* const end = p + length;
+	auto take = [&](std::size_t bytes) {
+		if (static_cast<std::size_t>(end - p) < bytes) throw std::runtime_error("Corrupt credential index");
+		const std::uint8_t* field = p;
+		p += bytes;
+		return field;
+	};
+	const auto nameLen = static_cast<std::size_t>(readUint(take(2), 2));
+	const std::uint8_t* name = take(nameLen);
+	if (nameLen != username.size() || std::memcmp(name, username.data(), nameLen) != 0) return false;
+	record.username = username;
+	switch (*take(1)) {
+	case kKdfNone: record.kdf.clear(); break;
+	case kKdfIdScrypt: record.kdf = kKdfScrypt; break;
+	case kKdfIdPbkdf2Sha256: record.kdf = kKdfPbkdf2Sha256; break;
+	default: throw std::runtime_error("Corrupt credential index");
+	}
+	try {
+		record.cost = checkedKdfCost(record.kdf, readUint(take(8), 8));
+	} catch (const std::runtime_error&) {
+		// JSON files get the same check when they are loaded
+		throw std::runtime_error("Corrupt credential index");
+	}
+	const std::size_t saltLen = *take(1);
+	const std::uint8_t* salt = take(saltLen);
+	record.salt.assign(salt, salt + saltLen);
+	const std::size_t hashLen = *take(1);
+	const std::uint8_t* hash = take(hashLen);
+	record.hash.assign(hash, hash + hashLen);
+	const auto plainLen = static_cast<std::size_t>(readUint(take(2), 2));
+	const std::uint8_t* plain = take(plainLen);
+	record.passwordPlain.assign(reinterpret_cast<const char*>(plain), plainLen);
+	return true;
+}
+
+void writeCredentialIndex(const std::vector<UserRecord>& records, const std::string& path) {
+	struct Entry {
+		std::uint64_t hash;
+		const UserRecord* record;
+	};
+	std::vector<Entry> entries;
+	entries.reserve(records.size());
+	for (const auto& record : records) {
+		entries.push_back({usernameHash(record.username.data(), record.username.size()), &record});
+	}
+	// stable, so the first of duplicate usernames wins as when loading JSON
+	std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.hash != b.hash ? a.hash < b.hash : a.record->username < b.record->username;
+	});
+	entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.record->username == b.record->username;
+	}), entries.end());
+	if (entries.size() > std::numeric_limits<std::uint32_t>::max()) throw std::runtime_error("Too many users for a credential index");
+
+	std::string table;
+	std::string area;
+	table.reserve(entries.size() * kEntrySize);
+	for (const auto& entry : entries) {
+		const UserRecord& r = *entry.record;
+		if (r.username.size() > 0xFFFF || r.passwordPlain.size() > 0xFFFF || r.salt.size() > 0xFF || r.hash.size() > 0xFF) {
+			throw std::runtime_error("Credential fields too long for an index: " + r.username);
+		}
+		const std::size_t offset = area.size();
+		putUint(area, r.username.size(), 2);
+		area += r.username;
+		area.push_back(static_cast<char>(kdfId(r.kdf)));
+		putUint(area, r.cost, 8);
+		putUint(area, r.salt.size(), 1);
+		area.append(r.salt.begin(), r.salt.end());
+		putUint(area, r.hash.size(), 1);
+		area.append(r.hash.begin(), r.hash.end());
+		putUint(area, r.passwordPlain.size(), 2);
+		area += r.passwordPlain;
+		if (area.size() > std::numeric_limits<std::uint32_t>::max()) throw std::runtime_error("Credential index too large");
+		putUint(table, entry.hash, 8);
+		putUint(table, offset, 4);
+		putUint(table, area.size() - offset, 4);
+	}
+
+	// readers map the file, so it is never modified in place
+	const std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream ofs(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!ofs) throw std::runtime_error("Failed to create credential index: " + tmpPath);
+		std::string header(kIndexMagic, sizeof(kIndexMagic));
+		putUint(header, entries.size(), 4);
+		putUint(header, 0, 4);
+		ofs << header << table << area;
+		ofs.close();
+		if (!ofs) throw std::runtime_error("Failed to write credential index: " + tmpPath);
+	}
+	Poco::File(tmpPath).renameTo(path);
+}
+
+void compileCredentialIndex(const std::string& jsonPath, const std::string& indexPath) {
+	writeCredentialIndex(parseCredentialJson(jsonPath), indexPath);
+}
+
+} // namespace vpn
@@ -1,22 +1,74 @@
 #include "vpn/crypto.h"
+#include "vpn/random.h"
 
-#include <Poco/Crypto/Cipher.h>
-#include <Poco/Crypto/CipherKey.h>
-#include <Poco/Crypto/CryptoTransform.h>
-#include <Poco/Crypto/RSAKey.h>
 #include <Poco/HMACEngine.h>
 #include <Poco/SHA2Engine.h>
-#include <Poco/RandomBuf.h>
+#include <openssl/evp.h>
 #include <stdexcept>
 #include <cstring>
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 namespace vpn {
 
-static std::vector<std::uint8_t> randomBytes(std::size_t len) {
-	std::vector<std::uint8_t> v(len);
-	Poco::RandomBuf rng;
-	rng.read(reinterpret_cast<char*>(v.data()), static_cast<std::streamsize>(len));
-	return v;
+static const std::size_t kCbcIvLen = 16;
+static const std::size_t kHmacLen = 32;
+static const std::size_t kAeadNonceLen = 12;
+static const std::size_t kAeadTagLen = 16;
+
+static const EVP_CIPHER* evpCipher(CipherSuite suite) {
+	switch (suite) {
+	case CipherSuite::AES_256_GCM: return EVP_aes_256_gcm();
+	case CipherSuite::CHACHA20_POLY1305: return EVP_chacha20_poly1305();
+	case CipherSuite::AES_256_CBC_HMAC_SHA256: break;
+	}
+	return EVP_aes_256_cbc();
+}
+
+static std::string macKeyString(const std::vector<std::uint8_t>& macKey) {
+	return std::string(reinterpret_cast<const char*>(macKey.data()), macKey.size());
+}
+
+const char* cipherSuiteName(CipherSuite suite) {
+	switch (suite) {
+	case CipherSuite::AES_256_CBC_HMAC_SHA256: return "aes-256-cbc-hmac-sha256";
+	case CipherSuite::AES_256_GCM: return "aes-256-gcm";
+	case CipherSuite::CHACHA20_POLY1305: return "chacha20-poly1305";
+	}
+	return "unknown";
+}
+
+static bool detectAesHardware() {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_cpu_supports("aes");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 25)) != 0;
+#elif defined(__aarch64__) && defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__aarch64__) && defined(__APPLE__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool hasAesHardware() {
+	static const bool hasAes = detectAesHardware();
+	return hasAes;
+}
+
+std::vector<CipherSuite> defaultCipherSuites() {
+	if (hasAesHardware()) {
+		return {CipherSuite::AES_256_GCM, CipherSuite::CHACHA20_POLY1305, CipherSuite::AES_256_CBC_HMAC_SHA256};
+	}
+	return {CipherSuite::CHACHA20_POLY1305, CipherSuite::AES_256_GCM, CipherSuite::AES_256_CBC_HMAC_SHA256};
 }
 
 std::vector<std::uint8_t> hkdfSha256(const std::vector<std::uint8_t>& ikm,
@@ -63,62 +115,185 @@ DerivedKeys deriveSessionKeys(const std::vector<std::uint8_t>& keySeed,
 	return out;
 }
 
+void SessionCrypto::CipherCtxDeleter::operator()(evp_cipher_ctx_st* ctx) const {
+	EVP_CIPHER_CTX_free(ctx);
+}
+
 SessionCrypto::SessionCrypto(const std::vector<std::uint8_t>& encKey,
-                             const std::vector<std::uint8_t>& macKey)
-	: _encKey(encKey), _macKey(macKey) {
-	if (_encKey.size() != 32 || _macKey.size() != 32) {
+                             const std::vector<std::uint8_t>& macKey,
+                             CipherSuite suite)
+	: _suite(suite)
+	, _encCtx(EVP_CIPHER_CTX_new())
+	, _decCtx(EVP_CIPHER_CTX_new())
+	, _encMac(macKeyString(macKey))
+	, _decMac(macKeyString(macKey)) {
+	if (encKey.size() != 32 || macKey.size() != 32) {
 		throw std::invalid_argument("SessionCrypto requires 32-byte encKey and macKey");
 	}
+	if (!_encCtx || !_decCtx) throw std::runtime_error("EVP_CIPHER_CTX_new failed");
+	// key schedule once; per packet only the IV is set
+	const EVP_CIPHER* cipher = evpCipher(_suite);
+	if (EVP_EncryptInit_ex(_encCtx.get(), cipher, nullptr, encKey.data(), nullptr) != 1 ||
+	    EVP_DecryptInit_ex(_decCtx.get(), cipher, nullptr, encKey.data(), nullptr) != 1) {
+		throw std::runtime_error("cipher initialisation failed");
+	}
+}
+
+SessionCrypto::~SessionCrypto() = default;
+
+std::size_t SessionCrypto::headroom() const {
+	return 1 + (_suite == CipherSuite::AES_256_CBC_HMAC_SHA256 ? kCbcIvLen : kAeadNonceLen);
+}
+
+std::size_t SessionCrypto::tailroom() const {
+	// CBC: up to one block of PKCS#7 padding plus the HMAC
+	return _suite == CipherSuite::AES_256_CBC_HMAC_SHA256 ? kCbcIvLen + kHmacLen : kAeadTagLen;
 }
 
 std::vector<std::uint8_t> SessionCrypto::encrypt(const std::vector<std::uint8_t>& plaintext) const {
-	// AES-256-CBC with random 16-byte IV, then HMAC-SHA256 over (ivLen|iv|ciphertext)
-	const std::size_t ivLen = 16;
-	auto iv = randomBytes(ivLen);
-	Poco::Crypto::CipherKey key("aes-256-cbc",
-		std::string(reinterpret_cast<const char*>(_encKey.data()), _encKey.size()),
-		std::string(reinterpret_cast<const char*>(iv.data()), iv.size()));
-	auto cipher = Poco::Crypto::Cipher::createCipher(key);
-	std::string encrypted = cipher->encrypt(std::string(reinterpret_cast<const char*>(plaintext.data()), plaintext.size()));
-
-	std::vector<std::uint8_t> frame;
-	frame.reserve(1 + iv.size() + encrypted.size() + 32);
-	frame.push_back(static_cast<std::uint8_t>(ivLen));
-	frame.insert(frame.end(), iv.begin(), iv.end());
-	frame.insert(frame.end(), encrypted.begin(), encrypted.end());
-
-	Poco::HMACEngine<Poco::SHA2Engine> hmac(std::string(reinterpret_cast<const char*>(_macKey.data()), _macKey.size()));
-	hmac.update(frame.data(), static_cast<unsigned>(frame.size()));
-	const auto macStr = hmac.digest();
-	frame.insert(frame.end(), macStr.begin(), macStr.end());
+	std::vector<std::uint8_t> frame(headroom() + plaintext.size() + tailroom());
+	frame.resize(seal(plaintext.data(), plaintext.size(), frame.data()));
 	return frame;
 }
 
 std::vector<std::uint8_t> SessionCrypto::decrypt(const std::vector<std::uint8_t>& frame) const {
-	if (frame.size() < 1 + 16 + 32) throw std::runtime_error("cipher frame too short");
+	// frame.size() covers the ciphertext plus one block of decrypt slack
+	std::vector<std::uint8_t> plain(frame.size());
+	plain.resize(open(frame.data(), frame.size(), plain.data()));
+	return plain;
+}
+
+void SessionCrypto::encryptInPlace(PacketBuffer& buf) const {
+	const std::size_t plainLen = buf.size();
+	buf.put(tailroom());
+	std::uint8_t* frame = buf.push(headroom());
+	buf.trim(seal(frame + headroom(), plainLen, frame));
+}
+
+ByteView SessionCrypto::decryptInPlace(ByteView frame) const {
+	std::uint8_t* plain = frame.data + headroom();
+	return ByteView{plain, open(frame.data, frame.size, plain)};
+}
+
+void SessionCrypto::encryptBatch(std::vector<PacketBuffer>& bufs) const {
+	const std::size_t ivLen = headroom() - 1;
+	_batchIvs.resize(bufs.size() * ivLen);
+	secureRandom(_batchIvs.data(), _batchIvs.size());
+	for (std::size_t i = 0; i < bufs.size(); ++i) {
+		PacketBuffer& buf = bufs[i];
+		const std::size_t plainLen = buf.size();
+		buf.put(tailroom());
+		std::uint8_t* frame = buf.push(headroom());
+		frame[0] = static_cast<std::uint8_t>(ivLen);
+		std::memcpy(frame + 1, _batchIvs.data() + i * ivLen, ivLen);
+		buf.trim(sealWithIv(frame + headroom(), plainLen, frame));
+	}
+}
+
+void SessionCrypto::decryptBatch(std::vector<ByteView>& frames) const {
+	for (auto& frame : frames) {
+		frame = decryptInPlace(frame);
+	}
+}
+
+std::size_t SessionCrypto::seal(const std::uint8_t* plain, std::size_t plainLen, std::uint8_t* frame) const {
+	const std::size_t ivLen = headroom() - 1;
+	frame[0] = static_cast<std::uint8_t>(ivLen);
+	secureRandom(frame + 1, ivLen);
+	return sealWithIv(plain, plainLen, frame);
+}
+
+std::size_t SessionCrypto::sealWithIv(const std::uint8_t* plain, std::size_t plainLen, std::uint8_t* frame) const {
+	if (_suite == CipherSuite::AES_256_CBC_HMAC_SHA256) return sealCbcHmac(plain, plainLen, frame);
+	return sealAead(plain, plainLen, frame);
+}
+
+std::size_t SessionCrypto::open(const std::uint8_t* frame, std::size_t frameLen, std::uint8_t* plainOut) const {
+	if (_suite == CipherSuite::AES_256_CBC_HMAC_SHA256) return openCbcHmac(frame, frameLen, plainOut);
+	return openAead(frame, frameLen, plainOut);
+}
+
+std::size_t SessionCrypto::sealCbcHmac(const std::uint8_t* plain, std::size_t plainLen, std::uint8_t* frame) const {
+	// AES-256-CBC with random 16-byte IV, then HMAC-SHA256 over (ivLen|iv|ciphertext)
+	std::uint8_t* iv = frame + 1;
+
+	EVP_CIPHER_CTX* ctx = _encCtx.get();
+	std::uint8_t* out = iv + kCbcIvLen;
+	int n = 0;
+	int fin = 0;
+	if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) != 1 ||
+	    EVP_EncryptUpdate(ctx, out, &n, plain, static_cast<int>(plainLen)) != 1 ||
+	    EVP_EncryptFinal_ex(ctx, out + n, &fin) != 1) {
+		throw std::runtime_error("encryption failed");
+	}
+	const std::size_t macOffset = 1 + kCbcIvLen + static_cast<std::size_t>(n + fin);
+
+	_encMac.update(frame, static_cast<unsigned>(macOffset));
+	const auto& mac = _encMac.digest();
+	std::copy(mac.begin(), mac.end(), frame + macOffset);
+	return macOffset + kHmacLen;
+}
+
+std::size_t SessionCrypto::openCbcHmac(const std::uint8_t* frame, std::size_t frameLen, std::uint8_t* plainOut) const {
+	if (frameLen < 1 + kCbcIvLen + kHmacLen) throw std::runtime_error("cipher frame too short");
 	std::size_t ivLen = frame[0];
-	if (ivLen != 16) throw std::runtime_error("invalid iv length");
-	if (frame.size() < 1 + ivLen + 32) throw std::runtime_error("cipher frame too short");
-	const std::size_t macOffset = frame.size() - 32;
-	// verify HMAC
-	Poco::HMACEngine<Poco::SHA2Engine> hmac(std::string(reinterpret_cast<const char*>(_macKey.data()), _macKey.size()));
-	hmac.update(frame.data(), static_cast<unsigned>(macOffset));
-	const auto macStr = hmac.digest();
-	std::vector<std::uint8_t> expected(macStr.begin(), macStr.end());
-	if (!std::equal(expected.begin(), expected.end(), frame.begin() + macOffset)) {
+	if (ivLen != kCbcIvLen) throw std::runtime_error("invalid iv length");
+	const std::size_t macOffset = frameLen - kHmacLen;
+	// verify HMAC before anything is decrypted (and, in place, overwritten)
+	_decMac.update(frame, static_cast<unsigned>(macOffset));
+	const auto& mac = _decMac.digest();
+	if (CRYPTO_memcmp(mac.data(), frame + macOffset, kHmacLen) != 0) {
 		throw std::runtime_error("HMAC verification failed");
 	}
 	// decrypt
-	std::vector<std::uint8_t> iv(frame.begin() + 1, frame.begin() + 1 + ivLen);
-	std::vector<std::uint8_t> ciphertext(frame.begin() + 1 + ivLen, frame.begin() + macOffset);
-	Poco::Crypto::CipherKey key("aes-256-cbc",
-		std::string(reinterpret_cast<const char*>(_encKey.data()), _encKey.size()),
-		std::string(reinterpret_cast<const char*>(iv.data()), iv.size()));
-	auto cipher = Poco::Crypto::Cipher::createCipher(key);
-	std::string decrypted = cipher->decrypt(std::string(reinterpret_cast<const char*>(ciphertext.data()), ciphertext.size()));
-	return std::vector<std::uint8_t>(decrypted.begin(), decrypted.end());
+	const std::uint8_t* iv = frame + 1;
+	const std::size_t ctLen = macOffset - 1 - kCbcIvLen;
+	EVP_CIPHER_CTX* ctx = _decCtx.get();
+	int n = 0;
+	int fin = 0;
+	if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) != 1 ||
+	    EVP_DecryptUpdate(ctx, plainOut, &n, iv + kCbcIvLen, static_cast<int>(ctLen)) != 1 ||
+	    EVP_DecryptFinal_ex(ctx, plainOut + n, &fin) != 1) {
+		throw std::runtime_error("decryption failed");
+	}
+	return static_cast<std::size_t>(n + fin);
 }
 
-} // namespace vpn
+std::size_t SessionCrypto::sealAead(const std::uint8_t* plain, std::size_t plainLen, std::uint8_t* frame) const {
+	// Single pass: ciphertext and tag come out of the same cipher invocation
+	std::uint8_t* nonce = frame + 1;
 
+	EVP_CIPHER_CTX* ctx = _encCtx.get();
+	std::uint8_t* out = nonce + kAeadNonceLen;
+	int n = 0;
+	int fin = 0;
+	if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce) != 1 ||
+	    EVP_EncryptUpdate(ctx, out, &n, plain, static_cast<int>(plainLen)) != 1 ||
+	    EVP_EncryptFinal_ex(ctx, out + n, &fin) != 1 ||
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, static_cast<int>(kAeadTagLen), out + n + fin) != 1) {
+		throw std::runtime_error("encryption failed");
+	}
+	return 1 + kAeadNonceLen + static_cast<std::size_t>(n + fin) + kAeadTagLen;
+}
 
+std::size_t SessionCrypto::openAead(const std::uint8_t* frame, std::size_t frameLen, std::uint8_t* plainOut) const {
+	if (frameLen < 1 + kAeadNonceLen + kAeadTagLen) throw std::runtime_error("cipher frame too short");
+	if (frame[0] != kAeadNonceLen) throw std::runtime_error("invalid nonce length");
+	const std::uint8_t* nonce = frame + 1;
+	const std::size_t tagOffset = frameLen - kAeadTagLen;
+	const std::size_t ctLen = tagOffset - 1 - kAeadNonceLen;
+
+	EVP_CIPHER_CTX* ctx = _decCtx.get();
+	int n = 0;
+	int fin = 0;
+	if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce) != 1 ||
+	    EVP_DecryptUpdate(ctx, plainOut, &n, nonce + kAeadNonceLen, static_cast<int>(ctLen)) != 1 ||
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, static_cast<int>(kAeadTagLen),
+	                        const_cast<std::uint8_t*>(frame + tagOffset)) != 1 ||
+	    EVP_DecryptFinal_ex(ctx, plainOut + n, &fin) != 1) {
+		throw std::runtime_error("AEAD tag verification failed");
+	}
+	return static_cast<std::size_t>(n + fin);
+}
+
+} // namespace vpn
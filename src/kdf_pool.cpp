@@ -0,0 +1,58 @@
+#include "vpn/kdf_pool.h"
+
+#include <Poco/Logger.h>
+#include <Poco/Format.h>
+#include <stdexcept>
+#include <exception>
+
+namespace vpn {
+
+class KdfJobNotification : public Poco::Notification {
+public:
+	explicit KdfJobNotification(KdfPool::Job job)
+		: job(std::move(job)) {}
+
+	KdfPool::Job job;
+};
+
+KdfPool::KdfPool(unsigned threads, std::size_t maxQueued)
+	: _maxQueued(maxQueued) {
+	if (threads == 0 || maxQueued == 0) throw std::invalid_argument("KDF pool needs at least one thread and queue slot");
+	for (unsigned i = 0; i < threads; ++i) {
+		_threads.push_back(std::make_unique<Poco::Thread>("kdf"));
+		_threads.back()->startFunc([this]() { run(); });
+	}
+}
+
+KdfPool::~KdfPool() {
+	// one plain notification per thread, behind the queued jobs, ends each loop
+	for (std::size_t i = 0; i < _threads.size(); ++i) _queue.enqueueNotification(new Poco::Notification);
+	for (auto& thread : _threads) thread->join();
+}
+
+bool KdfPool::trySubmit(Job job) {
+	std::size_t n = _queued;
+	do {
+		if (n >= _maxQueued) return false;
+	} while (!_queued.compare_exchange_weak(n, n + 1));
+	_queue.enqueueNotification(new KdfJobNotification(std::move(job)));
+	return true;
+}
+
+void KdfPool::run() {
+	for (;;) {
+		Poco::Notification::Ptr notification(_queue.waitDequeueNotification());
+		auto* job = dynamic_cast<KdfJobNotification*>(notification.get());
+		if (!job) break;
+		--_queued;
+		try {
+			job->job();
+		} catch (const std::exception& ex) {
+			// the job's caller would wait forever for an answer that never comes
+			Poco::Logger::get("VpnServer").fatal(Poco::format("KDF job threw: %s", std::string(ex.what())));
+			std::terminate();
+		}
+	}
+}
+
+} // namespace vpn
@@ -1,5 +1,6 @@
 #include "vpn/vpn_server.h"
 #include "vpn/vpn_client.h"
+#include "vpn/credential_index.h"
 
 #include <Poco/Util/Application.h>
 #include <Poco/Util/Option.h>
@@ -32,15 +33,25 @@ protected:
 		options.addOption(
 			Option("help", "h", "Display help information").required(false).repeatable(false));
 		options.addOption(
-			Option("mode", "m", "Mode: server|client")
+			Option("mode", "m", "Mode: server|client|compile-credentials")
 				.argument("mode")
 				.required(false)
 				.repeatable(false));
 		options.addOption(
-			Option("credentials", "c", "Path to credential store JSON (server only)")
+			Option("credentials", "c", "Path to credential store JSON or index (server only)")
 				.argument("file")
 				.required(false)
 				.repeatable(false));
+		options.addOption(
+			Option("output", "o", "Index file written by compile-credentials")
+				.argument("file")
+				.required(false)
+				.repeatable(false));
+		options.addOption(
+			Option("tun", "t", "Carry IP traffic through this TUN interface (client only, Linux)")
+				.argument("interface")
+				.required(false)
+				.repeatable(false));
 		options.addOption(
 			Option("username", "u", "Username for client authentication")
 				.argument("username")
@@ -61,6 +72,10 @@ protected:
 			_mode = value;
 		} else if (name == "credentials") {
 			_credentialFile = value;
+		} else if (name == "output") {
+			_outputFile = value;
+		} else if (name == "tun") {
+			_tunName = value;
 		} else if (name == "username") {
 			_username = value;
 		} else if (name == "password") {
@@ -72,7 +87,7 @@ protected:
 		if (_helpRequested) {
 			HelpFormatter helpFormatter(options());
 			helpFormatter.setCommand(commandName());
-			helpFormatter.setUsage("[-m server|client] [--credentials file] [--username user --password pass]");
+			helpFormatter.setUsage("[-m server|client|compile-credentials] [--credentials file] [--output file] [--tun interface] [--username user --password pass]");
 			helpFormatter.setHeader("Custom VPN application powered by Poco.");
 			helpFormatter.format(std::cout);
 			return Application::EXIT_OK;
@@ -91,6 +106,20 @@ protected:
 			if (!_password.empty()) cfg.password = _password;
 			vpn::VpnClient client(cfg);
 			client.connect();
+			if (!_tunName.empty()) {
+#if defined(__linux__)
+				vpn::TunDevice tun(_tunName);
+				tun.configure(client.virtualAddresses());
+				client.startPacketIO(tun);
+				logger().information("Tunneling traffic of " + tun.name());
+				waitForTerminationRequest();
+				client.disconnect();
+				return Application::EXIT_OK;
+#else
+				logger().error("TUN interfaces are only supported on Linux.");
+				return Application::EXIT_USAGE;
+#endif
+			}
 			// Demo: send framed data and print size of echo
 			auto payload = std::vector<unsigned char>{'P','I','N','G'};
 			client.send(payload);
@@ -99,6 +128,13 @@ protected:
 				std::cout << "Received " << resp.size() << " bytes\n";
 			}
 			client.disconnect();
+		} else if (_mode == "compile-credentials") {
+			if (_credentialFile.empty() || _outputFile.empty()) {
+				logger().error("compile-credentials needs --credentials and --output.");
+				return Application::EXIT_USAGE;
+			}
+			vpn::compileCredentialIndex(_credentialFile, _outputFile);
+			logger().information("Wrote credential index " + _outputFile);
 		} else {
 			logger().information("No mode specified. Use --mode=server or --mode=client.");
 		}
@@ -109,6 +145,8 @@ private:
 	bool _helpRequested;
 	std::string _mode;
 	std::string _credentialFile;
+	std::string _outputFile;
+	std::string _tunName;
 	std::string _username;
 	std::string _password;
 };
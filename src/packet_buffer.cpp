@@ -0,0 +1,95 @@
+#include "vpn/packet_buffer.h"
+
+#include <stdexcept>
+#include <cstring>
+
+namespace vpn {
+
+PacketBuffer::PacketBuffer(std::size_t headroom, std::size_t capacity, std::size_t tailroom)
+	: _block(BufferBlock::allocate(headroom + capacity + tailroom))
+	, _offset(headroom) {}
+
+PacketBuffer::PacketBuffer(BufferPool& pool, std::size_t headroom, std::size_t capacity, std::size_t tailroom)
+	: _block(pool.acquire(headroom + capacity + tailroom))
+	, _offset(headroom) {}
+
+PacketBuffer::PacketBuffer(const PacketBuffer& other)
+	: _offset(other._offset)
+	, _size(other._size) {
+	if (other._block) {
+		_block = other._block->sibling(other.capacity());
+		std::memcpy(storage(), other.storage(), other._offset + other._size);
+	}
+}
+
+PacketBuffer& PacketBuffer::operator=(const PacketBuffer& other) {
+	if (this != &other) {
+		PacketBuffer copy(other);
+		*this = std::move(copy);
+	}
+	return *this;
+}
+
+PacketBuffer::PacketBuffer(PacketBuffer&& other) noexcept
+	: _block(std::move(other._block))
+	, _offset(other._offset)
+	, _size(other._size) {
+	other._offset = 0;
+	other._size = 0;
+}
+
+PacketBuffer& PacketBuffer::operator=(PacketBuffer&& other) noexcept {
+	if (this != &other) {
+		_block = std::move(other._block);
+		_offset = other._offset;
+		_size = other._size;
+		other._offset = 0;
+		other._size = 0;
+	}
+	return *this;
+}
+
+void PacketBuffer::reset(std::size_t headroom) {
+	_size = 0;
+	if (capacity() < headroom) grow(headroom);
+	_offset = headroom;
+}
+
+std::uint8_t* PacketBuffer::push(std::size_t n) {
+	if (n > _offset) throw std::runtime_error("insufficient packet headroom");
+	_offset -= n;
+	_size += n;
+	return data();
+}
+
+void PacketBuffer::pull(std::size_t n) {
+	if (n > _size) throw std::runtime_error("pull beyond packet payload");
+	_offset += n;
+	_size -= n;
+}
+
+std::uint8_t* PacketBuffer::put(std::size_t n) {
+	if (tailroom() < n) grow(_offset + _size + n);
+	std::uint8_t* region = data() + _size;
+	_size += n;
+	return region;
+}
+
+void PacketBuffer::trim(std::size_t len) {
+	if (len > _size) throw std::runtime_error("trim beyond packet payload");
+	_size = len;
+}
+
+void PacketBuffer::assign(const std::uint8_t* p, std::size_t len) {
+	_size = 0;
+	if (len > 0) std::memcpy(put(len), p, len);
+}
+
+void PacketBuffer::grow(std::size_t capacity) {
+	// new block from the same pool; headroom and payload keep their offsets
+	BufferBlock::Ptr block = _block ? _block->sibling(capacity) : BufferBlock::allocate(capacity);
+	if (_block) std::memcpy(block->data(), storage(), _offset + _size);
+	_block = block;
+}
+
+} // namespace vpn
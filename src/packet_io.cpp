@@ -0,0 +1,248 @@
+#include "vpn/packet_io.h"
+
+#include <Poco/Net/IPAddress.h>
+#include <stdexcept>
+#include <cstring>
+#include <memory>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <linux/ipv6.h>
+#endif
+
+namespace vpn {
+
+MemoryPacketIO::MemoryPacketIO(std::size_t mtu)
+	: _mtu(mtu) {}
+
+std::size_t MemoryPacketIO::read(std::vector<PacketBuffer>& packets, std::chrono::milliseconds timeout) {
+	if (packets.empty()) return 0;
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	for (;;) {
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			if (_woken) {
+				_woken = false;
+				return 0;
+			}
+			std::size_t count = 0;
+			while (count < packets.size() && !_inbound.empty()) {
+				const auto& packet = _inbound.front();
+				packets[count].trim(0);
+				std::memcpy(packets[count].put(packet.size()), packet.data(), packet.size());
+				_inbound.pop_front();
+				++count;
+			}
+			if (count > 0) return count;
+		}
+		const auto now = std::chrono::steady_clock::now();
+		if (now >= deadline) return 0;
+		_readable.tryWait(static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1);
+	}
+}
+
+void MemoryPacketIO::write(ByteView packet) {
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+		_written.emplace_back(packet.data, packet.data + packet.size);
+	}
+	_writtenReady.set();
+}
+
+void MemoryPacketIO::wakeUp() {
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+		_woken = true;
+	}
+	_readable.set();
+}
+
+void MemoryPacketIO::inject(std::vector<std::uint8_t> packet) {
+	if (packet.size() > _mtu) throw std::invalid_argument("packet larger than the MTU");
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+		_inbound.push_back(std::move(packet));
+	}
+	_readable.set();
+}
+
+std::vector<std::vector<std::uint8_t>> MemoryPacketIO::takeWritten(std::size_t count, std::chrono::milliseconds timeout) {
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	for (;;) {
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			const auto now = std::chrono::steady_clock::now();
+			if (_written.size() >= count || now >= deadline) {
+				std::vector<std::vector<std::uint8_t>> written;
+				written.swap(_written);
+				return written;
+			}
+		}
+		const auto now = std::chrono::steady_clock::now();
+		_writtenReady.tryWait(static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1);
+	}
+}
+
+#if defined(__linux__)
+
+static std::runtime_error systemError(const std::string& what) {
+	return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Datagram socket for interface ioctls, closed on every way out
+class ControlSocket {
+public:
+	explicit ControlSocket(int family)
+		: _fd(::socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) {
+		if (_fd < 0) throw systemError("socket failed");
+	}
+	~ControlSocket() { ::close(_fd); }
+	ControlSocket(const ControlSocket&) = delete;
+	ControlSocket& operator=(const ControlSocket&) = delete;
+
+	void control(unsigned long request, void* arg, const std::string& what) {
+		if (::ioctl(_fd, request, arg) < 0) throw systemError(what + " failed");
+	}
+
+private:
+	int _fd;
+};
+
+static int openTun(const std::string& name, short flags, std::string& actualName) {
+	const int fd = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) throw systemError("cannot open /dev/net/tun");
+	struct ifreq ifr;
+	std::memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = flags;
+	std::strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+	if (::ioctl(fd, TUNSETIFF, &ifr) < 0) {
+		const int error = errno;
+		::close(fd);
+		errno = error;
+		return -1;
+	}
+	actualName = ifr.ifr_name;
+	return fd;
+}
+
+TunDevice::TunDevice(const std::string& name, bool multiQueue, std::size_t mtu)
+	: _mtu(mtu) {
+	if (name.size() >= IFNAMSIZ) throw std::invalid_argument("interface name too long: " + name);
+	if (mtu == 0 || mtu > 65535) throw std::invalid_argument("MTU out of range");
+	const short flags = IFF_TUN | IFF_NO_PI;
+	if (multiQueue) {
+		_fd = openTun(name, flags | IFF_MULTI_QUEUE, _name);
+		// EINVAL: no multi-queue support, or an existing single-queue device
+		if (_fd >= 0) _multiQueue = true;
+		else if (errno != EINVAL) throw systemError("cannot attach to TUN device " + name);
+	}
+	if (_fd < 0) {
+		_fd = openTun(name, flags, _name);
+		if (_fd < 0) throw systemError("cannot attach to TUN device " + name);
+	}
+	_wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wakeFd < 0) {
+		const auto error = systemError("eventfd failed");
+		::close(_fd);
+		throw error;
+	}
+}
+
+TunDevice::~TunDevice() {
+	::close(_wakeFd);
+	::close(_fd);
+}
+
+std::size_t TunDevice::read(std::vector<PacketBuffer>& packets, std::chrono::milliseconds timeout) {
+	if (packets.empty()) return 0;
+	struct pollfd fds[2] = {{_fd, POLLIN, 0}, {_wakeFd, POLLIN, 0}};
+	const int ready = ::poll(fds, 2, static_cast<int>(timeout.count()));
+	if (ready < 0) {
+		if (errno == EINTR) return 0;
+		throw systemError("poll on " + _name + " failed");
+	}
+	if (fds[1].revents & POLLIN) {
+		std::uint64_t count;
+		while (::read(_wakeFd, &count, sizeof(count)) > 0) {}
+		return 0;
+	}
+	if (fds[0].revents & (POLLERR | POLLHUP)) throw std::runtime_error("TUN device " + _name + " went away");
+	if (!(fds[0].revents & POLLIN)) return 0;
+	// one wakeup, as many packets as are queued: one read() each
+	std::size_t count = 0;
+	while (count < packets.size()) {
+		PacketBuffer& packet = packets[count];
+		packet.trim(0);
+		const ssize_t n = ::read(_fd, packet.put(_mtu), _mtu);
+		if (n < 0) {
+			packet.trim(0);
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			throw systemError("read from " + _name + " failed");
+		}
+		packet.trim(static_cast<std::size_t>(n));
+		if (n > 0) ++count;
+	}
+	return count;
+}
+
+void TunDevice::write(ByteView packet) {
+	// a full interface queue drops the packet, as a congested link would
+	if (::write(_fd, packet.data, packet.size) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+		throw systemError("write to " + _name + " failed");
+	}
+}
+
+void TunDevice::wakeUp() {
+	const std::uint64_t one = 1;
+	if (::write(_wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) throw systemError("eventfd write failed");
+}
+
+void TunDevice::configure(const std::vector<std::string>& addresses) {
+	ControlSocket sock4(AF_INET);
+	std::unique_ptr<ControlSocket> sock6; // IPv6 addresses go through an AF_INET6 socket and the interface index
+	struct ifreq ifr;
+	std::memset(&ifr, 0, sizeof(ifr));
+	std::strncpy(ifr.ifr_name, _name.c_str(), IFNAMSIZ - 1);
+	ifr.ifr_mtu = static_cast<int>(_mtu);
+	sock4.control(SIOCSIFMTU, &ifr, "setting the MTU on " + _name);
+	for (const auto& cidr : addresses) {
+		const auto slash = cidr.find('/');
+		const Poco::Net::IPAddress address(cidr.substr(0, slash));
+		const unsigned length = slash == std::string::npos ? 8 * address.length() : static_cast<unsigned>(std::stoul(cidr.substr(slash + 1)));
+		if (length > 8 * address.length()) throw std::invalid_argument("prefix length out of range: " + cidr);
+		if (address.family() == Poco::Net::IPAddress::IPv4) {
+			auto* in = reinterpret_cast<struct sockaddr_in*>(&ifr.ifr_addr);
+			in->sin_family = AF_INET;
+			std::memcpy(&in->sin_addr, address.addr(), 4);
+			sock4.control(SIOCSIFADDR, &ifr, "adding " + cidr + " to " + _name);
+			in->sin_addr.s_addr = length == 0 ? 0 : htonl(0xFFFFFFFFu << (32 - length));
+			sock4.control(SIOCSIFNETMASK, &ifr, "setting the netmask of " + cidr);
+		} else {
+			if (!sock6) sock6 = std::make_unique<ControlSocket>(AF_INET6);
+			sock4.control(SIOCGIFINDEX, &ifr, "looking up " + _name);
+			struct in6_ifreq ifr6;
+			std::memset(&ifr6, 0, sizeof(ifr6));
+			std::memcpy(&ifr6.ifr6_addr, address.addr(), 16);
+			ifr6.ifr6_prefixlen = length;
+			ifr6.ifr6_ifindex = ifr.ifr_ifindex;
+			sock6->control(SIOCSIFADDR, &ifr6, "adding " + cidr + " to " + _name);
+		}
+	}
+	sock4.control(SIOCGIFFLAGS, &ifr, "reading the flags of " + _name);
+	ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+	sock4.control(SIOCSIFFLAGS, &ifr, "bringing up " + _name);
+}
+
+#endif
+
+} // namespace vpn
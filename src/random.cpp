@@ -0,0 +1,131 @@
+#include "vpn/random.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+namespace vpn {
+
+static const std::size_t kKeyLen = 32;
+static const std::size_t kBufferLen = 4096;
+
+// Bumped in the child after fork() so every thread's generator reseeds
+static std::atomic<unsigned> g_forkGeneration{0};
+
+// OpenSSL's generator, seeded from the OS, for reseeding only
+static void osRandom(std::uint8_t* out, std::size_t len) {
+	if (RAND_bytes(out, static_cast<int>(len)) != 1) throw std::runtime_error("RAND_bytes failed");
+}
+
+class ThreadRandom {
+public:
+	ThreadRandom()
+		: _ctx(EVP_CIPHER_CTX_new()) {
+		if (!_ctx) throw std::runtime_error("EVP_CIPHER_CTX_new failed");
+#if !defined(_WIN32)
+		static const bool atforkRegistered = [] {
+			pthread_atfork(nullptr, nullptr, [] { g_forkGeneration.fetch_add(1); });
+			return true;
+		}();
+		(void)atforkRegistered;
+#endif
+		reseed();
+	}
+
+	~ThreadRandom() {
+		OPENSSL_cleanse(_key, sizeof(_key));
+		OPENSSL_cleanse(_buffer, sizeof(_buffer));
+		EVP_CIPHER_CTX_free(_ctx);
+	}
+
+	ThreadRandom(const ThreadRandom&) = delete;
+	ThreadRandom& operator=(const ThreadRandom&) = delete;
+
+	void fill(std::uint8_t* out, std::size_t len) {
+		if (_generation != g_forkGeneration.load(std::memory_order_relaxed) || _sinceReseed >= kRandomReseedInterval) {
+			reseed();
+		}
+		while (len > 0) {
+			if (_pos == kBufferLen) refill();
+			const std::size_t n = std::min(len, kBufferLen - _pos);
+			std::memcpy(out, _buffer + _pos, n);
+			// served bytes are wiped so a later memory disclosure cannot replay them
+			std::memset(_buffer + _pos, 0, n);
+			_pos += n;
+			_sinceReseed += n;
+			out += n;
+			len -= n;
+		}
+	}
+
+private:
+	void reseed() {
+		// mix fresh OS entropy into the current key; discard buffered output
+		std::uint8_t seed[kKeyLen];
+		osRandom(seed, sizeof(seed));
+		for (std::size_t i = 0; i < kKeyLen; ++i) _key[i] ^= seed[i];
+		OPENSSL_cleanse(seed, sizeof(seed));
+		_generation = g_forkGeneration.load(std::memory_order_relaxed);
+		_sinceReseed = 0;
+		refill();
+	}
+
+	void refill() {
+		// ChaCha20 keystream over [next key][output]; the key is used for exactly one refill
+		static const std::uint8_t zeroIv[16] = {0};
+		std::uint8_t block[kKeyLen + kBufferLen] = {0};
+		int n = 0;
+		if (EVP_EncryptInit_ex(_ctx, EVP_chacha20(), nullptr, _key, zeroIv) != 1 ||
+		    EVP_EncryptUpdate(_ctx, block, &n, block, static_cast<int>(sizeof(block))) != 1) {
+			throw std::runtime_error("random generator refill failed");
+		}
+		std::memcpy(_key, block, kKeyLen);
+		std::memcpy(_buffer, block + kKeyLen, kBufferLen);
+		OPENSSL_cleanse(block, sizeof(block));
+		_pos = 0;
+	}
+
+	EVP_CIPHER_CTX* _ctx;
+	std::uint8_t _key[kKeyLen] = {0};
+	std::uint8_t _buffer[kBufferLen] = {0};
+	std::size_t _pos = kBufferLen;
+	std::size_t _sinceReseed = 0;
+	unsigned _generation = 0;
+};
+
+void secureRandom(std::uint8_t* out, std::size_t len) {
+	thread_local ThreadRandom rng;
+	rng.fill(out, len);
+}
+
+std::vector<std::uint8_t> secureRandomBytes(std::size_t len) {
+	std::vector<std::uint8_t> v(len);
+	secureRandom(v.data(), len);
+	return v;
+}
+
+std::string randomSessionId() {
+	std::uint8_t b[16];
+	secureRandom(b, sizeof(b));
+	b[6] = static_cast<std::uint8_t>((b[6] & 0x0F) | 0x40); // version 4
+	b[8] = static_cast<std::uint8_t>((b[8] & 0x3F) | 0x80); // RFC 4122 variant
+	static const char hex[] = "0123456789abcdef";
+	std::string id;
+	id.reserve(36);
+	for (std::size_t i = 0; i < sizeof(b); ++i) {
+		if (i == 4 || i == 6 || i == 8 || i == 10) id.push_back('-');
+		id.push_back(hex[b[i] >> 4]);
+		id.push_back(hex[b[i] & 0x0F]);
+	}
+	return id;
+}
+
+} // namespace vpn
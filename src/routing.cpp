@@ -0,0 +1,285 @@
+#include "vpn/routing.h"
+
+#include <stdexcept>
+#include <cstring>
+
+namespace vpn {
+
+struct RoutingTable::Node {
+	struct Slot {
+		std::shared_ptr<const Node> child; // the next stride
+		SessionRegistry::EntryPtr target;  // most specific route ending in this stride
+		unsigned length = 0;               // of that route; 0 = none
+	};
+	std::array<Slot, 256> slots;
+};
+
+struct RoutingTable::Snapshot {
+	std::shared_ptr<const Node> roots[2]; // IPv4, IPv6
+	SessionRegistry::EntryPtr defaults[2]; // routes of length 0
+};
+
+static std::atomic<std::uint64_t> nextTableId{1};
+
+RoutingTable::RoutingTable()
+	: _id(nextTableId++)
+	, _snapshot(std::make_shared<const Snapshot>()) {}
+
+RoutingTable::~RoutingTable() = default;
+
+// Clears the bits of address past length
+static std::array<std::uint8_t, 16> maskedBytes(std::array<std::uint8_t, 16> address, unsigned length) {
+	for (unsigned i = 0; i < address.size(); ++i) {
+		if (length >= 8 * (i + 1)) continue;
+		const unsigned keep = length > 8 * i ? length - 8 * i : 0;
+		address[i] &= static_cast<std::uint8_t>(0xFF00 >> keep);
+	}
+	return address;
+}
+
+RoutingTable::RouteKey RoutingTable::routeKey(const Poco::Net::IPAddress& prefix, unsigned length) {
+	const bool v6 = prefix.family() == Poco::Net::IPAddress::IPv6;
+	const unsigned bytes = prefix.length();
+	if (length > 8 * bytes) throw std::invalid_argument("prefix length out of range: " + prefix.toString());
+	Bytes address{};
+	std::memcpy(address.data(), prefix.addr(), bytes);
+	return RouteKey(v6, maskedBytes(address, length), length);
+}
+
+void RoutingTable::add(const Poco::Net::IPAddress& prefix, unsigned length, SessionRegistry::EntryPtr target) {
+	if (!target) throw std::invalid_argument("route without a target");
+	const RouteKey key = routeKey(prefix, length);
+	Poco::FastMutex::ScopedLock lock(_writeMutex);
+	_routes[key] = std::move(target);
+	update(key);
+}
+
+bool RoutingTable::remove(const Poco::Net::IPAddress& prefix, unsigned length) {
+	const RouteKey key = routeKey(prefix, length);
+	Poco::FastMutex::ScopedLock lock(_writeMutex);
+	if (_routes.erase(key) == 0) return false;
+	update(key);
+	return true;
+}
+
+std::size_t RoutingTable::size() const {
+	Poco::FastMutex::ScopedLock lock(_writeMutex);
+	return _routes.size();
+}
+
+// The longest route for address with a length from longest down to shortest
+RoutingTable::Route RoutingTable::coveringRoute(bool v6, const Bytes& address, unsigned longest, unsigned shortest) const {
+	for (unsigned length = longest; length >= shortest && length > 0; --length) {
+		auto it = _routes.find(RouteKey(v6, maskedBytes(address, length), length));
+		if (it != _routes.end()) return Route{it->second, length};
+	}
+	return Route();
+}
+
+// Publishes a snapshot in which the slots of key's stride reflect _routes.
+// Only the nodes on the path to that stride are copied; the rest are shared
+// with the current snapshot.
+void RoutingTable::update(const RouteKey& key) {
+	const bool v6 = std::get<0>(key);
+	const Bytes& address = std::get<1>(key);
+	const unsigned length = std::get<2>(key);
+	auto next = std::make_shared<Snapshot>(*_snapshot);
+	if (length == 0) {
+		auto it = _routes.find(key);
+		next->defaults[v6] = it != _routes.end() ? it->second : nullptr;
+	} else {
+		const unsigned depth = (length - 1) / 8;
+		const std::shared_ptr<const Node>& root = next->roots[v6];
+		auto node = root ? std::make_shared<Node>(*root) : std::make_shared<Node>();
+		next->roots[v6] = node;
+		for (unsigned i = 0; i < depth; ++i) {
+			Node::Slot& slot = node->slots[address[i]];
+			auto child = slot.child ? std::make_shared<Node>(*slot.child) : std::make_shared<Node>();
+			slot.child = child;
+			node = std::move(child);
+		}
+		// a route shorter than the stride covers a run of slots; more specific
+		// routes in that run keep theirs
+		const Route best = coveringRoute(v6, address, length, 8 * depth + 1);
+		const unsigned span = 1u << (8 * (depth + 1) - length);
+		const unsigned first = address[depth] & ~(span - 1);
+		for (unsigned i = first; i < first + span; ++i) {
+			Node::Slot& slot = node->slots[i];
+			if (slot.length > length) continue;
+			slot.target = best.target;
+			slot.length = best.length;
+		}
+	}
+	Poco::FastMutex::ScopedLock lock(_mutex);
+	_snapshot = std::move(next);
+	_version.fetch_add(1, std::memory_order_release);
+}
+
+// As CredentialStore::snapshot(): each thread remembers the snapshot it last
+// used, weakly, and only goes to the mutex after a change bumped the version
+std::shared_ptr<const RoutingTable::Snapshot> RoutingTable::snapshot() const {
+	struct Cached {
+		std::uint64_t table = 0;
+		std::uint64_t version = 0;
+		std::weak_ptr<const Snapshot> snapshot;
+	};
+	thread_local Cached cached;
+	if (cached.table == _id && cached.version == _version.load(std::memory_order_acquire)) {
+		if (auto snap = cached.snapshot.lock()) return snap;
+	}
+	Poco::FastMutex::ScopedLock lock(_mutex);
+	cached.table = _id;
+	cached.version = _version.load(std::memory_order_relaxed);
+	cached.snapshot = _snapshot;
+	return _snapshot;
+}
+
+SessionRegistry::EntryPtr RoutingTable::lookup(const std::uint8_t* address, bool v6) const {
+	const auto snap = snapshot();
+	const SessionRegistry::EntryPtr* best = &snap->defaults[v6];
+	const Node* node = snap->roots[v6].get();
+	const unsigned bytes = v6 ? 16 : 4;
+	for (unsigned i = 0; node && i < bytes; ++i) {
+		const Node::Slot& slot = node->slots[address[i]];
+		if (slot.length) best = &slot.target;
+		node = slot.child.get();
+	}
+	return *best;
+}
+
+// Hands out the host addresses of one network, lowest first, reusing released ones
+class VirtualNetwork::AddressPool {
+public:
+	AddressPool(const std::string& network, Poco::Net::IPAddress::Family family) {
+		const auto slash = network.find('/');
+		if (slash == std::string::npos) throw std::invalid_argument("virtual network needs a prefix length: " + network);
+		const Poco::Net::IPAddress base(network.substr(0, slash));
+		if (base.family() != family) throw std::invalid_argument("virtual network of the wrong address family: " + network);
+		_bytes = base.length();
+		_prefixLength = static_cast<unsigned>(std::stoul(network.substr(slash + 1)));
+		// room for the network address, the server and at least one client
+		if (_prefixLength + 2 > 8 * _bytes) throw std::invalid_argument("virtual network too small: " + network);
+		std::array<std::uint8_t, 16> bytes{};
+		std::memcpy(bytes.data(), base.addr(), _bytes);
+		_base = maskedBytes(bytes, _prefixLength);
+		const unsigned hostBits = 8 * _bytes - _prefixLength;
+		// offsets are 32-bit; IPv4 keeps its broadcast address out
+		_hostMask = hostBits >= 32 ? 0xFFFFFFFFULL : (1ULL << hostBits) - 1;
+		_limit = family == Poco::Net::IPAddress::IPv4 ? _hostMask : _hostMask + 1;
+	}
+
+	VirtualAddress allocate() {
+		std::uint64_t offset = 0;
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			if (!_free.empty()) {
+				offset = _free.back();
+				_free.pop_back();
+			} else if (_next < _limit) {
+				offset = _next++;
+			} else {
+				throw std::runtime_error("virtual address pool exhausted");
+			}
+		}
+		std::array<std::uint8_t, 16> bytes = _base;
+		for (unsigned i = 0; i < 4; ++i) {
+			bytes[_bytes - 1 - i] |= static_cast<std::uint8_t>((offset >> (8 * i)) & 0xFF);
+		}
+		VirtualAddress address;
+		address.address = Poco::Net::IPAddress(bytes.data(), static_cast<poco_socklen_t>(_bytes));
+		address.prefixLength = _prefixLength;
+		return address;
+	}
+
+	void release(const Poco::Net::IPAddress& address) {
+		const auto* bytes = static_cast<const std::uint8_t*>(address.addr());
+		std::uint64_t offset = 0;
+		for (unsigned i = _bytes - 4; i < _bytes; ++i) offset = (offset << 8) | bytes[i];
+		offset &= _hostMask;
+		Poco::FastMutex::ScopedLock lock(_mutex);
+		_free.push_back(offset);
+	}
+
+private:
+	std::array<std::uint8_t, 16> _base{};
+	unsigned _bytes = 4;
+	unsigned _prefixLength = 0;
+	std::uint64_t _hostMask = 0;
+	std::uint64_t _limit = 0; // first offset past the pool
+	Poco::FastMutex _mutex;
+	std::uint64_t _next = 2; // .0 is the network, .1 the server
+	std::vector<std::uint64_t> _free;
+};
+
+VirtualNetwork::VirtualNetwork(const std::string& network4, const std::string& network6) {
+	if (!network4.empty()) _pool4 = std::make_unique<AddressPool>(network4, Poco::Net::IPAddress::IPv4);
+	if (!network6.empty()) _pool6 = std::make_unique<AddressPool>(network6, Poco::Net::IPAddress::IPv6);
+	if (!_pool4 && !_pool6) throw std::invalid_argument("virtual network without an address pool");
+}
+
+VirtualNetwork::~VirtualNetwork() = default;
+
+void VirtualNetwork::attach(const SessionRegistry::EntryPtr& entry) {
+	std::vector<VirtualAddress> addresses;
+	if (_pool4) addresses.push_back(_pool4->allocate());
+	if (_pool6) {
+		try {
+			addresses.push_back(_pool6->allocate());
+		} catch (...) {
+			if (_pool4) _pool4->release(addresses.front().address);
+			throw;
+		}
+	}
+	entry->setVirtualAddresses(addresses);
+	for (const auto& a : addresses) _routes.add(a.address, 8 * a.address.length(), entry);
+}
+
+void VirtualNetwork::detach(const SessionEntry& entry) {
+	for (const auto& a : entry.virtualAddresses()) {
+		_routes.remove(a.address, 8 * a.address.length());
+		(a.address.family() == Poco::Net::IPAddress::IPv6 ? _pool6 : _pool4)->release(a.address);
+	}
+}
+
+bool VirtualNetwork::forward(const SessionEntry& source, ByteView packet) {
+	const std::uint8_t* src = nullptr;
+	const std::uint8_t* dst = nullptr;
+	bool v6 = false;
+	const unsigned version = packet.size > 0 ? packet.data[0] >> 4 : 0;
+	if (version == 4 && packet.size >= 20) {
+		src = packet.data + 12;
+		dst = packet.data + 16;
+	} else if (version == 6 && packet.size >= 40) {
+		src = packet.data + 8;
+		dst = packet.data + 24;
+		v6 = true;
+	} else {
+		++_malformed;
+		return false;
+	}
+	if (!source.ownsAddress(src, v6)) {
+		++_spoofed;
+		return false;
+	}
+	const SessionRegistry::EntryPtr target = _routes.lookup(dst, v6);
+	if (!target) {
+		++_unroutable;
+		return false;
+	}
+	if (!target->deliver(packet)) {
+		++_queueFull;
+		return false;
+	}
+	return true;
+}
+
+ForwardStats VirtualNetwork::stats() const {
+	ForwardStats stats;
+	stats.malformed = _malformed;
+	stats.spoofed = _spoofed;
+	stats.unroutable = _unroutable;
+	stats.queueFull = _queueFull;
+	return stats;
+}
+
+} // namespace vpn
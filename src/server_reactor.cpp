@@ -0,0 +1,490 @@
+#include "vpn/server_reactor.h"
+#include "vpn/server_session.h"
+#include "vpn/tunnel.h"
+
+#include <Poco/Net/SecureStreamSocket.h>
+#include <Poco/Net/PollSet.h>
+#include <Poco/Mutex.h>
+#include <Poco/Logger.h>
+#include <Poco/Format.h>
+#include <Poco/Exception.h>
+#include <Poco/Environment.h>
+#include <map>
+#include <chrono>
+#include <stdexcept>
+
+using Poco::Net::PollSet;
+using Poco::Net::SecureStreamSocket;
+
+namespace vpn {
+
+const std::size_t ServerReactor::kMaxWriteBacklog;
+
+// The client must finish the TLS handshake within this time; HELLO and AUTH have their own deadlines
+static const std::chrono::seconds kTlsHandshakeTimeout(10);
+// Sessions quiet for this long give their buffers back to the pool
+static const std::chrono::seconds kIdleRelease(1);
+// Connections a sharded worker accepts per poll round, so a reconnect storm
+// cannot starve the sessions it already serves
+static const int kAcceptBatch = 64;
+
+unsigned reactorThreadCount(const ServerConfig& config) {
+	if (config.reactorThreads > 0) return config.reactorThreads;
+	const unsigned cores = Poco::Environment::processorCount();
+	return cores > 0 ? cores : 1;
+}
+
+unsigned handshakeThreadCount(const ServerConfig& config) {
+	if (config.handshakeThreads > 0) return config.handshakeThreads;
+	const unsigned cores = Poco::Environment::processorCount();
+	return cores > 1 ? cores / 2 : 1;
+}
+
+struct ServerReactor::Connection {
+	explicit Connection(const Poco::Net::StreamSocket& s)
+		: socket(s) {}
+
+	SecureStreamSocket socket;
+	std::unique_ptr<Tunnel> tunnel; // created once TLS is established
+	std::unique_ptr<ServerSession> session;
+	int tlsWait = PollSet::POLL_READ; // what the TLS handshake waits for
+	std::chrono::steady_clock::time_point deadline; // end of the TLS handshake
+	std::chrono::steady_clock::time_point lastActive;
+	Worker* home = nullptr; // data worker that accepted it, if sharded
+};
+
+// One event loop. Handshake workers run connections until they are
+// authenticated and then pass them on; data workers run them to the end.
+class ServerReactor::Worker {
+public:
+	Worker(ServerReactor& reactor, bool handshakes)
+		: _reactor(reactor)
+		, _handshakes(handshakes) {}
+
+	void start() {
+		_stopping = false;
+		_thread.startFunc([this]() { run(); });
+	}
+
+	void stop() {
+		_stopping = true;
+		_pollSet.wakeUp();
+		_thread.join();
+	}
+
+	// Drops hand-offs that arrived after stop(); call once every worker is stopped
+	void discardIncoming() {
+		std::vector<std::unique_ptr<Connection>> incoming;
+		// destroyed unlocked: a session's destructor waits for its wakeup, which may be calling resumeLater()
+		Poco::FastMutex::ScopedLock lock(_mutex);
+		incoming.swap(_incoming);
+	}
+
+	void wakeUp() { _pollSet.wakeUp(); }
+
+	// Called on a KDF thread when a connection's password check finished
+	void resumeLater(const Poco::Net::Socket& socket) {
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			_verified.push_back(socket);
+		}
+		_pollSet.wakeUp();
+	}
+
+	// Makes this worker accept from its own listener; call before start()
+	void listen(const Poco::Net::ServerSocket& listener) {
+		_listener = listener;
+		_listener.setBlocking(false);
+		_pollSet.add(_listener, PollSet::POLL_READ);
+		_listening = true;
+		_listenerOpen = true;
+	}
+
+	// Called from other threads: the acceptor, or the previous stage
+	void adopt(std::unique_ptr<Connection> connection) {
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			_incoming.push_back(std::move(connection));
+		}
+		_pollSet.wakeUp();
+	}
+
+	std::size_t connectionCount() const { return _count; }
+
+private:
+	using ConnectionMap = std::map<Poco::Net::Socket, std::unique_ptr<Connection>>;
+
+	void run() {
+		auto lastSweep = std::chrono::steady_clock::now();
+		while (!_stopping) {
+			adoptIncoming();
+			resumeVerified();
+			if (_listening) gateListener();
+			// returns early when a socket is ready or adopt()/wakeUp()/stop() wake it
+			PollSet::SocketModeMap ready = _pollSet.poll(Poco::Timespan(1, 0));
+			const auto now = std::chrono::steady_clock::now();
+			for (const auto& entry : ready) {
+				if (_listening && entry.first == _listener) {
+					acceptPending();
+					continue;
+				}
+				auto it = _connections.find(entry.first);
+				if (it == _connections.end()) continue;
+				it->second->lastActive = now;
+				step(it);
+			}
+			if (now - lastSweep >= std::chrono::seconds(1)) {
+				sweep(now);
+				lastSweep = now;
+			}
+		}
+		while (!_connections.empty()) close(_connections.begin());
+		const auto small = BufferPool::forThread().stats(BufferPool::SMALL);
+		const auto bulk = BufferPool::forThread().stats(BufferPool::BULK);
+		Poco::Logger::get("VpnServer").debug(Poco::format(
+			"Reactor buffer pool small hits=%?u misses=%?u highWater=%?u, bulk hits=%?u misses=%?u highWater=%?u",
+			small.hits, small.misses, small.highWater, bulk.hits, bulk.misses, bulk.highWater));
+	}
+
+	void adoptIncoming() {
+		std::vector<std::unique_ptr<Connection>> incoming;
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			incoming.swap(_incoming);
+		}
+		for (auto& connection : incoming) {
+			const bool established = connection->session != nullptr;
+			Poco::Net::Socket key = connection->socket;
+			try {
+				// the client speaks first in TLS
+				_pollSet.add(connection->socket, PollSet::POLL_READ);
+			} catch (const std::exception& ex) {
+				Poco::Logger::get("VpnServer").warning(Poco::format("Connection error: %s", std::string(ex.what())));
+				if (_handshakes) _reactor.releaseAdmission();
+				continue;
+			}
+			auto it = _connections.emplace(key, std::move(connection)).first;
+			++_count;
+			if (!established) continue;
+			// close requests and forwarded packets now wake this worker; the
+			// resume sends what was forwarded during the hand-off and reads
+			// frames the handshake stage left behind
+			it->second->session->setWakeup([this, key]() { resumeLater(key); });
+			resumeLater(key);
+		}
+	}
+
+	void resumeVerified() {
+		std::vector<Poco::Net::Socket> verified;
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			verified.swap(_verified);
+		}
+		for (const auto& socket : verified) {
+			auto it = _connections.find(socket);
+			if (it == _connections.end()) continue; // closed meanwhile
+			bool keep = false;
+			try {
+				keep = it->second->session->resume();
+				if (!keep) it->second->tunnel->flush(); // the rejection or CLOSE
+			} catch (const std::exception& ex) {
+				Poco::Logger::get("VpnServer").warning(Poco::format("Connection error: %s", std::string(ex.what())));
+			}
+			if (!keep) {
+				close(it);
+				continue;
+			}
+			step(it); // sends the reply, then reads on
+		}
+	}
+
+	// While the handshake stage is full, new connections wait in this
+	// listener's backlog; releaseAdmission() wakes us when it drains
+	void gateListener() {
+		const bool open = _reactor.admitting();
+		if (open == _listenerOpen) return;
+		_pollSet.update(_listener, open ? PollSet::POLL_READ : 0);
+		_listenerOpen = open;
+	}
+
+	void acceptPending() {
+		for (int i = 0; i < kAcceptBatch; ++i) {
+			// the first accept is known to succeed; later ones only if more are queued
+			if (i > 0 && !_listener.poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ)) break;
+			if (!_reactor.tryAdmit()) break;
+			Poco::Net::StreamSocket socket;
+			try {
+				socket = _listener.acceptConnection();
+			} catch (const std::exception& ex) {
+				_reactor.releaseAdmission();
+				Poco::Logger::get("VpnServer").warning(Poco::format("Accept error: %s", std::string(ex.what())));
+				break;
+			}
+			_reactor.beginHandshake(socket, this);
+		}
+	}
+
+	// Runs a connection after readiness, then closes it or passes it on
+	void step(ConnectionMap::iterator it) {
+		Connection& c = *it->second;
+		bool keep = false;
+		try {
+			keep = onReady(c);
+		} catch (const std::exception& ex) {
+			Poco::Logger::get("VpnServer").warning(Poco::format("Connection error: %s", std::string(ex.what())));
+		}
+		if (!keep) {
+			close(it);
+		} else if (_handshakes && c.session && c.session->state() == ServerSession::State::DATA) {
+			handOff(it);
+		}
+	}
+
+	// Handles readiness of one connection; returns false when it should be closed
+	bool onReady(Connection& c) {
+		if (!c.session && !tlsHandshake(c)) {
+			_pollSet.update(c.socket, c.tlsWait);
+			return true;
+		}
+		Tunnel& tunnel = *c.tunnel;
+		// drain the backlog first: it decides whether we may read more
+		tunnel.flush();
+		while (!c.session->waiting() && tunnel.pendingBytes() < kMaxWriteBacklog) {
+			FrameView frame;
+			if (!tunnel.receiveFrame(frame, std::chrono::milliseconds(0))) {
+				if (tunnel.closed()) return false;
+				break;
+			}
+			if (!c.session->handleFrame(frame)) {
+				tunnel.flush();
+				return false;
+			}
+			// data is for the data workers
+			if (_handshakes && c.session->state() == ServerSession::State::DATA) break;
+		}
+		tunnel.flush();
+		updateInterest(c);
+		return true;
+	}
+
+	// Advances the TLS handshake; true once the session can start
+	bool tlsHandshake(Connection& c) {
+		const int rc = c.socket.completeHandshake();
+		if (rc == SecureStreamSocket::ERR_SSL_WANT_READ) {
+			c.tlsWait = PollSet::POLL_READ;
+			return false;
+		}
+		if (rc == SecureStreamSocket::ERR_SSL_WANT_WRITE) {
+			c.tlsWait = PollSet::POLL_WRITE;
+			return false;
+		}
+		c.tunnel = std::make_unique<Tunnel>(c.socket);
+		c.tunnel->setNonBlocking(true);
+		c.session = std::make_unique<ServerSession>(*c.tunnel, _reactor._store, _reactor._config,
+			_reactor._sessions, _reactor._network);
+		const Poco::Net::Socket key = c.socket;
+		c.session->setWakeup([this, key]() { resumeLater(key); });
+		return true;
+	}
+
+	void updateInterest(Connection& c) {
+		// a peer that does not read its replies is not read from either, nor
+		// one whose password is being checked
+		int mode = 0;
+		if (c.tunnel->pendingBytes() > 0) mode |= PollSet::POLL_WRITE;
+		if (c.tunnel->pendingBytes() < kMaxWriteBacklog && !c.session->waiting()) mode |= PollSet::POLL_READ;
+		_pollSet.update(c.socket, mode);
+	}
+
+	// Expires stalled handshakes and releases the buffers of idle sessions
+	void sweep(std::chrono::steady_clock::time_point now) {
+		for (auto it = _connections.begin(); it != _connections.end();) {
+			Connection& c = *it->second;
+			bool expired = false;
+			try {
+				if (!c.session) {
+					expired = now >= c.deadline;
+					if (expired) Poco::Logger::get("VpnServer").warning("Connection error: TLS handshake timed out");
+				} else if (c.session->expire(now)) {
+					c.tunnel->flush();
+					expired = true;
+				} else if (now - c.lastActive >= kIdleRelease) {
+					c.tunnel->releaseBuffers();
+				}
+			} catch (const std::exception& ex) {
+				Poco::Logger::get("VpnServer").warning(Poco::format("Connection error: %s", std::string(ex.what())));
+				expired = true;
+			}
+			it = expired ? close(it) : std::next(it);
+		}
+	}
+
+	void handOff(ConnectionMap::iterator it) {
+		std::unique_ptr<Connection> connection = std::move(it->second);
+		try {
+			_pollSet.remove(connection->socket);
+		} catch (...) {}
+		_connections.erase(it);
+		--_count;
+		// the data worker draws its buffers from its own pool
+		connection->tunnel->releaseBuffers();
+		_reactor.beginData(std::move(connection));
+	}
+
+	ConnectionMap::iterator close(ConnectionMap::iterator it) {
+		try {
+			_pollSet.remove(it->second->socket);
+		} catch (...) {}
+		--_count;
+		if (_handshakes) _reactor.releaseAdmission();
+		// the tunnel goes before its socket; the socket closes with its last reference
+		return _connections.erase(it);
+	}
+
+	ServerReactor& _reactor;
+	const bool _handshakes;
+	PollSet _pollSet;
+	Poco::Net::ServerSocket _listener;
+	bool _listening = false;
+	bool _listenerOpen = false;
+	Poco::Thread _thread;
+	std::atomic<bool> _stopping{false};
+	Poco::FastMutex _mutex; // guards _incoming and _verified
+	std::vector<std::unique_ptr<Connection>> _incoming;
+	std::vector<Poco::Net::Socket> _verified; // sessions whose password check finished
+	ConnectionMap _connections; // worker thread only
+	std::atomic<std::size_t> _count{0};
+};
+
+ServerReactor::ServerReactor(const Poco::Net::ServerSocket& socket, CredentialStore::Ptr store, const ServerConfig& config,
+                             SessionRegistry::Ptr sessions, VirtualNetwork::Ptr network)
+	: _socket(socket)
+	, _store(std::move(store))
+	, _sessions(std::move(sessions))
+	, _network(std::move(network))
+	, _config(config) {
+	const unsigned threads = reactorThreadCount(_config);
+	for (unsigned i = 0; i < threads; ++i) {
+		_workers.push_back(std::make_unique<Worker>(*this, false));
+	}
+	createHandshakers();
+}
+
+ServerReactor::ServerReactor(const std::vector<Poco::Net::ServerSocket>& listeners, CredentialStore::Ptr store, const ServerConfig& config,
+                             SessionRegistry::Ptr sessions, VirtualNetwork::Ptr network)
+	: _store(std::move(store))
+	, _sessions(std::move(sessions))
+	, _network(std::move(network))
+	, _config(config)
+	, _sharded(true) {
+	if (listeners.empty()) throw std::invalid_argument("at least one listener is required");
+	for (const auto& listener : listeners) {
+		_workers.push_back(std::make_unique<Worker>(*this, false));
+		_workers.back()->listen(listener);
+	}
+	createHandshakers();
+}
+
+ServerReactor::~ServerReactor() {
+	stop();
+}
+
+void ServerReactor::createHandshakers() {
+	if (_config.maxPendingHandshakes == 0) throw std::invalid_argument("maxPendingHandshakes must be at least 1");
+	const unsigned threads = handshakeThreadCount(_config);
+	for (unsigned i = 0; i < threads; ++i) {
+		_handshakers.push_back(std::make_unique<Worker>(*this, true));
+	}
+}
+
+void ServerReactor::start() {
+	if (_running) return;
+	_stopping = false;
+	for (auto& worker : _workers) worker->start();
+	for (auto& worker : _handshakers) worker->start();
+	if (!_sharded) _acceptor.startFunc([this]() { acceptLoop(); });
+	_running = true;
+}
+
+void ServerReactor::stop() {
+	if (!_running) return;
+	_stopping = true;
+	if (!_sharded) _acceptor.join();
+	// handshakes first: they hand sessions to the data workers
+	for (auto& worker : _handshakers) worker->stop();
+	for (auto& worker : _workers) worker->stop();
+	for (auto& worker : _handshakers) worker->discardIncoming();
+	for (auto& worker : _workers) worker->discardIncoming();
+	_handshaking = 0;
+	_running = false;
+}
+
+std::size_t ServerReactor::connectionCount() const {
+	std::size_t count = 0;
+	for (const auto& worker : _workers) count += worker->connectionCount();
+	for (const auto& worker : _handshakers) count += worker->connectionCount();
+	return count;
+}
+
+bool ServerReactor::tryAdmit() {
+	unsigned n = _handshaking;
+	while (n < _config.maxPendingHandshakes) {
+		if (_handshaking.compare_exchange_weak(n, n + 1)) return true;
+	}
+	return false;
+}
+
+void ServerReactor::releaseAdmission() {
+	if (_handshaking.fetch_sub(1) != _config.maxPendingHandshakes) return;
+	// the stage was full: whoever stopped accepting may resume
+	_slotFree.set();
+	if (_sharded) {
+		for (auto& worker : _workers) worker->wakeUp();
+	}
+}
+
+void ServerReactor::beginHandshake(Poco::Net::StreamSocket& socket, Worker* home) {
+	try {
+		// the TLS handshake is lazy: it runs on the handshake worker, one step per readiness event
+		socket.setBlocking(false);
+		socket.setNoDelay(true);
+		auto connection = std::make_unique<Connection>(socket);
+		const auto now = std::chrono::steady_clock::now();
+		connection->deadline = now + kTlsHandshakeTimeout;
+		connection->lastActive = now;
+		connection->home = home;
+		_handshakers[_nextHandshaker++ % _handshakers.size()]->adopt(std::move(connection));
+	} catch (const std::exception& ex) {
+		releaseAdmission();
+		Poco::Logger::get("VpnServer").warning(Poco::format("Connection error: %s", std::string(ex.what())));
+	}
+}
+
+void ServerReactor::beginData(std::unique_ptr<Connection> connection) {
+	releaseAdmission();
+	Worker* worker = connection->home ? connection->home : _workers[_nextWorker++ % _workers.size()].get();
+	worker->adopt(std::move(connection));
+}
+
+void ServerReactor::acceptLoop() {
+	while (!_stopping) {
+		// a full handshake stage leaves new connections in the listen backlog
+		if (!tryAdmit()) {
+			_slotFree.tryWait(250);
+			continue;
+		}
+		try {
+			// short waits so stop() is noticed without closing the listening socket
+			if (_socket.poll(Poco::Timespan(0, 250000), Poco::Net::Socket::SELECT_READ)) {
+				Poco::Net::StreamSocket socket = _socket.acceptConnection();
+				beginHandshake(socket, nullptr); // takes over the admission
+				continue;
+			}
+		} catch (const std::exception& ex) {
+			Poco::Logger::get("VpnServer").warning(Poco::format("Accept error: %s", std::string(ex.what())));
+		}
+		releaseAdmission();
+	}
+}
+
+} // namespace vpn
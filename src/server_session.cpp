@@ -0,0 +1,333 @@
+#include "vpn/server_session.h"
+#include "vpn/random.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Logger.h>
+#include <Poco/Format.h>
+#include <Poco/JSON/Parser.h>
+#include <Poco/JSON/Object.h>
+#include <stdexcept>
+
+namespace vpn {
+
+constexpr std::chrono::milliseconds ServerSession::kHelloTimeout;
+constexpr std::chrono::milliseconds ServerSession::kAuthTimeout;
+
+// Replies are framed or queued before handleFrame returns, so every session
+// served by a thread can build them in the same buffers
+static PacketBuffer& echoBuffer() {
+	thread_local PacketBuffer buffer(BufferPool::forThread(), Tunnel::kFrameHeaderLen + 64, 2048, 64);
+	return buffer;
+}
+
+static std::vector<PacketBuffer>& deliveredBuffer() {
+	thread_local std::vector<PacketBuffer> packets;
+	return packets;
+}
+
+static std::vector<std::uint8_t>& streamEchoBuffer() {
+	thread_local std::vector<std::uint8_t> buffer(StreamMux::kMaxChunk);
+	return buffer;
+}
+
+ServerSession::ServerSession(Tunnel& tunnel, CredentialStore::Ptr store, const ServerConfig& config,
+                             SessionRegistry::Ptr registry, VirtualNetwork::Ptr network)
+	: _tunnel(tunnel)
+	, _store(std::move(store))
+	, _config(config)
+	, _registry(std::move(registry))
+	, _network(std::move(network))
+	, _deadline(std::chrono::steady_clock::now() + kHelloTimeout) {
+	HandshakeOptions handshakeOptions;
+	handshakeOptions.cipherSuites = _config.cipherSuites;
+	handshakeOptions.tlsOnlyData = _config.tlsOnlyData && _config.requireClientAuth;
+	if (_config.allowCompression) handshakeOptions.compression = {CompressionCodec::ZLIB};
+	handshakeOptions.maxFrameLen = _config.maxFrameSize;
+	handshakeOptions.maxMessageLen = _config.maxMessageSize;
+	_tunnel.setHandshakeOptions(handshakeOptions);
+	CoalescingOptions coalescing;
+	coalescing.flushBytes = _config.sendCoalesceBytes;
+	coalescing.maxDelay = _config.sendCoalesceDelay;
+	_tunnel.setCoalescing(coalescing);
+}
+
+// Outcome of a password check, filled in by whichever thread runs it
+struct ServerSession::PendingVerify {
+	Poco::FastMutex mutex;
+	std::function<void()> wakeup; // cleared once the session no longer waits
+	bool done = false;
+	VerifyResult result = VerifyResult::REJECTED;
+};
+
+ServerSession::~ServerSession() {
+	if (_pending) {
+		Poco::FastMutex::ScopedLock lock(_pending->mutex);
+		_pending->wakeup = nullptr;
+	}
+	if (_entry) {
+		_entry->setWakeup(nullptr);
+		if (_registry) _registry->remove(*_entry);
+		if (_network) _network->detach(*_entry);
+	}
+}
+
+void ServerSession::setWakeup(std::function<void()> wakeup) {
+	_wakeup = std::move(wakeup);
+	if (_entry) _entry->setWakeup(_wakeup);
+}
+
+bool ServerSession::handleFrame(const FrameView& frame) {
+	if (closeRequested()) return false;
+	switch (_state) {
+	case State::HELLO:
+		handleHello(frame);
+		return true;
+	case State::AUTH:
+		return handleAuth(frame);
+	case State::DATA:
+		return handleData(frame);
+	case State::VERIFYING:
+		throw std::runtime_error("frame received during password check");
+	case State::CLOSED:
+		break;
+	}
+	return false;
+}
+
+bool ServerSession::expire(std::chrono::steady_clock::time_point now) {
+	if (closeRequested()) return true;
+	if ((_state != State::HELLO && _state != State::AUTH && _state != State::VERIFYING) || now < _deadline) return false;
+	if (_state == State::HELLO) {
+		Poco::Logger::get("VpnServer").warning("Connection error: HELLO not received");
+		_state = State::CLOSED;
+	} else {
+		reject("Authentication timeout");
+	}
+	return true;
+}
+
+void ServerSession::handleHello(const FrameView& frame) {
+	_serverSessionId = randomSessionId();
+	std::string clientSessionId;
+	std::vector<std::uint8_t> clientNonce, serverNonce, keySeed;
+	_tunnel.serverHandshake(frame, _serverSessionId, clientSessionId, clientNonce, serverNonce, keySeed);
+	auto keys = vpn::deriveSessionKeys(keySeed, clientNonce, serverNonce);
+	const auto suite = _tunnel.handshakeResult().cipherSuite;
+	_crypto = std::make_shared<SessionCrypto>(keys.encKey, keys.macKey, suite);
+	_tlsOnlyData = _tunnel.handshakeResult().tlsOnlyData;
+	const auto codec = _tunnel.handshakeResult().compression;
+	if (codec != CompressionCodec::NONE) {
+		_compressor = std::make_unique<PayloadCompressor>(codec);
+		_compressor->setMaxDecompressedSize(_config.maxMessageSize);
+	}
+	Poco::Logger::get("VpnServer").information(Poco::format("Session established serverId=%s clientId=%s cipher=%s compression=%s",
+		_serverSessionId, clientSessionId, std::string(_tlsOnlyData ? "tls-only" : cipherSuiteName(suite)),
+		std::string(compressionCodecName(codec))));
+	_state = State::AUTH;
+	_deadline = std::chrono::steady_clock::now() + kAuthTimeout;
+}
+
+bool ServerSession::handleAuth(const FrameView& frame) {
+	if (frame.type != FrameType::AUTH) {
+		reject("Authentication required");
+		return false;
+	}
+	std::string username;
+	std::string password;
+	try {
+		auto authPlain = _crypto->decrypt(std::vector<std::uint8_t>(frame.payload.data, frame.payload.data + frame.payload.size));
+		std::string authJson(authPlain.begin(), authPlain.end());
+		Poco::JSON::Parser parser;
+		auto result = parser.parse(authJson);
+		auto obj = result.extract<Poco::JSON::Object::Ptr>();
+		username = obj->getValue<std::string>("username");
+		password = obj->getValue<std::string>("password");
+	} catch (const std::exception& ex) {
+		Poco::Logger::get("VpnServer").warning(Poco::format("Auth parse error: %s", std::string(ex.what())));
+		reject("Invalid auth payload");
+		return false;
+	}
+
+	if (!_store) {
+		reject("Authentication failed");
+		return false;
+	}
+	_username = username;
+	_state = State::VERIFYING;
+	_pending = std::make_shared<PendingVerify>();
+	_pending->wakeup = _wakeup;
+	auto pending = _pending;
+	_store->verifyAsync(username, password, [pending](VerifyResult result) {
+		Poco::FastMutex::ScopedLock lock(pending->mutex);
+		pending->result = result;
+		pending->done = true;
+		if (pending->wakeup) pending->wakeup();
+	});
+	// cached logins and refusals are answered before verifyAsync returns
+	return resume();
+}
+
+bool ServerSession::resume() {
+	if (closeRequested()) return false;
+	if (_state == State::DATA) sendDelivered();
+	if (_state != State::VERIFYING) return _state != State::CLOSED;
+	VerifyResult result;
+	{
+		Poco::FastMutex::ScopedLock lock(_pending->mutex);
+		if (!_pending->done) return true;
+		result = _pending->result;
+		_pending->wakeup = nullptr;
+	}
+	_pending.reset();
+	switch (result) {
+	case VerifyResult::ACCEPTED: {
+		try {
+			registerSession();
+		} catch (const std::exception& ex) {
+			Poco::Logger::get("VpnServer").warning(Poco::format("Cannot admit user %s: %s", _username, std::string(ex.what())));
+			reject("Server cannot take more sessions");
+			return false;
+		}
+		// the client learns its virtual addresses from the result: "OK 10.8.0.2/24 fd00:8::2/112"
+		std::string message = "OK";
+		for (const auto& a : _entry->virtualAddresses()) {
+			message += Poco::format(" %s/%u", a.address.toString(), a.prefixLength);
+		}
+		_tunnel.sendAuthResult(true, message);
+		Poco::Logger::get("VpnServer").information(Poco::format("User %s authenticated", _username));
+		_state = State::DATA;
+		return true;
+	}
+	case VerifyResult::BUSY:
+		Poco::Logger::get("VpnServer").warning(Poco::format("Login queue full, turning away user %s", _username));
+		reject("Server busy, try again later");
+		return false;
+	case VerifyResult::REJECTED:
+		break;
+	}
+	Poco::Logger::get("VpnServer").warning(Poco::format("Authentication failed for user %s", _username));
+	reject("Authentication failed");
+	return false;
+}
+
+bool ServerSession::handleData(const FrameView& frame) {
+	switch (frame.type) {
+	case FrameType::ENCRYPTED_DATA:
+		try {
+			// decrypted in place in the tunnel's receive buffer, then forwarded or echoed back encrypted
+			auto plain = _crypto->decryptInPlace(frame.payload);
+			if (frame.compressed) plain = decompress(_compressor.get(), plain);
+			if (_network) _network->forward(*_entry, plain);
+			else sendPacket(plain, true);
+		} catch (const std::exception& ex) {
+			Poco::Logger::get("VpnServer").warning(Poco::format("Decrypt error: %s", std::string(ex.what())));
+			return false; // Exit on crypto errors to prevent resource waste
+		}
+		break;
+	case FrameType::DATA: {
+		// TLS-only data, or legacy unencrypted DATA
+		auto plain = frame.compressed ? decompress(_compressor.get(), frame.payload) : frame.payload;
+		if (_network) _network->forward(*_entry, plain);
+		else sendPacket(plain, false);
+		break;
+	}
+	case FrameType::HEARTBEAT:
+		_tunnel.sendHeartbeat();
+		break;
+	case FrameType::STREAM_OPEN:
+	case FrameType::STREAM_DATA:
+	case FrameType::STREAM_CLOSE:
+	case FrameType::STREAM_WINDOW_UPDATE: {
+		if (!_streams) {
+			_streams = std::make_unique<StreamMux>(_tunnel, _tlsOnlyData ? nullptr : _crypto.get(), false,
+				StreamMux::kDefaultWindow, _config.maxStreams);
+		}
+		const std::uint32_t id = _streams->handleFrame(frame);
+		// every stream is echoed as its data arrives, so the accepted ids are not needed
+		if (frame.type == FrameType::STREAM_OPEN) _streams->acceptStreams();
+		// Echo what the stream delivered. Reading returns credit to the
+		// client, so stop while a window's worth of echo is still queued.
+		std::vector<std::uint8_t>& streamEcho = streamEchoBuffer();
+		std::size_t n = 0;
+		while (_streams->pending(id) < StreamMux::kDefaultWindow &&
+		       (n = _streams->read(id, streamEcho.data(), streamEcho.size())) > 0) {
+			_streams->write(id, streamEcho.data(), n);
+		}
+		if (_streams->remoteClosed(id) && _streams->readable(id) == 0 && _streams->exists(id)) _streams->close(id);
+		break;
+	}
+	case FrameType::CLOSE:
+		Poco::Logger::get("VpnServer").information(Poco::format("Session %s closed by client", _serverSessionId));
+		_state = State::CLOSED;
+		return false;
+	default:
+		Poco::Logger::get("VpnServer").warning(Poco::format("Ignoring unexpected frame type %d",
+			static_cast<int>(frame.type)));
+		break;
+	}
+	_entry->publish(_tunnel.stats());
+	return true;
+}
+
+// Sends one packet as ENCRYPTED_DATA, or as DATA if not encrypted
+void ServerSession::sendPacket(ByteView plain, bool encrypted) {
+	PacketBuffer& buffer = echoBuffer();
+	buffer.reset(Tunnel::kFrameHeaderLen + (encrypted ? _crypto->headroom() : 0));
+	buffer.assign(plain.data, plain.size);
+	sendPacket(buffer, encrypted);
+}
+
+// Frames buffer's payload in place; it needs the frame header and, if
+// encrypted, the cipher's headroom in front of it
+void ServerSession::sendPacket(PacketBuffer& buffer, bool encrypted) {
+	const bool compressed = _compressor && _compressor->compress(buffer);
+	if (!encrypted) {
+		_tunnel.sendFrame(FrameType::DATA, buffer, compressed);
+		return;
+	}
+	_crypto->encryptInPlace(buffer);
+	_tunnel.sendEncrypted(buffer, compressed);
+}
+
+void ServerSession::sendDelivered() {
+	if (!_entry->hasDelivered()) return;
+	auto& packets = deliveredBuffer();
+	_entry->takeDelivered(packets);
+	for (auto& packet : packets) sendPacket(packet, !_tlsOnlyData);
+	// returns the blocks to the pools of the sessions that filled them
+	packets.clear();
+}
+
+void ServerSession::reject(const std::string& message) {
+	_tunnel.sendAuthResult(false, message);
+	_tunnel.sendClose();
+	_state = State::CLOSED;
+}
+
+void ServerSession::registerSession() {
+	auto entry = std::make_shared<SessionEntry>(_serverSessionId, _username, _crypto);
+	if (_network) _network->attach(entry);
+	if (_registry && !_registry->add(entry)) {
+		if (_network) _network->detach(*entry);
+		throw std::runtime_error("duplicate session ID " + _serverSessionId);
+	}
+	entry->setWakeup(_wakeup);
+	_entry = std::move(entry);
+}
+
+// Closes the session if the registry asked it to
+bool ServerSession::closeRequested() {
+	if (!_entry || !_entry->closeRequested() || _state == State::CLOSED) return false;
+	Poco::Logger::get("VpnServer").information(Poco::format("Closing session %s of user %s on request",
+		_serverSessionId, _username));
+	_tunnel.sendClose();
+	_state = State::CLOSED;
+	return true;
+}
+
+ByteView ServerSession::decompress(PayloadCompressor* compressor, ByteView payload) {
+	if (!compressor) throw std::runtime_error("compressed frame without negotiated compression");
+	return compressor->decompress(payload);
+}
+
+} // namespace vpn
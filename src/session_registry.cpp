@@ -0,0 +1,167 @@
+#include "vpn/session_registry.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+
+namespace vpn {
+
+const std::size_t SessionRegistry::kDefaultShards;
+const std::size_t SessionEntry::kMaxDelivered;
+
+SessionEntry::SessionEntry(std::string sessionId, std::string username, std::shared_ptr<SessionCrypto> crypto)
+	: _sessionId(std::move(sessionId))
+	, _username(std::move(username))
+	, _established(std::chrono::system_clock::now())
+	, _crypto(std::move(crypto)) {}
+
+TunnelStats SessionEntry::stats() const {
+	TunnelStats stats;
+	stats.framesSent = _framesSent.load(std::memory_order_relaxed);
+	stats.framesReceived = _framesReceived.load(std::memory_order_relaxed);
+	stats.bytesSent = _bytesSent.load(std::memory_order_relaxed);
+	stats.bytesReceived = _bytesReceived.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void SessionEntry::publish(const TunnelStats& stats) {
+	// only the driver writes, so plain stores suffice
+	_framesSent.store(stats.framesSent, std::memory_order_relaxed);
+	_framesReceived.store(stats.framesReceived, std::memory_order_relaxed);
+	_bytesSent.store(stats.bytesSent, std::memory_order_relaxed);
+	_bytesReceived.store(stats.bytesReceived, std::memory_order_relaxed);
+}
+
+void SessionEntry::requestClose() {
+	_closeRequested.store(true, std::memory_order_release);
+	Poco::FastMutex::ScopedLock lock(_wakeupMutex);
+	if (_wakeup) _wakeup();
+}
+
+void SessionEntry::setWakeup(std::function<void()> wakeup) {
+	Poco::FastMutex::ScopedLock lock(_wakeupMutex);
+	_wakeup = std::move(wakeup);
+}
+
+bool SessionEntry::ownsAddress(const std::uint8_t* address, bool v6) const {
+	const auto family = v6 ? Poco::Net::IPAddress::IPv6 : Poco::Net::IPAddress::IPv4;
+	for (const auto& own : _virtualAddresses) {
+		if (own.address.family() == family && std::memcmp(own.address.addr(), address, own.address.length()) == 0) return true;
+	}
+	return false;
+}
+
+bool SessionEntry::deliver(ByteView packet) {
+	if (_deliveredCount.load(std::memory_order_relaxed) >= kMaxDelivered) return false;
+	const std::size_t headroom = Tunnel::kFrameHeaderLen + (_crypto ? _crypto->headroom() : 0);
+	PacketBuffer buffer(BufferPool::forThread(), headroom, packet.size, _crypto ? _crypto->tailroom() : 0);
+	buffer.assign(packet.data, packet.size);
+	{
+		Poco::FastMutex::ScopedLock lock(_deliveredMutex);
+		if (_delivered.size() >= kMaxDelivered) return false;
+		_delivered.push_back(std::move(buffer));
+		// the driver was woken for the earlier packets and has not taken them yet
+		if (_deliveredCount.fetch_add(1, std::memory_order_release) > 0) return true;
+	}
+	Poco::FastMutex::ScopedLock lock(_wakeupMutex);
+	if (_wakeup) _wakeup();
+	return true;
+}
+
+void SessionEntry::takeDelivered(std::vector<PacketBuffer>& out) {
+	// moved element by element, so both vectors keep their capacity
+	Poco::FastMutex::ScopedLock lock(_deliveredMutex);
+	std::move(_delivered.begin(), _delivered.end(), std::back_inserter(out));
+	_delivered.clear();
+	_deliveredCount.store(0, std::memory_order_relaxed);
+}
+
+// Cache-line aligned, so threads working on neighbouring shards do not
+// contend for the same line
+struct alignas(64) SessionRegistry::Shard {
+	mutable Poco::FastMutex mutex;
+	std::unordered_map<std::string, EntryPtr> sessions; // by session ID
+	std::unordered_map<std::string, std::vector<EntryPtr>> users;
+};
+
+SessionRegistry::SessionRegistry(std::size_t shards)
+	: _shardCount(shards)
+	, _shards(shards > 0 ? new Shard[shards] : nullptr) {
+	if (shards == 0) throw std::invalid_argument("session registry needs at least one shard");
+}
+
+SessionRegistry::~SessionRegistry() = default;
+
+SessionRegistry::Shard& SessionRegistry::shardOf(const std::string& key) const {
+	// remixed: the shard's maps bucket by the same hash
+	const std::uint64_t h = static_cast<std::uint64_t>(std::hash<std::string>()(key)) * 0x9E3779B97F4A7C15ULL;
+	return _shards[(h >> 32) % _shardCount];
+}
+
+bool SessionRegistry::add(const EntryPtr& entry) {
+	{
+		Shard& shard = shardOf(entry->sessionId());
+		Poco::FastMutex::ScopedLock lock(shard.mutex);
+		if (!shard.sessions.emplace(entry->sessionId(), entry).second) return false;
+	}
+	{
+		Shard& shard = shardOf(entry->username());
+		Poco::FastMutex::ScopedLock lock(shard.mutex);
+		shard.users[entry->username()].push_back(entry);
+	}
+	_size.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void SessionRegistry::remove(const SessionEntry& entry) {
+	{
+		Shard& shard = shardOf(entry.sessionId());
+		Poco::FastMutex::ScopedLock lock(shard.mutex);
+		auto it = shard.sessions.find(entry.sessionId());
+		if (it == shard.sessions.end() || it->second.get() != &entry) return;
+		shard.sessions.erase(it);
+	}
+	{
+		Shard& shard = shardOf(entry.username());
+		Poco::FastMutex::ScopedLock lock(shard.mutex);
+		auto it = shard.users.find(entry.username());
+		if (it != shard.users.end()) {
+			auto& entries = it->second;
+			entries.erase(std::remove_if(entries.begin(), entries.end(),
+				[&entry](const EntryPtr& e) { return e.get() == &entry; }), entries.end());
+			if (entries.empty()) shard.users.erase(it);
+		}
+	}
+	_size.fetch_sub(1, std::memory_order_relaxed);
+}
+
+SessionRegistry::EntryPtr SessionRegistry::find(const std::string& sessionId) const {
+	Shard& shard = shardOf(sessionId);
+	Poco::FastMutex::ScopedLock lock(shard.mutex);
+	auto it = shard.sessions.find(sessionId);
+	return it == shard.sessions.end() ? nullptr : it->second;
+}
+
+std::vector<SessionRegistry::EntryPtr> SessionRegistry::findByUser(const std::string& username) const {
+	Shard& shard = shardOf(username);
+	Poco::FastMutex::ScopedLock lock(shard.mutex);
+	auto it = shard.users.find(username);
+	return it == shard.users.end() ? std::vector<EntryPtr>() : it->second;
+}
+
+std::size_t SessionRegistry::sessionsOfUser(const std::string& username) const {
+	Shard& shard = shardOf(username);
+	Poco::FastMutex::ScopedLock lock(shard.mutex);
+	auto it = shard.users.find(username);
+	return it == shard.users.end() ? 0 : it->second.size();
+}
+
+void SessionRegistry::forEach(const std::function<void(const EntryPtr&)>& fn) const {
+	for (std::size_t i = 0; i < _shardCount; ++i) {
+		Poco::FastMutex::ScopedLock lock(_shards[i].mutex);
+		for (const auto& entry : _shards[i].sessions) fn(entry.second);
+	}
+}
+
+} // namespace vpn
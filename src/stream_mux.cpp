@@ -0,0 +1,243 @@
+#include "vpn/stream_mux.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+namespace vpn {
+
+static const std::size_t kStreamIdLen = 4;
+
+static void putUint32(std::uint8_t* p, std::uint32_t v) {
+	p[0] = static_cast<std::uint8_t>((v >> 24) & 0xFF);
+	p[1] = static_cast<std::uint8_t>((v >> 16) & 0xFF);
+	p[2] = static_cast<std::uint8_t>((v >> 8) & 0xFF);
+	p[3] = static_cast<std::uint8_t>(v & 0xFF);
+}
+
+static std::uint32_t readUint32(const std::uint8_t* p) {
+	return (static_cast<std::uint32_t>(p[0]) << 24) |
+	       (static_cast<std::uint32_t>(p[1]) << 16) |
+	       (static_cast<std::uint32_t>(p[2]) << 8) |
+	       (static_cast<std::uint32_t>(p[3]));
+}
+
+// drop the consumed front of a queue once it is more than half the storage
+static void compact(std::vector<std::uint8_t>& buf, std::size_t& offset) {
+	if (offset == buf.size()) {
+		buf.clear();
+		offset = 0;
+	} else if (offset > buf.size() / 2) {
+		buf.erase(buf.begin(), buf.begin() + static_cast<std::ptrdiff_t>(offset));
+		offset = 0;
+	}
+}
+
+StreamMux::StreamMux(Tunnel& tunnel, const SessionCrypto* crypto, bool initiator, std::uint32_t window,
+                     std::size_t maxStreams)
+	: _tunnel(tunnel)
+	, _crypto(crypto)
+	, _window(window < kInitialWindow ? kInitialWindow : window)
+	, _maxStreams(maxStreams)
+	, _nextId(initiator ? 1 : 2)
+	, _txChunk(BufferPool::forThread(),
+	           Tunnel::kFrameHeaderLen + kStreamIdLen + (crypto ? crypto->headroom() : 0),
+	           kMaxChunk,
+	           crypto ? crypto->tailroom() : 0)
+	, _control(Tunnel::kFrameHeaderLen, 8) {}
+
+bool StreamMux::isStreamFrame(FrameType type) {
+	return type == FrameType::STREAM_OPEN || type == FrameType::STREAM_DATA ||
+	       type == FrameType::STREAM_CLOSE || type == FrameType::STREAM_WINDOW_UPDATE;
+}
+
+std::uint32_t StreamMux::open() {
+	const std::uint32_t id = _nextId;
+	_nextId += 2;
+	Stream& s = _streams[id];
+	sendControl(FrameType::STREAM_OPEN, id, nullptr);
+	grantCredit(id, s, _window - kInitialWindow);
+	return id;
+}
+
+std::uint32_t StreamMux::handleFrame(const FrameView& frame) {
+	if (frame.payload.size < kStreamIdLen) throw std::runtime_error("truncated stream frame");
+	const std::uint8_t* p = frame.payload.data;
+	const std::uint32_t id = readUint32(p);
+	switch (frame.type) {
+	case FrameType::STREAM_OPEN: {
+		if ((id & 1) == (_nextId & 1)) throw std::runtime_error("peer opened a stream with our id parity");
+		const auto peerStreams = std::count_if(_streams.begin(), _streams.end(),
+			[this](const std::pair<const std::uint32_t, Stream>& entry) { return (entry.first & 1) != (_nextId & 1); });
+		if (static_cast<std::size_t>(peerStreams) >= _maxStreams) throw std::runtime_error("too many streams");
+		auto inserted = _streams.emplace(id, Stream());
+		if (!inserted.second) throw std::runtime_error("stream opened twice");
+		_accepted.push_back(id);
+		grantCredit(id, inserted.first->second, _window - kInitialWindow);
+		break;
+	}
+	case FrameType::STREAM_DATA: {
+		auto it = _streams.find(id);
+		if (it == _streams.end() || it->second.remoteClosed) throw std::runtime_error("data on a stream that is not open");
+		Stream& s = it->second;
+		ByteView sealed{frame.payload.data + kStreamIdLen, frame.payload.size - kStreamIdLen};
+		ByteView plain = _crypto ? _crypto->decryptInPlace(sealed) : sealed;
+		if (plain.size > s.recvWindow) throw std::runtime_error("stream flow control window exceeded");
+		s.recvWindow -= static_cast<std::uint32_t>(plain.size);
+		s.rx.insert(s.rx.end(), plain.data, plain.data + plain.size);
+		break;
+	}
+	case FrameType::STREAM_CLOSE: {
+		auto it = _streams.find(id);
+		if (it != _streams.end()) it->second.remoteClosed = true;
+		retireIfDone(id);
+		break;
+	}
+	case FrameType::STREAM_WINDOW_UPDATE: {
+		if (frame.payload.size < kStreamIdLen + 4) throw std::runtime_error("truncated window update");
+		auto it = _streams.find(id);
+		// late updates for streams we already retired are harmless
+		if (it == _streams.end()) break;
+		const std::uint64_t credit = std::uint64_t(it->second.sendCredit) + readUint32(p + kStreamIdLen);
+		if (credit > 0xFFFFFFFFu) throw std::runtime_error("stream window overflow");
+		it->second.sendCredit = static_cast<std::uint32_t>(credit);
+		pump();
+		break;
+	}
+	default:
+		throw std::invalid_argument("not a stream frame");
+	}
+	return id;
+}
+
+void StreamMux::write(std::uint32_t id, const std::uint8_t* data, std::size_t len) {
+	Stream& s = stream(id);
+	if (s.closePending || s.localClosed) throw std::runtime_error("write on a closed stream");
+	s.tx.insert(s.tx.end(), data, data + len);
+	pump();
+}
+
+std::size_t StreamMux::read(std::uint32_t id, std::uint8_t* out, std::size_t max) {
+	auto it = _streams.find(id);
+	if (it == _streams.end()) return 0;
+	Stream& s = it->second;
+	const std::size_t n = std::min(max, s.rx.size() - s.rxOffset);
+	if (n == 0) return 0;
+	std::memcpy(out, s.rx.data() + s.rxOffset, n);
+	s.rxOffset += n;
+	compact(s.rx, s.rxOffset);
+	s.consumed += static_cast<std::uint32_t>(n);
+	// batch credit returns: one update per half window read
+	if (s.consumed >= _window / 2 && !s.remoteClosed) {
+		grantCredit(id, s, s.consumed);
+		s.consumed = 0;
+	}
+	retireIfDone(id);
+	return n;
+}
+
+void StreamMux::close(std::uint32_t id) {
+	Stream& s = stream(id);
+	if (s.closePending || s.localClosed) return;
+	s.closePending = true;
+	pump();
+}
+
+void StreamMux::pump() {
+	bool progress = true;
+	while (progress) {
+		progress = false;
+		for (auto& entry : _streams) {
+			if (sendChunk(entry.first, entry.second)) progress = true;
+		}
+	}
+	for (auto it = _streams.begin(); it != _streams.end();) {
+		Stream& s = it->second;
+		if (s.closePending && s.txOffset == s.tx.size()) {
+			s.closePending = false;
+			s.localClosed = true;
+			sendControl(FrameType::STREAM_CLOSE, it->first, nullptr);
+		}
+		const bool done = s.localClosed && s.remoteClosed && s.rxOffset == s.rx.size();
+		it = done ? _streams.erase(it) : std::next(it);
+	}
+}
+
+bool StreamMux::exists(std::uint32_t id) const {
+	return find(id) != nullptr;
+}
+
+std::size_t StreamMux::readable(std::uint32_t id) const {
+	const Stream* s = find(id);
+	return s ? s->rx.size() - s->rxOffset : 0;
+}
+
+std::size_t StreamMux::pending(std::uint32_t id) const {
+	const Stream* s = find(id);
+	return s ? s->tx.size() - s->txOffset : 0;
+}
+
+std::size_t StreamMux::sendCredit(std::uint32_t id) const {
+	const Stream* s = find(id);
+	return s ? s->sendCredit : 0;
+}
+
+bool StreamMux::remoteClosed(std::uint32_t id) const {
+	const Stream* s = find(id);
+	// a retired stream was closed by both sides
+	return s ? s->remoteClosed : true;
+}
+
+std::vector<std::uint32_t> StreamMux::acceptStreams() {
+	std::vector<std::uint32_t> out;
+	out.swap(_accepted);
+	return out;
+}
+
+StreamMux::Stream& StreamMux::stream(std::uint32_t id) {
+	auto it = _streams.find(id);
+	if (it == _streams.end()) throw std::invalid_argument("unknown stream");
+	return it->second;
+}
+
+const StreamMux::Stream* StreamMux::find(std::uint32_t id) const {
+	auto it = _streams.find(id);
+	return it == _streams.end() ? nullptr : &it->second;
+}
+
+void StreamMux::sendControl(FrameType type, std::uint32_t id, const std::uint32_t* value) {
+	_control.reset(Tunnel::kFrameHeaderLen);
+	putUint32(_control.put(kStreamIdLen), id);
+	if (value) putUint32(_control.put(4), *value);
+	_tunnel.sendFrame(type, _control);
+}
+
+bool StreamMux::sendChunk(std::uint32_t id, Stream& s) {
+	const std::size_t queued = s.tx.size() - s.txOffset;
+	const std::size_t n = std::min({queued, static_cast<std::size_t>(s.sendCredit), kMaxChunk});
+	if (n == 0) return false;
+	_txChunk.reset(Tunnel::kFrameHeaderLen + kStreamIdLen + (_crypto ? _crypto->headroom() : 0));
+	_txChunk.assign(s.tx.data() + s.txOffset, n);
+	if (_crypto) _crypto->encryptInPlace(_txChunk);
+	putUint32(_txChunk.push(kStreamIdLen), id);
+	_tunnel.sendFrame(FrameType::STREAM_DATA, _txChunk);
+	s.sendCredit -= static_cast<std::uint32_t>(n);
+	s.txOffset += n;
+	compact(s.tx, s.txOffset);
+	return true;
+}
+
+void StreamMux::grantCredit(std::uint32_t id, Stream& s, std::uint32_t increment) {
+	if (increment == 0) return;
+	s.recvWindow += increment;
+	sendControl(FrameType::STREAM_WINDOW_UPDATE, id, &increment);
+}
+
+void StreamMux::retireIfDone(std::uint32_t id) {
+	auto it = _streams.find(id);
+	if (it == _streams.end()) return;
+	const Stream& s = it->second;
+	if (s.localClosed && s.remoteClosed && s.rxOffset == s.rx.size()) _streams.erase(it);
+}
+
+} // namespace vpn
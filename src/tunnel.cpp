@@ -1,14 +1,50 @@
 #include "vpn/tunnel.h"
+#include "vpn/random.h"
 
 #include <Poco/Timespan.h>
+#include <Poco/Exception.h>
 #include <stdexcept>
 #include <algorithm>
+#include <cstring>
 
 namespace vpn {
 
-Tunnel::Tunnel(Poco::Net::SecureStreamSocket& socket)
+Tunnel::Tunnel(Poco::Net::StreamSocket& socket)
 	: _socket(socket) {}
 
+Tunnel::~Tunnel() {
+	try {
+		flush();
+	} catch (...) {}
+}
+
+void Tunnel::setHandshakeOptions(const HandshakeOptions& options) {
+	if (options.maxFrameLen < kMinMaxFrameLen || options.maxFrameLen > kMaxFrameLen) {
+		throw std::invalid_argument("maxFrameLen out of range");
+	}
+	if (options.maxMessageLen < options.maxFrameLen - 1 || options.maxMessageLen > kMaxFrameLen) {
+		throw std::invalid_argument("maxMessageLen out of range");
+	}
+	_handshakeOptions = options;
+}
+
+void Tunnel::writeFrameLimits(std::vector<std::uint8_t>& payload) const {
+	std::vector<std::uint8_t> limits;
+	writeUint32(limits, static_cast<std::uint32_t>(_handshakeOptions.maxFrameLen));
+	writeUint32(limits, static_cast<std::uint32_t>(_handshakeOptions.maxMessageLen));
+	writeExtension(payload, HelloExtension::MAX_FRAME_SIZE, limits);
+}
+
+void Tunnel::readFrameLimits(const std::vector<std::uint8_t>& value) {
+	if (value.size() != 8) throw std::runtime_error("invalid frame size limits");
+	// larger limits than we could ever use are clamped; tiny frames are refused
+	const std::size_t frameLen = std::min<std::size_t>(readUint32(value.data()), static_cast<std::size_t>(kMaxFrameLen));
+	const std::size_t messageLen = std::min<std::size_t>(readUint32(value.data() + 4), static_cast<std::size_t>(kMaxFrameLen));
+	if (frameLen < kMinMaxFrameLen || messageLen < frameLen - 1) throw std::runtime_error("invalid frame size limits");
+	_handshakeResult.peerMaxFrameLen = frameLen;
+	_handshakeResult.peerMaxMessageLen = messageLen;
+}
+
 void Tunnel::clientHandshake(const std::string& clientSessionId,
                              std::vector<std::uint8_t>& outClientNonce,
                              std::string& outServerSessionId,
@@ -19,11 +55,23 @@ void Tunnel::clientHandshake(const std::string& clientSessionId,
 	if (clientSessionId.size() > 255) throw std::runtime_error("client id too long");
 	payload.push_back(static_cast<std::uint8_t>(clientSessionId.size()));
 	payload.insert(payload.end(), clientSessionId.begin(), clientSessionId.end());
-	std::vector<std::uint8_t> clientNonce(16);
-	Poco::RandomBuf rng;
-	rng.read(reinterpret_cast<char*>(clientNonce.data()), 16);
+	auto clientNonce = secureRandomBytes(16);
 	outClientNonce = clientNonce;
 	payload.insert(payload.end(), clientNonce.begin(), clientNonce.end());
+	if (!_handshakeOptions.cipherSuites.empty()) {
+		std::vector<std::uint8_t> suites;
+		for (auto suite : _handshakeOptions.cipherSuites) suites.push_back(static_cast<std::uint8_t>(suite));
+		writeExtension(payload, HelloExtension::CIPHER_SUITES, suites);
+	}
+	if (_handshakeOptions.tlsOnlyData) {
+		writeExtension(payload, HelloExtension::TLS_ONLY_DATA, {});
+	}
+	if (!_handshakeOptions.compression.empty()) {
+		std::vector<std::uint8_t> codecs;
+		for (auto codec : _handshakeOptions.compression) codecs.push_back(static_cast<std::uint8_t>(codec));
+		writeExtension(payload, HelloExtension::COMPRESSION, codecs);
+	}
+	writeFrameLimits(payload);
 	Frame hello{FrameType::HELLO, payload};
 	sendFrame(hello);
 	Frame ack;
@@ -40,6 +88,35 @@ void Tunnel::clientHandshake(const std::string& clientSessionId,
 	outServerNonce.assign(ack.payload.begin() + p, ack.payload.begin() + p + 16);
 	p += 16;
 	outKeySeed.assign(ack.payload.begin() + p, ack.payload.begin() + p + 32);
+	p += 32;
+	// a server without extension support implies the legacy suite
+	_handshakeResult = HandshakeResult{};
+	std::vector<std::pair<HelloExtension, std::vector<std::uint8_t>>> extensions;
+	parseExtensions(ack.payload, p, extensions);
+	for (const auto& ext : extensions) {
+		if (ext.first == HelloExtension::CIPHER_SUITES) {
+			if (ext.second.size() != 1) throw std::runtime_error("invalid cipher suite selection");
+			auto selected = static_cast<CipherSuite>(ext.second[0]);
+			if (std::find(_handshakeOptions.cipherSuites.begin(), _handshakeOptions.cipherSuites.end(), selected) ==
+			    _handshakeOptions.cipherSuites.end()) {
+				throw std::runtime_error("server selected a cipher suite that was not offered");
+			}
+			_handshakeResult.cipherSuite = selected;
+		} else if (ext.first == HelloExtension::TLS_ONLY_DATA) {
+			if (!_handshakeOptions.tlsOnlyData) throw std::runtime_error("server enabled TLS-only data without an offer");
+			_handshakeResult.tlsOnlyData = true;
+		} else if (ext.first == HelloExtension::COMPRESSION) {
+			if (ext.second.size() != 1) throw std::runtime_error("invalid compression selection");
+			auto selected = static_cast<CompressionCodec>(ext.second[0]);
+			if (std::find(_handshakeOptions.compression.begin(), _handshakeOptions.compression.end(), selected) ==
+			    _handshakeOptions.compression.end()) {
+				throw std::runtime_error("server selected a compression codec that was not offered");
+			}
+			_handshakeResult.compression = selected;
+		} else if (ext.first == HelloExtension::MAX_FRAME_SIZE) {
+			readFrameLimits(ext.second);
+		}
+	}
 }
 
 void Tunnel::serverHandshake(const std::string& serverSessionId,
@@ -47,10 +124,20 @@ void Tunnel::serverHandshake(const std::string& serverSessionId,
                              std::vector<std::uint8_t>& outClientNonce,
                              std::vector<std::uint8_t>& outServerNonce,
                              std::vector<std::uint8_t>& outKeySeed) {
-	Frame hello;
-	if (!receiveFrame(hello, std::chrono::milliseconds(5000)) || hello.type != FrameType::HELLO) {
-		throw std::runtime_error("HELLO not received");
-	}
+	FrameView hello;
+	if (!receiveFrame(hello, std::chrono::milliseconds(5000))) throw std::runtime_error("HELLO not received");
+	serverHandshake(hello, serverSessionId, outClientSessionId, outClientNonce, outServerNonce, outKeySeed);
+}
+
+void Tunnel::serverHandshake(const FrameView& helloFrame,
+                             const std::string& serverSessionId,
+                             std::string& outClientSessionId,
+                             std::vector<std::uint8_t>& outClientNonce,
+                             std::vector<std::uint8_t>& outServerNonce,
+                             std::vector<std::uint8_t>& outKeySeed) {
+	if (helloFrame.type != FrameType::HELLO) throw std::runtime_error("HELLO not received");
+	const Frame hello{FrameType::HELLO,
+	                  std::vector<std::uint8_t>(helloFrame.payload.data, helloFrame.payload.data + helloFrame.payload.size)};
 	// parse HELLO: [idLen][id][clientNonce(16)]
 	if (hello.payload.size() < 1 + 16) throw std::runtime_error("HELLO payload too short");
 	std::size_t p = 0;
@@ -59,18 +146,57 @@ void Tunnel::serverHandshake(const std::string& serverSessionId,
 	outClientSessionId.assign(reinterpret_cast<const char*>(hello.payload.data() + p), idLen);
 	p += idLen;
 	outClientNonce.assign(hello.payload.begin() + p, hello.payload.begin() + p + 16);
+	p += 16;
+	// select the first locally accepted suite the client offered; legacy clients offer nothing
+	_handshakeResult = HandshakeResult{};
+	bool clientOfferedSuites = false;
+	std::vector<std::pair<HelloExtension, std::vector<std::uint8_t>>> extensions;
+	parseExtensions(hello.payload, p, extensions);
+	for (const auto& ext : extensions) {
+		if (ext.first == HelloExtension::CIPHER_SUITES) {
+			clientOfferedSuites = true;
+			auto it = std::find_if(_handshakeOptions.cipherSuites.begin(), _handshakeOptions.cipherSuites.end(),
+				[&](CipherSuite suite) {
+					return std::find(ext.second.begin(), ext.second.end(), static_cast<std::uint8_t>(suite)) != ext.second.end();
+				});
+			if (it == _handshakeOptions.cipherSuites.end()) throw std::runtime_error("no common cipher suite");
+			_handshakeResult.cipherSuite = *it;
+		} else if (ext.first == HelloExtension::TLS_ONLY_DATA) {
+			_handshakeResult.tlsOnlyData = _handshakeOptions.tlsOnlyData;
+		} else if (ext.first == HelloExtension::COMPRESSION) {
+			// compression is optional: without a common codec the session just runs uncompressed
+			for (auto offered : ext.second) {
+				auto codec = static_cast<CompressionCodec>(offered);
+				if (std::find(_handshakeOptions.compression.begin(), _handshakeOptions.compression.end(), codec) !=
+				    _handshakeOptions.compression.end()) {
+					_handshakeResult.compression = codec;
+					break;
+				}
+			}
+		} else if (ext.first == HelloExtension::MAX_FRAME_SIZE) {
+			readFrameLimits(ext.second);
+		}
+	}
 	// build ACK with serverNonce and keySeed
-	outServerNonce.assign(16, 0);
-	Poco::RandomBuf rng;
-	rng.read(reinterpret_cast<char*>(outServerNonce.data()), 16);
-	outKeySeed.assign(32, 0);
-	rng.read(reinterpret_cast<char*>(outKeySeed.data()), 32);
+	outServerNonce = secureRandomBytes(16);
+	outKeySeed = secureRandomBytes(32);
 	std::vector<std::uint8_t> payload;
 	if (serverSessionId.size() > 255) throw std::runtime_error("server id too long");
 	payload.push_back(static_cast<std::uint8_t>(serverSessionId.size()));
 	payload.insert(payload.end(), serverSessionId.begin(), serverSessionId.end());
 	payload.insert(payload.end(), outServerNonce.begin(), outServerNonce.end());
 	payload.insert(payload.end(), outKeySeed.begin(), outKeySeed.end());
+	if (clientOfferedSuites) {
+		writeExtension(payload, HelloExtension::CIPHER_SUITES, {static_cast<std::uint8_t>(_handshakeResult.cipherSuite)});
+	}
+	if (_handshakeResult.tlsOnlyData) {
+		writeExtension(payload, HelloExtension::TLS_ONLY_DATA, {});
+	}
+	if (_handshakeResult.compression != CompressionCodec::NONE) {
+		writeExtension(payload, HelloExtension::COMPRESSION, {static_cast<std::uint8_t>(_handshakeResult.compression)});
+	}
+	// legacy clients announce no limits and would not understand fragments either way
+	writeFrameLimits(payload);
 	Frame ack{FrameType::HELLO_ACK, payload};
 	sendFrame(ack);
 }
@@ -99,6 +225,35 @@ std::vector<std::uint8_t> Tunnel::receiveEncrypted(std::chrono::milliseconds tim
 	return {};
 }
 
+void Tunnel::sendEncrypted(PacketBuffer& cipherFrame, bool compressed) {
+	sendFrame(FrameType::ENCRYPTED_DATA, cipherFrame, compressed);
+}
+
+bool Tunnel::receiveEncrypted(ByteView& outCipherFrame, std::chrono::milliseconds timeout) {
+	FrameView f;
+	if (!receiveFrame(f, timeout)) return false;
+	if (f.type != FrameType::ENCRYPTED_DATA) return false;
+	outCipherFrame = f.payload;
+	return true;
+}
+
+void Tunnel::sendFrameBatch(FrameType type, const std::vector<PacketBuffer>& payloads,
+                            const std::vector<bool>& compressed) {
+	// one write for the whole burst: fewer syscalls and full TLS records
+	for (const auto& payload : payloads) maxSendPayload(payload.size());
+	for (std::size_t i = 0; i < payloads.size(); ++i) {
+		const auto& payload = payloads[i];
+		const bool flagged = i < compressed.size() && compressed[i];
+		appendFrame(flagged ? static_cast<FrameType>(static_cast<std::uint8_t>(type) | kCompressedFlag) : type,
+		            payload.data(), payload.size());
+	}
+	flush();
+}
+
+void Tunnel::sendEncryptedBatch(const std::vector<PacketBuffer>& cipherFrames, const std::vector<bool>& compressed) {
+	sendFrameBatch(FrameType::ENCRYPTED_DATA, cipherFrames, compressed);
+}
+
 void Tunnel::sendAuth(const std::vector<std::uint8_t>& cipherFrame) {
 	Frame f{FrameType::AUTH, cipherFrame};
 	sendFrame(f);
@@ -144,46 +299,265 @@ bool Tunnel::receiveHeartbeat(std::chrono::milliseconds timeout) {
 void Tunnel::sendClose() {
 	Frame f{FrameType::CLOSE, {}};
 	sendFrame(f);
+	flush();
 }
 
 void Tunnel::sendFrame(const Frame& frame) {
+	queueFrame(frame.type, frame.payload.data(), frame.payload.size());
+}
+
+void Tunnel::sendFrame(FrameType type, PacketBuffer& buf, bool compressed) {
+	if (compressed) type = static_cast<FrameType>(static_cast<std::uint8_t>(type) | kCompressedFlag);
+	if (_coalescing.flushBytes > 0 || !_txQueue.empty() || _nonBlocking || buf.size() > maxSendPayload(buf.size())) {
+		queueFrame(type, buf.data(), buf.size());
+		return;
+	}
+	// not coalescing: header goes into the headroom, header plus payload in one write
+	const std::size_t payloadLen = buf.size();
+	std::uint8_t* hdr = buf.push(kFrameHeaderLen);
+	putUint32(hdr, static_cast<std::uint32_t>(1 + payloadLen));
+	hdr[4] = static_cast<std::uint8_t>(type);
+	++_stats.framesSent;
+	sendAll(buf.data(), buf.size());
+	buf.pull(kFrameHeaderLen);
+}
+
+void Tunnel::queueFrame(FrameType type, const std::uint8_t* payload, std::size_t len) {
+	// payloads beyond the peer's frame limit go out as a run of fragments,
+	// each written (or queued) before the next is framed
+	const std::size_t maxPayload = maxSendPayload(len);
+	const FrameType more = static_cast<FrameType>(static_cast<std::uint8_t>(type) | kMoreFragmentsFlag);
+	while (len > maxPayload) {
+		queueFragment(more, payload, maxPayload);
+		payload += maxPayload;
+		len -= maxPayload;
+	}
+	queueFragment(type, payload, len);
+}
+
+void Tunnel::queueFragment(FrameType type, const std::uint8_t* payload, std::size_t len) {
 	// Frame format: [len:4][type:1][payload...], len = 1 + payload size
-	std::vector<std::uint8_t> buf;
-	buf.reserve(5 + frame.payload.size());
-	writeUint32(buf, static_cast<std::uint32_t>(1 + frame.payload.size()));
-	buf.push_back(static_cast<std::uint8_t>(frame.type));
-	buf.insert(buf.end(), frame.payload.begin(), frame.payload.end());
-	const char* data = reinterpret_cast<const char*>(buf.data());
-	int toSend = static_cast<int>(buf.size());
+	if (_txQueue.empty()) _txQueuedAt = std::chrono::steady_clock::now();
+	++_stats.framesSent;
+	writeUint32(_txQueue, static_cast<std::uint32_t>(1 + len));
+	_txQueue.push_back(static_cast<std::uint8_t>(type));
+	if (len >= kTlsRecordSize && !_nonBlocking) {
+		// large payload: top the queue up to one full record, write the rest
+		// straight from the caller's memory instead of copying it
+		const std::size_t head = _txQueue.size() < kTlsRecordSize ? std::min(len, kTlsRecordSize - _txQueue.size()) : 0;
+		_txQueue.insert(_txQueue.end(), payload, payload + head);
+		flush();
+		sendAll(payload + head, len - head);
+		return;
+	}
+	if (len > 0) _txQueue.insert(_txQueue.end(), payload, payload + len);
+	if (_txQueue.size() >= _coalescing.flushBytes) {
+		flush();
+	} else {
+		flushIfDue();
+	}
+}
+
+void Tunnel::appendFrame(FrameType type, const std::uint8_t* payload, std::size_t len) {
+	const std::size_t maxPayload = maxSendPayload(len);
+	std::uint8_t flags = 0;
+	do {
+		const std::size_t n = std::min(len, maxPayload);
+		flags = n < len ? kMoreFragmentsFlag : 0;
+		++_stats.framesSent;
+		writeUint32(_txQueue, static_cast<std::uint32_t>(1 + n));
+		_txQueue.push_back(static_cast<std::uint8_t>(static_cast<std::uint8_t>(type) | flags));
+		if (n >= kTlsRecordSize && !_nonBlocking) {
+			// as in queueFragment: a full record is worth its own write, without the copy
+			const std::size_t head = _txQueue.size() < kTlsRecordSize ? kTlsRecordSize - _txQueue.size() : 0;
+			_txQueue.insert(_txQueue.end(), payload, payload + head);
+			flush();
+			sendAll(payload + head, n - head);
+		} else {
+			_txQueue.insert(_txQueue.end(), payload, payload + n);
+		}
+		payload += n;
+		len -= n;
+	} while (flags != 0);
+}
+
+std::size_t Tunnel::maxSendPayload(std::size_t len) const {
+	// peers that announced no limits take whole frames, as before fragmentation existed
+	const std::size_t frameLen = _handshakeResult.peerMaxFrameLen ? _handshakeResult.peerMaxFrameLen : kMaxFrameLen;
+	const std::size_t messageLen = _handshakeResult.peerMaxMessageLen ? _handshakeResult.peerMaxMessageLen : kMaxFrameLen - 1;
+	if (len > messageLen) throw std::runtime_error("payload exceeds the peer's message size limit");
+	return frameLen - 1;
+}
+
+void Tunnel::setCoalescing(const CoalescingOptions& options) {
+	_coalescing = options;
+	if (_coalescing.flushBytes == 0) flush();
+}
+
+void Tunnel::flush() {
+	if (_txQueue.empty()) return;
+	if (_nonBlocking) {
+		// write what the socket takes now; the rest waits for the next flush
+		std::size_t sent = 0;
+		while (sent < _txQueue.size()) {
+			int n = _socket.sendBytes(_txQueue.data() + sent, static_cast<int>(_txQueue.size() - sent));
+			if (n < 0) break; // would block (TLS: the same bytes are offered again next time)
+			if (n == 0) throw std::runtime_error("sendFrame failed");
+			sent += static_cast<std::size_t>(n);
+			++_stats.writes;
+		}
+		_stats.bytesSent += sent;
+		_txQueue.erase(_txQueue.begin(), _txQueue.begin() + static_cast<std::ptrdiff_t>(sent));
+		return;
+	}
+	sendAll(_txQueue.data(), _txQueue.size());
+	_txQueue.clear(); // keeps capacity for the next burst
+}
+
+void Tunnel::releaseBuffers() {
+	if (_rxHead == _rxTail && !_reassembling) {
+		_rxBuffer = BufferBlock::Ptr();
+		_rxHead = _rxTail = 0;
+		std::vector<std::uint8_t>().swap(_rxMessage);
+		_rxMessageDone = false;
+	}
+	if (_txQueue.empty()) std::vector<std::uint8_t>().swap(_txQueue);
+}
+
+bool Tunnel::flushIfDue() {
+	if (_txQueue.empty()) return false;
+	if (std::chrono::steady_clock::now() - _txQueuedAt < _coalescing.maxDelay) return false;
+	flush();
+	return true;
+}
+
+void Tunnel::sendAll(const std::uint8_t* data, std::size_t len) {
+	const char* p = reinterpret_cast<const char*>(data);
+	int toSend = static_cast<int>(len);
 	int sent = 0;
 	while (sent < toSend) {
-		int n = _socket.sendBytes(data + sent, toSend - sent);
+		int n = _socket.sendBytes(p + sent, toSend - sent);
 		if (n <= 0) throw std::runtime_error("sendFrame failed");
 		sent += n;
 	}
+	++_stats.writes;
+	_stats.bytesSent += len;
 }
 
 bool Tunnel::receiveFrame(Frame& outFrame, std::chrono::milliseconds timeout) {
-	_socket.setReceiveTimeout(Poco::Timespan(0, static_cast<long>(timeout.count()) * 1000));
-	std::uint8_t hdr[4];
-	int recvd = 0;
-	while (recvd < 4) {
-		int n = _socket.receiveBytes(reinterpret_cast<void*>(hdr + recvd), 4 - recvd);
-		if (n <= 0) return false;
-		recvd += n;
-	}
-	std::uint32_t len = readUint32(hdr);
-	if (len == 0) return false;
-	std::vector<std::uint8_t> body(len);
-	int got = 0;
-	while (got < static_cast<int>(len)) {
-		int n = _socket.receiveBytes(reinterpret_cast<void*>(body.data() + got), static_cast<int>(len) - got);
-		if (n <= 0) return false;
-		got += n;
-	}
-	if (body.empty()) return false;
-	outFrame.type = static_cast<FrameType>(body[0]);
-	outFrame.payload.assign(body.begin() + 1, body.end());
+	FrameView view;
+	if (!receiveFrame(view, timeout)) return false;
+	outFrame.type = view.type;
+	outFrame.payload.assign(view.payload.data, view.payload.data + view.payload.size);
+	return true;
+}
+
+bool Tunnel::receiveFrame(FrameView& outFrame, std::chrono::milliseconds timeout) {
+	if (_rxMessageDone) {
+		// the last reassembled message has been consumed; keep only a modest buffer
+		_rxMessageDone = false;
+		_rxMessage.clear();
+		if (_rxMessage.capacity() > kReceiveBufferSize) std::vector<std::uint8_t>().swap(_rxMessage);
+	}
+	for (;;) {
+		bool more = false;
+		// serve frames left over from an earlier read before touching the socket
+		while (!nextBufferedFrame(outFrame, more)) {
+			if (!fillReceiveBuffer(timeout)) return false;
+		}
+		if (!more && !_reassembling) return true;
+		if (reassemble(outFrame, more)) return true;
+	}
+}
+
+bool Tunnel::frameBuffered() const {
+	const std::size_t avail = _rxTail - _rxHead;
+	return avail >= 4 && avail - 4 >= readUint32(_rxBuffer->data() + _rxHead);
+}
+
+bool Tunnel::reassemble(FrameView& frame, bool more) {
+	if (!_reassembling) {
+		_reassembling = true;
+		_rxMessageType = frame.type;
+		_rxMessageCompressed = frame.compressed;
+	} else if (frame.type != _rxMessageType || frame.compressed != _rxMessageCompressed) {
+		throw std::runtime_error("fragment does not continue the current message");
+	}
+	const std::size_t limit = _handshakeOptions.maxMessageLen;
+	if (frame.payload.size > limit - _rxMessage.size()) throw std::runtime_error("reassembled message too large");
+	// grow geometrically but never past the message limit
+	const std::size_t needed = _rxMessage.size() + frame.payload.size;
+	if (needed > _rxMessage.capacity()) _rxMessage.reserve(std::min(std::max(needed, 2 * _rxMessage.capacity()), limit));
+	_rxMessage.insert(_rxMessage.end(), frame.payload.data, frame.payload.data + frame.payload.size);
+	if (more) return false;
+	_reassembling = false;
+	_rxMessageDone = true;
+	frame.payload = ByteView{_rxMessage.data(), _rxMessage.size()};
+	return true;
+}
+
+bool Tunnel::nextBufferedFrame(FrameView& outFrame, bool& more) {
+	for (;;) {
+		const std::size_t avail = _rxTail - _rxHead;
+		if (avail < 4) return false;
+		const std::uint32_t len = readUint32(_rxBuffer->data() + _rxHead);
+		if (len > _handshakeOptions.maxFrameLen) throw std::runtime_error("frame too large");
+		if (avail - 4 < len) return false;
+		std::uint8_t* body = _rxBuffer->data() + _rxHead + 4;
+		_rxHead += 4 + len;
+		if (len == 0) continue; // empty frame carries no type; skip it
+		outFrame.type = static_cast<FrameType>(body[0] & ~(kCompressedFlag | kMoreFragmentsFlag));
+		outFrame.compressed = (body[0] & kCompressedFlag) != 0;
+		more = (body[0] & kMoreFragmentsFlag) != 0;
+		++_stats.framesReceived;
+		outFrame.payload = ByteView{body + 1, len - 1};
+		return true;
+	}
+}
+
+bool Tunnel::fillReceiveBuffer(std::chrono::milliseconds timeout) {
+	// the peer may be waiting on what we have queued before it answers
+	flush();
+	if (!_rxBuffer) _rxBuffer = BufferPool::forThread().acquire(kReceiveBufferSize);
+	// Views handed out earlier are invalidated from here on, so the unparsed
+	// tail can move to the front to make room for one large read
+	if (_rxHead == _rxTail) {
+		_rxHead = _rxTail = 0;
+		// drop a block grown for an oversized frame in favour of a pooled one;
+		// not its sibling, which is unpooled like the grown block itself
+		if (_rxBuffer->capacity() > kReceiveBufferSize) _rxBuffer = BufferPool::forThread().acquire(kReceiveBufferSize);
+	} else if (_rxHead > 0) {
+		std::memmove(_rxBuffer->data(), _rxBuffer->data() + _rxHead, _rxTail - _rxHead);
+		_rxTail -= _rxHead;
+		_rxHead = 0;
+	}
+	if (_rxTail >= 4) {
+		const std::size_t need = 4 + static_cast<std::size_t>(readUint32(_rxBuffer->data()));
+		if (need > _rxBuffer->capacity()) {
+			BufferBlock::Ptr bigger = _rxBuffer->sibling(need);
+			std::memcpy(bigger->data(), _rxBuffer->data(), _rxTail);
+			_rxBuffer = bigger;
+		}
+	}
+	if (!_nonBlocking && timeout != _rxTimeout) {
+		_socket.setReceiveTimeout(Poco::Timespan(0, static_cast<long>(timeout.count()) * 1000));
+		_rxTimeout = timeout;
+	}
+	int n = 0;
+	try {
+		n = _socket.receiveBytes(reinterpret_cast<void*>(_rxBuffer->data() + _rxTail),
+		                         static_cast<int>(_rxBuffer->capacity() - _rxTail));
+	} catch (const Poco::TimeoutException&) {
+		return false;
+	}
+	if (n < 0 && _nonBlocking) return false; // nothing to read yet
+	if (n <= 0) {
+		_closed = true;
+		return false;
+	}
+	_rxTail += static_cast<std::size_t>(n);
+	++_stats.reads;
+	_stats.bytesReceived += static_cast<std::size_t>(n);
 	return true;
 }
 
@@ -195,6 +569,35 @@ void Tunnel::writeUint32(std::vector<std::uint8_t>& buf, std::uint32_t v) {
 	buf.push_back(static_cast<std::uint8_t>(v & 0xFF));
 }
 
+void Tunnel::writeExtension(std::vector<std::uint8_t>& buf, HelloExtension type, const std::vector<std::uint8_t>& value) {
+	if (value.size() > 255) throw std::runtime_error("hello extension too long");
+	buf.push_back(static_cast<std::uint8_t>(type));
+	buf.push_back(static_cast<std::uint8_t>(value.size()));
+	buf.insert(buf.end(), value.begin(), value.end());
+}
+
+void Tunnel::parseExtensions(const std::vector<std::uint8_t>& payload, std::size_t offset,
+                             std::vector<std::pair<HelloExtension, std::vector<std::uint8_t>>>& out) {
+	// unknown extension types are kept; callers skip what they do not understand
+	std::size_t p = offset;
+	while (p < payload.size()) {
+		if (payload.size() - p < 2) throw std::runtime_error("truncated hello extension");
+		auto type = static_cast<HelloExtension>(payload[p]);
+		std::size_t len = payload[p + 1];
+		p += 2;
+		if (payload.size() - p < len) throw std::runtime_error("truncated hello extension");
+		out.emplace_back(type, std::vector<std::uint8_t>(payload.begin() + p, payload.begin() + p + len));
+		p += len;
+	}
+}
+
+void Tunnel::putUint32(std::uint8_t* p, std::uint32_t v) {
+	p[0] = static_cast<std::uint8_t>((v >> 24) & 0xFF);
+	p[1] = static_cast<std::uint8_t>((v >> 16) & 0xFF);
+	p[2] = static_cast<std::uint8_t>((v >> 8) & 0xFF);
+	p[3] = static_cast<std::uint8_t>(v & 0xFF);
+}
+
 std::uint32_t Tunnel::readUint32(const std::uint8_t* p) {
 	return (static_cast<std::uint32_t>(p[0]) << 24) |
 	       (static_cast<std::uint32_t>(p[1]) << 16) |
@@ -1,6 +1,6 @@
 #include "vpn/core/Crypto.h"
+#include "vpn/random.h"
 #include <Poco/Crypto/DigestEngine.h>
-#include <Poco/RandomStream.h>
 #include <Poco/HexBinaryEncoder.h>
 #include <sstream>
 
@@ -15,8 +15,7 @@ std::vector<unsigned char> Crypto::sha256(const std::vector<unsigned char>& data
 
 std::string Crypto::randomHex(std::size_t bytes) {
 	std::string buffer(bytes, '\0');
-	Poco::RandomInputStream ris;
-	ris.read(buffer.data(), static_cast<std::streamsize>(bytes));
+	vpn::secureRandom(reinterpret_cast<std::uint8_t*>(buffer.data()), bytes);
 	std::ostringstream oss;
 	Poco::HexBinaryEncoder encoder(oss);
 	encoder.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
@@ -8,11 +8,14 @@
 #include <Poco/Logger.h>
 #include <Poco/Format.h>
 #include <stdexcept>
-#include <Poco/UUIDGenerator.h>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Stringifier.h>
 #include "vpn/tunnel.h"
 #include "vpn/crypto.h"
+#include "vpn/random.h"
 
 using Poco::Net::Context;
 using Poco::Net::SecureStreamSocket;
@@ -37,18 +40,34 @@ VpnClient::VpnClient(const ClientConfig& config)
 	SSLManager::instance().initializeClient(pkeyHandler, certHandler, _sslContext.get());
 }
 
+VpnClient::~VpnClient() {
+	try {
+		disconnect();
+	} catch (...) {}
+}
+
 void VpnClient::connect() {
 	if (_connected) return;
 	Poco::Net::SocketAddress addr(_config.serverHost, _config.serverPort);
 	_socket = std::make_unique<SecureStreamSocket>(addr, _sslContext.get());
-	// Perform tunnel handshake
-	vpn::Tunnel tunnel(*_socket);
-	auto clientSessionId = Poco::UUIDGenerator::defaultGenerator().createRandom().toString();
+	// One tunnel for the whole connection: streams keep state across calls
+	_tunnel = std::make_unique<Tunnel>(*_socket);
+	Tunnel& tunnel = *_tunnel;
+	HandshakeOptions handshakeOptions;
+	handshakeOptions.cipherSuites = _config.cipherSuites;
+	handshakeOptions.tlsOnlyData = _config.allowTlsOnlyData;
+	if (_config.compression) handshakeOptions.compression = {CompressionCodec::ZLIB};
+	tunnel.setHandshakeOptions(handshakeOptions);
+	CoalescingOptions coalescing;
+	coalescing.flushBytes = _config.sendCoalesceBytes;
+	coalescing.maxDelay = _config.sendCoalesceDelay;
+	tunnel.setCoalescing(coalescing);
+	auto clientSessionId = randomSessionId();
 	std::string serverSessionId;
 	std::vector<std::uint8_t> clientNonce, serverNonce, keySeed;
 	tunnel.clientHandshake(clientSessionId, clientNonce, serverSessionId, serverNonce, keySeed);
 	auto keys = vpn::deriveSessionKeys(keySeed, clientNonce, serverNonce);
-	_sessionCrypto = std::make_unique<vpn::SessionCrypto>(keys.encKey, keys.macKey);
+	_sessionCrypto = std::make_unique<vpn::SessionCrypto>(keys.encKey, keys.macKey, tunnel.handshakeResult().cipherSuite);
 
 	// Authentication
 	Poco::JSON::Object::Ptr authObj = new Poco::JSON::Object();
@@ -64,51 +83,422 @@ void VpnClient::connect() {
 	std::string message;
 	if (!tunnel.receiveAuthResult(std::chrono::milliseconds(5000), success, message) || !success) {
 		tunnel.sendClose();
+		_tunnel.reset();
 		_sessionCrypto.reset();
 		_socket->shutdown();
 		_socket.reset();
 		throw std::runtime_error(message.empty() ? "Authentication failed" : message);
 	}
+	// "OK", followed by our addresses when the server runs a virtual network
+	_virtualAddresses.clear();
+	std::istringstream words(message);
+	std::string word;
+	words >> word;
+	while (words >> word) _virtualAddresses.push_back(word);
+	_tlsOnlyData = tunnel.handshakeResult().tlsOnlyData;
+	if (_tlsOnlyData) {
+		// mTLS already protects the channel; data goes out as plain DATA frames
+		_sessionCrypto.reset();
+	}
+	_streams = std::make_unique<StreamMux>(tunnel, _sessionCrypto.get(), true);
+	if (tunnel.handshakeResult().compression != CompressionCodec::NONE) {
+		_compressor = std::make_unique<PayloadCompressor>(tunnel.handshakeResult().compression);
+		// a decompressed payload may not outgrow what we accept as one message
+		_compressor->setMaxDecompressedSize(handshakeOptions.maxMessageLen);
+	}
+	_txPacket = createPacket(0);
 	_connected = true;
-	Poco::Logger::get("VpnClient").information("Connected to VPN server");
+	Poco::Logger::get("VpnClient").information(_tlsOnlyData ? "Connected to VPN server (TLS-only data)" : "Connected to VPN server");
 }
 
 void VpnClient::disconnect() {
 	if (!_connected) return;
+	// the I/O thread sends what is still queued before it exits
+	stopAsync();
 	try {
-		if (_socket) {
-			vpn::Tunnel tunnel(*_socket);
-			tunnel.sendClose();
-		}
+		if (_tunnel) _tunnel->sendClose();
 		_socket->shutdown();
 	} catch (...) {}
+	_streams.reset();
+	_compressor.reset();
+	_tunnel.reset();
 	_socket.reset();
 	_sessionCrypto.reset();
+	_rxQueue.clear();
+	_tlsOnlyData = false;
 	_connected = false;
 	Poco::Logger::get("VpnClient").information("Disconnected from VPN server");
 }
 
 void VpnClient::send(const std::vector<unsigned char>& data) {
 	if (!_connected || !_socket) throw std::runtime_error("Not connected");
-	vpn::Tunnel tunnel(*_socket);
+	if (_ioThread) {
+		sendAsync(data).get();
+	} else if (_sessionCrypto) {
+		// one copy into the reusable buffer, then encrypted and framed in place
+		_txPacket.reset(Tunnel::kFrameHeaderLen + _sessionCrypto->headroom());
+		_txPacket.assign(data.data(), data.size());
+		send(_txPacket);
+	} else {
+		_tunnel->sendData(data);
+	}
+}
+
+PacketBuffer VpnClient::createPacket(std::size_t payloadCapacity) const {
+	return createPacket(_bufferPool, payloadCapacity);
+}
+
+PacketBuffer VpnClient::createPacket(BufferPool& pool, std::size_t payloadCapacity) const {
+	std::size_t headroom = Tunnel::kFrameHeaderLen;
+	std::size_t tailroom = 0;
+	if (_sessionCrypto) {
+		headroom += _sessionCrypto->headroom();
+		tailroom = _sessionCrypto->tailroom();
+	}
+	return PacketBuffer(pool, headroom, payloadCapacity, tailroom);
+}
+
+void VpnClient::send(PacketBuffer& packet) {
+	if (!_connected || !_socket) throw std::runtime_error("Not connected");
+	if (_ioThread) {
+		sendAsync(std::vector<unsigned char>(packet.data(), packet.data() + packet.size())).get();
+		return;
+	}
+	const bool compressed = _compressor && _compressor->compress(packet);
 	if (_sessionCrypto) {
-		auto enc = _sessionCrypto->encrypt(data);
-		tunnel.sendEncrypted(enc);
+		_sessionCrypto->encryptInPlace(packet);
+		_tunnel->sendEncrypted(packet, compressed);
 	} else {
-		tunnel.sendData(data);
+		_tunnel->sendFrame(FrameType::DATA, packet, compressed);
 	}
 }
 
-std::vector<unsigned char> VpnClient::receive() {
+void VpnClient::sendBatch(std::vector<PacketBuffer>& packets) {
 	if (!_connected || !_socket) throw std::runtime_error("Not connected");
-	vpn::Tunnel tunnel(*_socket);
+	if (_ioThread) {
+		std::vector<std::future<void>> sent;
+		for (const auto& packet : packets) {
+			sent.push_back(sendAsync(std::vector<unsigned char>(packet.data(), packet.data() + packet.size())));
+		}
+		for (auto& done : sent) done.get();
+		return;
+	}
+	sendPackets(packets);
+}
+
+void VpnClient::sendPackets(std::vector<PacketBuffer>& packets) {
+	std::vector<bool> compressed;
+	if (_compressor) {
+		compressed.reserve(packets.size());
+		for (auto& packet : packets) compressed.push_back(_compressor->compress(packet));
+	}
 	if (_sessionCrypto) {
-		auto enc = tunnel.receiveEncrypted(std::chrono::milliseconds(5000));
-		if (!enc.empty()) {
-			return _sessionCrypto->decrypt(enc);
+		_sessionCrypto->encryptBatch(packets);
+		_tunnel->sendEncryptedBatch(packets, compressed);
+	} else {
+		_tunnel->sendFrameBatch(FrameType::DATA, packets, compressed);
+	}
+}
+
+void VpnClient::flush() {
+	if (!_connected || !_tunnel) throw std::runtime_error("Not connected");
+	// the I/O thread flushes after every round of queued sends
+	if (!_ioThread) _tunnel->flush();
+}
+
+TunnelStats VpnClient::tunnelStats() const {
+	if (_ioThread) {
+		Poco::FastMutex::ScopedLock lock(_asyncMutex);
+		return _asyncStats;
+	}
+	return _tunnel ? _tunnel->stats() : TunnelStats{};
+}
+
+std::vector<unsigned char> VpnClient::receive() {
+	if (!_connected || !_socket) throw std::runtime_error("Not connected");
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(5000);
+	if (_ioThread) {
+		if (_packetHandler) throw std::runtime_error("Packets are delivered to the async handler");
+		for (;;) {
+			{
+				Poco::FastMutex::ScopedLock lock(_asyncMutex);
+				if (!_rxQueue.empty()) {
+					auto packet = std::move(_rxQueue.front());
+					_rxQueue.pop_front();
+					return packet;
+				}
+				if (!_asyncError.empty()) throw std::runtime_error(_asyncError);
+			}
+			const auto now = std::chrono::steady_clock::now();
+			if (now >= deadline) return {};
+			_rxReady.tryWait(static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1);
+		}
+	}
+	while (_rxQueue.empty() && processIncoming(deadline)) {}
+	if (_rxQueue.empty()) return {};
+	auto packet = std::move(_rxQueue.front());
+	_rxQueue.pop_front();
+	return packet;
+}
+
+std::uint32_t VpnClient::openStream() {
+	if (!_connected || !_streams) throw std::runtime_error("Not connected");
+	requireSyncMode();
+	return _streams->open();
+}
+
+void VpnClient::sendStream(std::uint32_t streamId, const std::vector<unsigned char>& data) {
+	if (!_connected || !_streams) throw std::runtime_error("Not connected");
+	requireSyncMode();
+	_streams->write(streamId, data.data(), data.size());
+	// keep at most one window queued: wait for the server to return credit
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(5000);
+	while (_streams->pending(streamId) > StreamMux::kDefaultWindow) {
+		if (!processIncoming(deadline)) throw std::runtime_error("stream send timed out");
+	}
+}
+
+std::vector<unsigned char> VpnClient::receiveStream(std::uint32_t streamId, std::chrono::milliseconds timeout) {
+	if (!_connected || !_streams) throw std::runtime_error("Not connected");
+	requireSyncMode();
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	while (_streams->readable(streamId) == 0 && !_streams->remoteClosed(streamId)) {
+		if (!processIncoming(deadline)) break;
+	}
+	std::vector<unsigned char> data(_streams->readable(streamId));
+	if (!data.empty()) _streams->read(streamId, data.data(), data.size());
+	return data;
+}
+
+void VpnClient::closeStream(std::uint32_t streamId) {
+	if (!_connected || !_streams) throw std::runtime_error("Not connected");
+	requireSyncMode();
+	_streams->close(streamId);
+}
+
+bool VpnClient::streamFinished(std::uint32_t streamId) const {
+	requireSyncMode();
+	return !_streams || (_streams->remoteClosed(streamId) && _streams->readable(streamId) == 0);
+}
+
+bool VpnClient::processIncoming(std::chrono::steady_clock::time_point deadline) {
+	const auto now = std::chrono::steady_clock::now();
+	if (now >= deadline) return false;
+	FrameView frame;
+	if (!_tunnel->receiveFrame(frame, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now))) {
+		if (_tunnel->closed()) throw std::runtime_error("Connection closed by server");
+		return false;
+	}
+	handleIncoming(frame);
+	return true;
+}
+
+void VpnClient::handleIncoming(const FrameView& frame) {
+	// packets that arrive while waiting on a stream are kept for receive()
+	if (StreamMux::isStreamFrame(frame.type)) {
+		_streams->handleFrame(frame);
+	} else if ((frame.type == FrameType::ENCRYPTED_DATA && _sessionCrypto) || frame.type == FrameType::DATA) {
+		ByteView plain = frame.type == FrameType::DATA ? frame.payload : _sessionCrypto->decryptInPlace(frame.payload);
+		if (frame.compressed) {
+			if (!_compressor) throw std::runtime_error("compressed frame without negotiated compression");
+			plain = _compressor->decompress(plain);
+		}
+		deliverPacket(plain);
+	}
+}
+
+void VpnClient::deliverPacket(ByteView packet) {
+	if (!_ioThread) {
+		_rxQueue.emplace_back(packet.data, packet.data + packet.size);
+		return;
+	}
+	if (_packetHandler) {
+		try {
+			_packetHandler(packet);
+		} catch (const std::exception& ex) {
+			Poco::Logger::get("VpnClient").warning(Poco::format("Packet handler error: %s", std::string(ex.what())));
+		}
+		return;
+	}
+	{
+		Poco::FastMutex::ScopedLock lock(_asyncMutex);
+		_rxQueue.emplace_back(packet.data, packet.data + packet.size);
+	}
+	_rxReady.set();
+}
+
+void VpnClient::startAsync(PacketHandler handler) {
+	if (!_connected || !_tunnel) throw std::runtime_error("Not connected");
+	if (_ioThread) throw std::runtime_error("Async mode already running");
+	_tunnel->flush();
+	_packetHandler = std::move(handler);
+	if (_packetHandler) {
+		// hand over packets that arrived before the switch
+		for (auto& packet : _rxQueue) _packetHandler(ByteView{packet.data(), packet.size()});
+		_rxQueue.clear();
+	}
+	_pollSet.add(*_socket, Poco::Net::PollSet::POLL_READ);
+	_ioThread = std::make_unique<Poco::Thread>("VpnClient-io");
+	_ioThread->startFunc([this]() { runAsync(); });
+}
+
+std::future<void> VpnClient::sendAsync(std::vector<unsigned char> data) {
+	if (!_connected || !_ioThread) throw std::runtime_error("Async mode not running");
+	PendingSend pending;
+	pending.data = std::move(data);
+	auto done = pending.done.get_future();
+	{
+		Poco::FastMutex::ScopedLock lock(_asyncMutex);
+		if (!_asyncError.empty()) {
+			pending.done.set_exception(std::make_exception_ptr(std::runtime_error(_asyncError)));
+			return done;
 		}
+		_sendQueue.push_back(std::move(pending));
 	}
-	return tunnel.receiveData(std::chrono::milliseconds(5000));
+	_pollSet.wakeUp();
+	return done;
+}
+
+void VpnClient::startPacketIO(PacketIO& io) {
+	startAsync([&io](ByteView packet) { io.write(packet); });
+	_packetIO = &io;
+	_packetReader = std::make_unique<Poco::Thread>("VpnClient-packets");
+	_packetReader->startFunc([this, &io]() { readPackets(io); });
+}
+
+void VpnClient::readPackets(PacketIO& io) {
+	// buffers come from this thread's pool; the I/O thread returns them after sending
+	BufferPool& pool = BufferPool::forThread();
+	std::vector<PacketBuffer> batch;
+	try {
+		while (!_asyncStop) {
+			while (batch.size() < kPacketBatch) batch.push_back(createPacket(pool, io.mtu()));
+			const std::size_t count = io.read(batch, std::chrono::milliseconds(1000));
+			if (count == 0) continue;
+			// a full queue means the connection is the bottleneck: stop reading
+			// and let io's own queue fill up and drop
+			for (;;) {
+				{
+					Poco::FastMutex::ScopedLock lock(_asyncMutex);
+					if (!_asyncError.empty()) return;
+					if (_packetQueue.size() < kMaxQueuedPackets) {
+						std::move(batch.begin(), batch.begin() + count, std::back_inserter(_packetQueue));
+						break;
+					}
+				}
+				if (_asyncStop) return;
+				_packetSpace.tryWait(100);
+			}
+			batch.erase(batch.begin(), batch.begin() + count);
+			_pollSet.wakeUp();
+		}
+	} catch (const std::exception& ex) {
+		// a tunnel that no longer carries the device's packets is down: fail the
+		// connection as an I/O thread error would
+		Poco::Logger::get("VpnClient").warning(Poco::format("Packet reader stopped: %s", std::string(ex.what())));
+		{
+			Poco::FastMutex::ScopedLock lock(_asyncMutex);
+			if (_asyncError.empty()) _asyncError = std::string("Packet reader stopped: ") + ex.what();
+		}
+		_asyncStop = true;
+		_pollSet.wakeUp();
+	}
+}
+
+void VpnClient::runAsync() {
+	// once data starts arriving, how long to wait for the rest of a frame
+	// before queued sends get another turn
+	const auto frameTimeout = std::chrono::milliseconds(100);
+	try {
+		while (!_asyncStop) {
+			sendQueued();
+			// TLS may hold decrypted records the socket no longer signals
+			if (!_tunnel->frameBuffered() && _socket->available() == 0) {
+				{
+					Poco::FastMutex::ScopedLock lock(_asyncMutex);
+					_asyncStats = _tunnel->stats();
+				}
+				// sleeps until the server sends something or sendAsync()/stopAsync() wake it
+				if (_pollSet.poll(Poco::Timespan(1, 0)).empty()) continue;
+			}
+			FrameView frame;
+			if (_tunnel->receiveFrame(frame, frameTimeout)) {
+				handleIncoming(frame);
+			} else if (_tunnel->closed()) {
+				throw std::runtime_error("Connection closed by server");
+			}
+		}
+		{
+			// stopped by the packet reader failing rather than by stopAsync()
+			Poco::FastMutex::ScopedLock lock(_asyncMutex);
+			if (!_asyncError.empty()) throw std::runtime_error(_asyncError);
+		}
+		sendQueued();
+		_tunnel->flush();
+	} catch (const std::exception& ex) {
+		Poco::Logger::get("VpnClient").warning(Poco::format("I/O thread stopped: %s", std::string(ex.what())));
+		Poco::FastMutex::ScopedLock lock(_asyncMutex);
+		_asyncError = ex.what();
+		for (auto& pending : _sendQueue) pending.done.set_exception(std::make_exception_ptr(std::runtime_error(_asyncError)));
+		_sendQueue.clear();
+		_packetQueue.clear();
+		_packetSpace.set();
+	}
+	Poco::FastMutex::ScopedLock lock(_asyncMutex);
+	_asyncStats = _tunnel->stats();
+	_rxReady.set();
+}
+
+void VpnClient::sendQueued() {
+	std::deque<PendingSend> batch;
+	// everything queued since the last round goes out in one write: packets
+	// from the PacketIO as they are, sendAsync() data copied into buffers
+	_asyncBatch.clear();
+	{
+		Poco::FastMutex::ScopedLock lock(_asyncMutex);
+		batch.swap(_sendQueue);
+		_asyncBatch.swap(_packetQueue);
+	}
+	if (!_asyncBatch.empty()) _packetSpace.set();
+	if (batch.empty() && _asyncBatch.empty()) return;
+	for (const auto& pending : batch) {
+		_asyncBatch.push_back(createPacket(pending.data.size()));
+		_asyncBatch.back().assign(pending.data.data(), pending.data.size());
+	}
+	try {
+		sendPackets(_asyncBatch);
+	} catch (...) {
+		for (auto& pending : batch) pending.done.set_exception(std::current_exception());
+		throw;
+	}
+	for (auto& pending : batch) pending.done.set_value();
+}
+
+void VpnClient::stopAsync() {
+	if (!_ioThread) return;
+	_asyncStop = true;
+	if (_packetReader) {
+		_packetIO->wakeUp();
+		_packetSpace.set();
+		_packetReader->join();
+		_packetReader.reset();
+		_packetIO = nullptr;
+	}
+	_pollSet.wakeUp();
+	_ioThread->join();
+	_ioThread.reset();
+	_pollSet.clear();
+	_asyncStop = false;
+	_packetHandler = PacketHandler();
+	_asyncError.clear();
+	// sends queued after the thread's last round
+	for (auto& pending : _sendQueue) pending.done.set_exception(std::make_exception_ptr(std::runtime_error("Disconnected")));
+	_sendQueue.clear();
+	_packetQueue.clear();
+}
+
+void VpnClient::requireSyncMode() const {
+	if (_ioThread) throw std::runtime_error("Streams are not available in async mode");
 }
 
 } // namespace vpn
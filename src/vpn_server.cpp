@@ -4,18 +4,19 @@
 #include <Poco/Net/TCPServerParams.h>
 #include <Poco/Net/SocketStream.h>
 #include <Poco/Net/SSLManager.h>
+#include <Poco/Net/PollSet.h>
 #include <Poco/Net/ConsoleCertificateHandler.h>
 #include <Poco/Net/KeyConsoleHandler.h>
 #include <Poco/Buffer.h>
 #include <Poco/Logger.h>
 #include <Poco/Format.h>
-#include <Poco/Thread.h>
 #include <Poco/Timespan.h>
+#include <Poco/Event.h>
 #include <iostream>
-#include <Poco/JSON/Parser.h>
-#include <Poco/JSON/Object.h>
-#include <Poco/UUIDGenerator.h>
+#include <openssl/ssl.h>
 #include "vpn/tunnel.h"
+#include "vpn/server_session.h"
+#include "vpn/server_reactor.h"
 #include "vpn/crypto.h"
 #include "vpn/auth.h"
 
@@ -31,121 +32,128 @@ namespace vpn {
 
 class VpnServer::Connection : public TCPServerConnection {
 public:
-	Connection(const Poco::Net::StreamSocket& s, CredentialStore::Ptr store)
+	Connection(const Poco::Net::StreamSocket& s, CredentialStore::Ptr store, const ServerConfig& config,
+	           SessionRegistry::Ptr sessions, VirtualNetwork::Ptr network)
 		: TCPServerConnection(s)
-		, _store(std::move(store)) {}
+		, _store(std::move(store))
+		, _sessions(std::move(sessions))
+		, _network(std::move(network))
+		, _config(config) {}
 
 	void run() override {
 		try {
 			Poco::Net::SecureStreamSocket secureSock(socket());
 			vpn::Tunnel tunnel(secureSock);
-			// Handshake
-			auto serverSessionId = Poco::UUIDGenerator::defaultGenerator().createRandom().toString();
-			std::string clientSessionId;
-			std::vector<std::uint8_t> clientNonce, serverNonce, keySeed;
-			tunnel.serverHandshake(serverSessionId, clientSessionId, clientNonce, serverNonce, keySeed);
-			auto keys = vpn::deriveSessionKeys(keySeed, clientNonce, serverNonce);
-			vpn::SessionCrypto sessionCrypto(keys.encKey, keys.macKey);
-			Poco::Logger::get("VpnServer").information(Poco::format("Session established serverId=%s clientId=%s", serverSessionId, clientSessionId));
-
-			// Authentication phase
-			auto authCipher = tunnel.receiveAuth(std::chrono::milliseconds(10000));
-			if (authCipher.empty()) {
-				tunnel.sendAuthResult(false, "Authentication timeout");
-				tunnel.sendClose();
-				return;
-			}
-
-			std::string username;
-			std::string password;
-			try {
-				auto authPlain = sessionCrypto.decrypt(authCipher);
-				std::string authJson(authPlain.begin(), authPlain.end());
-				Poco::JSON::Parser parser;
-				auto result = parser.parse(authJson);
-				auto obj = result.extract<Poco::JSON::Object::Ptr>();
-				username = obj->getValue<std::string>("username");
-				password = obj->getValue<std::string>("password");
-			} catch (const std::exception& ex) {
-				Poco::Logger::get("VpnServer").warning(Poco::format("Auth parse error: %s", ex.what()));
-				tunnel.sendAuthResult(false, "Invalid auth payload");
-				tunnel.sendClose();
-				return;
-			}
-
-			if (!_store || !_store->verify(username, password)) {
-				Poco::Logger::get("VpnServer").warning(Poco::format("Authentication failed for user %s", username));
-				tunnel.sendAuthResult(false, "Authentication failed");
-				tunnel.sendClose();
-				return;
-			}
-			tunnel.sendAuthResult(true, "OK");
-			Poco::Logger::get("VpnServer").information(Poco::format("User %s authenticated", username));
-
-			// Main loop: handle DATA and HEARTBEAT with optimized polling
-			// Use shorter timeout for better responsiveness while maintaining efficiency
-			const auto pollTimeout = std::chrono::milliseconds(100);
+			Poco::Event woken;
+			Poco::Net::PollSet readiness;
+			readiness.add(secureSock, Poco::Net::PollSet::POLL_READ);
+			ServerSession session(tunnel, _store, _config, _sessions, _network);
+			session.setWakeup([&woken, &readiness]() {
+				woken.set();
+				readiness.wakeUp();
+			});
+			// One blocking receive per frame, handed to the session. Between
+			// frames the thread waits in poll(), which the session's wakeup ends
+			// as soon as packets are forwarded to it or it is asked to close; the
+			// HELLO and AUTH deadlines are checked whenever a wait times out.
+			// Replies to frames parsed from one read are flushed before waiting.
+			const auto receiveTimeout = std::chrono::milliseconds(1000);
+			FrameView frame;
 			for (;;) {
-				// Prefer encrypted data (primary path)
-				auto enc = tunnel.receiveEncrypted(pollTimeout);
-				if (!enc.empty()) {
-					try {
-						auto plain = sessionCrypto.decrypt(enc);
-						// Echo plaintext back as encrypted
-						auto resp = sessionCrypto.encrypt(plain);
-						tunnel.sendEncrypted(resp);
-					} catch (const std::exception& ex) {
-						Poco::Logger::get("VpnServer").warning(Poco::format("Decrypt error: %s", ex.what()));
-						break; // Exit on crypto errors to prevent resource waste
-					}
+				if (session.waiting()) {
+					// the password check runs on the KDF pool
+					woken.tryWait(1000);
+					if (!session.resume() || session.expire(std::chrono::steady_clock::now())) break;
 					continue;
 				}
-				// Fallback to legacy DATA if present (minimal timeout for non-blocking check)
-				auto data = tunnel.receiveData(std::chrono::milliseconds(1));
-				if (!data.empty()) {
-					tunnel.sendData(data);
-					continue;
+				if (!session.resume()) break;
+				// TLS may hold decrypted bytes the socket no longer shows as readable
+				if (!tunnel.frameBuffered() && secureSock.available() == 0) {
+					tunnel.flush();
+					if (readiness.poll(Poco::Timespan(1, 0)).empty()) {
+						if (session.expire(std::chrono::steady_clock::now())) break;
+						continue;
+					}
 				}
-				// Check heartbeat (non-blocking)
-				if (tunnel.receiveHeartbeat(std::chrono::milliseconds(1))) {
-					tunnel.sendHeartbeat();
+				if (!tunnel.receiveFrame(frame, receiveTimeout)) {
+					if (tunnel.closed() || session.expire(std::chrono::steady_clock::now())) break;
 					continue;
 				}
-				// Brief yield to prevent tight loop when idle
-				Poco::Thread::yield();
+				if (!session.handleFrame(frame)) break;
 			}
 		} catch (const std::exception& ex) {
 			Poco::Logger::get("VpnServer").warning(Poco::format("Connection error: %s", ex.what()));
 		}
+		// worker threads are reused, so the counters cover every session this thread served
+		const auto small = BufferPool::forThread().stats(BufferPool::SMALL);
+		const auto bulk = BufferPool::forThread().stats(BufferPool::BULK);
+		Poco::Logger::get("VpnServer").debug(Poco::format(
+			"Buffer pool small hits=%?u misses=%?u highWater=%?u, bulk hits=%?u misses=%?u highWater=%?u",
+			small.hits, small.misses, small.highWater, bulk.hits, bulk.misses, bulk.highWater));
 	}
 
 private:
 	CredentialStore::Ptr _store;
+	SessionRegistry::Ptr _sessions;
+	VirtualNetwork::Ptr _network;
+	ServerConfig _config;
 };
 
 class ConnectionFactory : public TCPServerConnectionFactory {
 public:
-	explicit ConnectionFactory(CredentialStore::Ptr store)
-		: _store(std::move(store)) {}
+	ConnectionFactory(CredentialStore::Ptr store, const ServerConfig& config, SessionRegistry::Ptr sessions,
+	                  VirtualNetwork::Ptr network)
+		: _store(std::move(store))
+		, _sessions(std::move(sessions))
+		, _network(std::move(network))
+		, _config(config) {}
 
 	TCPServerConnection* createConnection(const Poco::Net::StreamSocket& socket) override {
-		return new VpnServer::Connection(socket, _store);
+		return new VpnServer::Connection(socket, _store, _config, _sessions, _network);
 	}
 
 private:
 	CredentialStore::Ptr _store;
+	SessionRegistry::Ptr _sessions;
+	VirtualNetwork::Ptr _network;
+	ServerConfig _config;
 };
 
 VpnServer::VpnServer(const ServerConfig& config)
-	: _config(config) {
+	: _config(config)
+	, _sessions(std::make_shared<SessionRegistry>()) {
 }
 
 VpnServer::~VpnServer() {
 	stop();
 }
 
+// Binds one listener per shard to the same address with SO_REUSEPORT; the
+// kernel spreads new connections over them by address hash
+static std::vector<Poco::Net::ServerSocket> openListenerShards(const ServerConfig& config, Context* context, unsigned count) {
+	std::vector<Poco::Net::ServerSocket> listeners;
+	Poco::Net::SocketAddress address(config.address, config.port);
+	for (unsigned i = 0; i < count; ++i) {
+		SecureServerSocket listener(Context::Ptr(context, true));
+		listener.bind(address, true, true);
+		listener.listen(64);
+		// with port 0 the other shards join the port the first was given
+		if (i == 0) address = listener.address();
+		listeners.push_back(listener);
+	}
+	return listeners;
+}
+
 void VpnServer::start() {
 	if (_running) return;
+	if (_config.tlsOnlyData && !_config.requireClientAuth) {
+		throw std::invalid_argument("tlsOnlyData requires requireClientAuth");
+	}
+	// the bounds Tunnel::setHandshakeOptions enforces, checked before any client connects
+	if (_config.maxFrameSize < kMinMaxFrameLen || _config.maxFrameSize > Tunnel::kMaxFrameLen ||
+	    _config.maxMessageSize < _config.maxFrameSize - 1 || _config.maxMessageSize > Tunnel::kMaxFrameLen) {
+		throw std::invalid_argument("maxFrameSize/maxMessageSize out of range");
+	}
 
 	// Configure SSL/TLS context
 	_sslContext = std::make_shared<Context>(
@@ -161,6 +169,12 @@ void VpnServer::start() {
 	if (_config.requireClientAuth) {
 		_sslContext->requireClientVerification(true);
 	}
+	if (_config.mode != ServerMode::THREADED) {
+		// non-blocking writes are retried from a write queue that may have moved;
+		// idle connections drop OpenSSL's read and write buffers
+		SSL_CTX_set_mode(_sslContext->sslContext(),
+			SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	}
 
 	// Setup SSL manager with simple console handlers (placeholder)
 	Poco::SharedPtr<Poco::Net::InvalidCertificateHandler> certHandler = new Poco::Net::ConsoleCertificateHandler(true);
@@ -168,14 +182,43 @@ void VpnServer::start() {
 	SSLManager::instance().initializeServer(pkeyHandler, certHandler, _sslContext.get());
 
 	_credentialStore = CredentialStore::loadFromFile(_config.credentialFile);
+	VerifyOptions verifyOptions;
+	verifyOptions.kdfThreads = _config.kdfThreads;
+	verifyOptions.maxQueued = _config.maxQueuedLogins;
+	verifyOptions.cacheTtl = _config.loginCacheTtl;
+	_credentialStore->setVerifyOptions(verifyOptions);
+	_credentialStore->watch(_config.credentialReloadInterval);
+	if (!_config.virtualNetwork.empty() || !_config.virtualNetwork6.empty()) {
+		_network = std::make_shared<VirtualNetwork>(_config.virtualNetwork, _config.virtualNetwork6);
+	}
 
+	if (_config.mode == ServerMode::SHARDED) {
+		const unsigned shards = reactorThreadCount(_config);
+		auto listeners = openListenerShards(_config, _sslContext.get(), shards);
+		_port = listeners.front().address().port();
+		_reactor = std::make_unique<ServerReactor>(listeners, _credentialStore, _config, _sessions, _network);
+		_reactor->start();
+		_running = true;
+		Poco::Logger::get("VpnServer").information(Poco::format("VPN server started (%u SO_REUSEPORT shards, %u handshake threads)",
+			shards, handshakeThreadCount(_config)));
+		return;
+	}
 	SecureServerSocket svs(Poco::Net::SocketAddress(_config.address, _config.port), 64, _sslContext.get());
+	_port = svs.address().port();
+	if (_config.mode == ServerMode::REACTOR) {
+		_reactor = std::make_unique<ServerReactor>(svs, _credentialStore, _config, _sessions, _network);
+		_reactor->start();
+		_running = true;
+		Poco::Logger::get("VpnServer").information(Poco::format("VPN server started (reactor, %u threads, %u handshake threads)",
+			reactorThreadCount(_config), handshakeThreadCount(_config)));
+		return;
+	}
 	auto params = new TCPServerParams;
 	params->setMaxThreads(16);
 	params->setMaxQueued(64);
 	params->setThreadIdleTime(Poco::Timespan(10, 0));
 
-	_tcpServer = std::make_unique<TCPServer>(new ConnectionFactory(_credentialStore), svs, params);
+	_tcpServer = std::make_unique<TCPServer>(new ConnectionFactory(_credentialStore, _config, _sessions, _network), svs, params);
 	_tcpServer->start();
 	_running = true;
 	Poco::Logger::get("VpnServer").information("VPN server started");
@@ -183,13 +226,25 @@ void VpnServer::start() {
 
 void VpnServer::stop() {
 	if (!_running) return;
-	_tcpServer->stop();
-	_tcpServer.reset();
+	if (_reactor) {
+		_reactor->stop();
+		_reactor.reset();
+	} else {
+		_tcpServer->stop();
+		_tcpServer.reset();
+	}
+	_credentialStore->watch(std::chrono::milliseconds(0));
 	_credentialStore.reset();
+	_network.reset();
 	_running = false;
 	Poco::Logger::get("VpnServer").information("VPN server stopped");
 }
 
+void VpnServer::reloadCredentials() {
+	if (!_running) throw std::runtime_error("server is not running");
+	_credentialStore->reload();
+}
+
 } // namespace vpn
 
 
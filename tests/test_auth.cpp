@@ -1,8 +1,31 @@
 #include "vpn/auth.h"
+#include "vpn/credential_index.h"
 #include <Poco/File.h>
 #include <Poco/Path.h>
+#include <Poco/Base64Encoder.h>
+#include <Poco/Event.h>
 #include <fstream>
 #include <sstream>
+#include <thread>
+
+static std::string base64Encode(const std::vector<std::uint8_t>& data) {
+	std::ostringstream ostr;
+	Poco::Base64Encoder encoder(ostr);
+	encoder.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+	encoder.close();
+	return ostr.str();
+}
+
+static vpn::VerifyResult verifyAndWait(const vpn::CredentialStore& store, const std::string& user, const std::string& password) {
+	Poco::Event done;
+	vpn::VerifyResult result = vpn::VerifyResult::BUSY;
+	store.verifyAsync(user, password, [&](vpn::VerifyResult r) {
+		result = r;
+		done.set();
+	});
+	done.wait();
+	return result;
+}
 
 void test_auth() {
 	TEST_SUITE(Auth) {
@@ -33,9 +56,109 @@ void test_auth() {
 		ASSERT(store->verify("testuser", "testpass123"), "Should verify correct plaintext password");
 		ASSERT(!store->verify("testuser", "wrongpass"), "Should reject wrong password");
 		ASSERT(!store->verify("nonexistent", "anypass"), "Should reject nonexistent user");
-		
+
+		// Test reload: the new users replace the old ones in place
+		const auto version = store->version();
+		{
+			std::ofstream ofs(testFile);
+			ofs << R"({ "users": [ { "username": "rotated", "password": "newpass456" } ] })";
+		}
+		store->reload();
+		ASSERT(store->version() == version + 1, "Reload should install a new snapshot");
+		ASSERT(store->verify("rotated", "newpass456"), "Should verify users added by a reload");
+		ASSERT(!store->verify("testuser", "testpass123"), "Should reject users removed by a reload");
+
+		// Test failed reload: the current users stay
+		{
+			std::ofstream ofs(testFile);
+			ofs << "{ \"users\": [";
+		}
+		bool reloadFailed = false;
+		try {
+			store->reload();
+		} catch (const std::exception&) {
+			reloadFailed = true;
+		}
+		ASSERT(reloadFailed, "Reloading a malformed file should fail");
+		ASSERT(store->verify("rotated", "newpass456"), "A failed reload should keep the current users");
+
+		// Test KDF records: checked once, then served from the login cache
+		const std::vector<std::uint8_t> salt = {1, 2, 3, 4, 5, 6, 7, 8};
+		{
+			std::ofstream ofs(testFile);
+			ofs << R"({ "users": [ { "username": "kdfuser", "kdf": "pbkdf2-sha256", "cost": 1000, "salt": ")"
+			    << base64Encode(salt) << R"(", "hash": ")"
+			    << base64Encode(vpn::derivePasswordHash(vpn::kKdfPbkdf2Sha256, 1000, salt, "s3cret")) << R"(" } ] })";
+		}
+		store->reload();
+		ASSERT(verifyAndWait(*store, "kdfuser", "s3cret") == vpn::VerifyResult::ACCEPTED, "Should verify a PBKDF2 hash on the pool");
+		ASSERT(verifyAndWait(*store, "kdfuser", "wrong") == vpn::VerifyResult::REJECTED, "Should reject a wrong password on the pool");
+		ASSERT(store->verifyStats().kdfRuns == 2 && store->verifyStats().cacheHits == 0, "Each new check should run the KDF");
+		ASSERT(store->verify("kdfuser", "s3cret"), "Should verify a cached login");
+		ASSERT(store->verifyStats().kdfRuns == 2 && store->verifyStats().cacheHits == 1, "A repeated login should skip the KDF");
+		ASSERT(verifyAndWait(*store, "kdfuser", "wrong") == vpn::VerifyResult::REJECTED, "Failed logins should not be cached");
+		store->reload();
+		ASSERT(store->verify("kdfuser", "s3cret") && store->verifyStats().kdfRuns == 4, "A reload should invalidate cached logins");
+
+		// Test a compiled index: same users, mapped instead of parsed
+		std::string indexFile = "test_users.idx";
+		{
+			std::ofstream ofs(testFile);
+			ofs << R"({ "users": [ { "username": "alice", "password": "pw-a" }, { "username": "bob", "kdf": "pbkdf2-sha256", "cost": 1000, "salt": ")"
+			    << base64Encode(salt) << R"(", "hash": ")"
+			    << base64Encode(vpn::derivePasswordHash(vpn::kKdfPbkdf2Sha256, 1000, salt, "pw-b")) << R"(" } ] })";
+		}
+		vpn::compileCredentialIndex(testFile, indexFile);
+		ASSERT(vpn::CredentialIndex::isIndexFile(indexFile) && !vpn::CredentialIndex::isIndexFile(testFile), "Should tell an index from JSON");
+		auto indexed = vpn::CredentialStore::loadFromFile(indexFile);
+		ASSERT(indexed->verify("alice", "pw-a") && !indexed->verify("alice", "pw-b"), "Should verify a plaintext user from the index");
+		ASSERT(verifyAndWait(*indexed, "bob", "pw-b") == vpn::VerifyResult::ACCEPTED, "Should verify a KDF user from the index");
+		ASSERT(!indexed->verify("carol", "pw-a"), "Should reject a user missing from the index");
+		vpn::writeCredentialIndex({}, indexFile);
+		indexed->reload();
+		ASSERT(!indexed->verify("alice", "pw-a"), "Reload should map the replaced index");
+
+		// Test a record that cannot be checked: the waiting login is answered, not dropped
+		vpn::UserRecord broken;
+		broken.username = "broken";
+		broken.kdf = vpn::kKdfScrypt;
+		broken.cost = 3; // not a power of two
+		broken.salt = salt;
+		broken.hash = salt;
+		vpn::writeCredentialIndex({broken}, indexFile);
+		indexed->reload();
+		ASSERT(verifyAndWait(*indexed, "broken", "pw") == vpn::VerifyResult::REJECTED, "A broken record should reject the login");
+		bool corrupt = false;
+		try {
+			indexed->verify("broken", "pw");
+		} catch (const std::runtime_error& ex) {
+			corrupt = std::string(ex.what()) == "Corrupt credential index";
+		}
+		ASSERT(corrupt, "An index cost the loader would refuse should read as corruption");
+
+		// Test PBKDF2 against the RFC 7914 vector, so existing hashes keep verifying
+		const std::string rfcSalt = "salt";
+		const auto rfcHash = vpn::derivePasswordHash(vpn::kKdfPbkdf2Sha256, 1,
+			std::vector<std::uint8_t>(rfcSalt.begin(), rfcSalt.end()), "passwd");
+		ASSERT(rfcHash.size() == 32 && rfcHash[0] == 0x55 && rfcHash[1] == 0xac && rfcHash[31] == 0xbc, "PBKDF2-HMAC-SHA256 should match the standard");
+
+		// Test the watcher: a rewritten file is installed without a reload() call
+		store->watch(std::chrono::milliseconds(20));
+		const auto watchedVersion = store->version();
+		{
+			std::ofstream ofs(testFile);
+			ofs << R"({ "users": [ { "username": "watched", "password": "seen-by-the-watcher" } ] })";
+		}
+		for (int i = 0; i < 250 && store->version() == watchedVersion; ++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+		store->watch(std::chrono::milliseconds(0));
+		ASSERT(store->version() != watchedVersion, "The watcher should reload a changed file");
+		ASSERT(store->verify("watched", "seen-by-the-watcher"), "Should verify users the watcher installed");
+
 		// Cleanup
 		Poco::File(testFile).remove();
+		Poco::File(indexFile).remove();
 	}
 }
 
@@ -1,7 +1,10 @@
 #include "vpn/crypto.h"
+#include "vpn/random.h"
+#include "vpn/compression.h"
 #include <Poco/Random.h>
 #include <vector>
 #include <cstring>
+#include <string>
 
 void test_crypto() {
 	TEST_SUITE(Crypto) {
@@ -40,5 +43,129 @@ void test_crypto() {
 		}
 		ASSERT(caught, "Corrupted ciphertext should fail MAC verification");
 	}
-}
 
+	TEST_SUITE(CryptoAead) {
+		std::vector<std::uint8_t> keySeed(32, 0x42);
+		std::vector<std::uint8_t> clientNonce(16, 0x11);
+		std::vector<std::uint8_t> serverNonce(16, 0x22);
+		auto keys = vpn::deriveSessionKeys(keySeed, clientNonce, serverNonce);
+		std::vector<std::uint8_t> plaintext = {'H', 'e', 'l', 'l', 'o', ',', ' ', 'W', 'o', 'r', 'l', 'd', '!'};
+
+		for (auto suite : {vpn::CipherSuite::AES_256_GCM, vpn::CipherSuite::CHACHA20_POLY1305}) {
+			vpn::SessionCrypto crypto(keys.encKey, keys.macKey, suite);
+			auto ciphertext = crypto.encrypt(plaintext);
+			// no padding: nonce + tag overhead only
+			ASSERT(ciphertext.size() == 1 + 12 + plaintext.size() + 16, "AEAD frame should carry nonce and tag only");
+			ASSERT(crypto.decrypt(ciphertext) == plaintext, "AEAD round trip should restore plaintext");
+
+			auto empty = crypto.decrypt(crypto.encrypt({}));
+			ASSERT(empty.empty(), "AEAD should handle empty payloads");
+
+			ciphertext[1 + 12] ^= 0x01;
+			bool caught = false;
+			try {
+				crypto.decrypt(ciphertext);
+			} catch (const std::exception&) {
+				caught = true;
+			}
+			ASSERT(caught, "Tampered AEAD ciphertext should fail tag verification");
+		}
+
+		// Contexts are keyed once and reused: many packets of varying size through one instance
+		for (auto suite : {vpn::CipherSuite::AES_256_CBC_HMAC_SHA256, vpn::CipherSuite::AES_256_GCM, vpn::CipherSuite::CHACHA20_POLY1305}) {
+			vpn::SessionCrypto sender(keys.encKey, keys.macKey, suite);
+			vpn::SessionCrypto receiver(keys.encKey, keys.macKey, suite);
+			for (std::size_t len : {0, 1, 15, 16, 17, 1500, 1, 64}) {
+				std::vector<std::uint8_t> packet(len, static_cast<std::uint8_t>(len));
+				ASSERT(receiver.decrypt(sender.encrypt(packet)) == packet, "Reused session contexts should round trip");
+			}
+		}
+
+		// In-place API: header into headroom, tag/MAC into tailroom, plaintext view into the frame
+		for (auto suite : {vpn::CipherSuite::AES_256_CBC_HMAC_SHA256, vpn::CipherSuite::AES_256_GCM}) {
+			vpn::SessionCrypto crypto(keys.encKey, keys.macKey, suite);
+			vpn::PacketBuffer buf(5 + crypto.headroom(), plaintext.size(), crypto.tailroom());
+			buf.assign(plaintext.data(), plaintext.size());
+			const std::uint8_t* payloadStart = buf.data();
+			crypto.encryptInPlace(buf);
+			ASSERT(buf.data() == payloadStart - crypto.headroom(), "Cipher header should be written into the headroom");
+			ASSERT(buf.headroom() == 5, "Frame header headroom should remain");
+			std::vector<std::uint8_t> frame(buf.data(), buf.data() + buf.size());
+			ASSERT(crypto.decrypt(frame) == plaintext, "In-place frame should decrypt with the vector API");
+			auto plain = crypto.decryptInPlace(buf.view());
+			ASSERT(plain.data == payloadStart, "Plaintext view should point into the frame");
+			ASSERT(std::vector<std::uint8_t>(plain.data, plain.data + plain.size) == plaintext, "In-place round trip should restore plaintext");
+		}
+
+		// Batch API: burst of mixed sizes through one call each way
+		{
+			vpn::SessionCrypto sender(keys.encKey, keys.macKey, vpn::CipherSuite::AES_256_GCM);
+			vpn::SessionCrypto receiver(keys.encKey, keys.macKey, vpn::CipherSuite::AES_256_GCM);
+			const std::vector<std::size_t> sizes = {0, 64, 1500, 7};
+			std::vector<vpn::PacketBuffer> burst;
+			for (auto len : sizes) {
+				vpn::PacketBuffer buf(5 + sender.headroom(), len, sender.tailroom());
+				std::vector<std::uint8_t> packet(len, static_cast<std::uint8_t>(len));
+				buf.assign(packet.data(), packet.size());
+				burst.push_back(buf);
+			}
+			sender.encryptBatch(burst);
+			std::vector<vpn::ByteView> frames;
+			for (auto& buf : burst) frames.push_back(buf.view());
+			ASSERT(frames[0].data[1] != frames[1].data[1] || frames[0].data[2] != frames[1].data[2], "Batch nonces should differ");
+			receiver.decryptBatch(frames);
+			for (std::size_t i = 0; i < sizes.size(); ++i) {
+				ASSERT(frames[i].size == sizes[i], "Batch plaintext size should match");
+				ASSERT(sizes[i] == 0 || frames[i].data[0] == static_cast<std::uint8_t>(sizes[i]), "Batch plaintext should match");
+			}
+		}
+
+		auto suites = vpn::defaultCipherSuites();
+		ASSERT(!suites.empty() && suites.back() == vpn::CipherSuite::AES_256_CBC_HMAC_SHA256,
+			"CBC+HMAC should remain the last-resort fallback");
+	}
+
+	TEST_SUITE(SecureRandom) {
+		auto a = vpn::secureRandomBytes(16);
+		auto b = vpn::secureRandomBytes(16);
+		ASSERT(a.size() == 16 && a != b, "Consecutive random draws should differ");
+
+		// larger than the internal buffer, crossing refills
+		auto big = vpn::secureRandomBytes(10000);
+		std::size_t zeros = 0;
+		for (auto byte : big) zeros += byte == 0;
+		ASSERT(zeros < 200, "Random output should not be mostly zero");
+
+		auto id = vpn::randomSessionId();
+		ASSERT(id.size() == 36 && id[8] == '-' && id[14] == '4', "Session id should be a version 4 UUID");
+		ASSERT(id != vpn::randomSessionId(), "Session ids should be unique");
+	}
+
+	TEST_SUITE(Compression) {
+		vpn::PayloadCompressor sender, receiver;
+		std::string logs;
+		for (int i = 0; i < 20; ++i) logs += "{\"level\":\"info\",\"msg\":\"request served\",\"status\":200}\n";
+		vpn::PacketBuffer buf(21, logs.size());
+		buf.assign(reinterpret_cast<const std::uint8_t*>(logs.data()), logs.size());
+		ASSERT(sender.compress(buf), "Repetitive text should compress");
+		ASSERT(buf.size() < logs.size() / 4 && buf.headroom() == 21, "Compressed in place, headroom kept");
+		auto plain = receiver.decompress(buf.view());
+		ASSERT(std::string(reinterpret_cast<const char*>(plain.data), plain.size) == logs, "Round trip should restore the payload");
+
+		// incompressible data is detected and then skipped for a while
+		auto noise = vpn::secureRandomBytes(1400);
+		vpn::PacketBuffer rnd(0, noise.size());
+		rnd.assign(noise.data(), noise.size());
+		ASSERT(!sender.compress(rnd) && rnd.size() == noise.size(), "Random data should be sent as is");
+		ASSERT(!sender.compress(rnd) && sender.stats().skipped == 1, "The next payload should be skipped");
+
+		std::uint8_t junk[] = {0xFF, 0xFF, 0xFF, 0xFF};
+		bool threw = false;
+		try {
+			receiver.decompress(vpn::ByteView{junk, sizeof(junk)});
+		} catch (const std::runtime_error&) {
+			threw = true;
+		}
+		ASSERT(threw, "Corrupt compressed data should be rejected");
+	}
+}
@@ -1,8 +1,60 @@
 #include "vpn/vpn_client.h"
 #include "vpn/vpn_server.h"
+#include "vpn/server_reactor.h"
+#include "vpn/routing.h"
+#include "vpn/packet_io.h"
 #include <Poco/Thread.h>
 #include <Poco/Event.h>
+#include <Poco/Mutex.h>
+#include <Poco/File.h>
+#include <Poco/Net/StreamSocket.h>
+#include <Poco/Net/SocketAddress.h>
+#include <algorithm>
+#include <fstream>
+#include <future>
 #include <memory>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+static const char* const kTestCredentials = "test_integration_users.json";
+
+static void writeTestCredentials() {
+	std::ofstream ofs(kTestCredentials);
+	ofs << R"({ "users": [ { "username": "tester", "password": "integration" } ] })";
+}
+
+// A loopback server with the repository's certificates and the test user
+static vpn::ServerConfig testServerConfig(vpn::ServerMode mode) {
+	vpn::ServerConfig config;
+	config.address = "127.0.0.1";
+	config.port = 0;
+	config.credentialFile = kTestCredentials;
+	config.credentialReloadInterval = std::chrono::milliseconds(0);
+	config.mode = mode;
+	config.reactorThreads = 2;
+	config.handshakeThreads = 1;
+	return config;
+}
+
+static vpn::ClientConfig testClientConfig(unsigned short port) {
+	vpn::ClientConfig config;
+	config.serverPort = port;
+	config.username = "tester";
+	config.password = "integration";
+	return config;
+}
+
+// A device whose reads fail, as a TUN interface does once it is torn down
+class FailingPacketIO : public vpn::PacketIO {
+public:
+	std::size_t read(std::vector<vpn::PacketBuffer>&, std::chrono::milliseconds) override {
+		throw std::runtime_error("device gone");
+	}
+	void write(vpn::ByteView) override {}
+	void wakeUp() override {}
+	std::size_t mtu() const override { return 1400; }
+};
 
 void test_integration() {
 	TEST_SUITE(Integration) {
@@ -18,7 +70,12 @@ void test_integration() {
 		
 		vpn::VpnServer server(serverCfg);
 		ASSERT(true, "Server should construct without errors");
-		
+		ASSERT(vpn::reactorThreadCount(serverCfg) >= 1, "Reactor and shard counts should default to one per core");
+		serverCfg.reactorThreads = 3;
+		ASSERT(vpn::reactorThreadCount(serverCfg) == 3, "An explicit reactor thread count should be kept");
+		ASSERT(vpn::handshakeThreadCount(serverCfg) >= 1, "Handshakes should get at least one thread");
+		ASSERT(server.sessions().size() == 0, "A new server should have no sessions");
+
 		vpn::ClientConfig clientCfg;
 		clientCfg.serverHost = "127.0.0.1";
 		clientCfg.serverPort = 44350;
@@ -30,6 +87,277 @@ void test_integration() {
 		
 		vpn::VpnClient client(clientCfg);
 		ASSERT(true, "Client should construct without errors");
+		ASSERT(!client.asyncRunning(), "Client should start in lockstep mode");
+		bool rejected = false;
+		try {
+			client.sendAsync({1, 2, 3});
+		} catch (const std::runtime_error&) {
+			rejected = true;
+		}
+		ASSERT(rejected, "sendAsync should require a running async connection");
+	}
+
+	TEST_SUITE(MemoryPacketIO) {
+		// Batched reads into buffers with headroom, early wakeups
+		vpn::MemoryPacketIO packetIO(64);
+		for (std::uint8_t i = 1; i <= 3; ++i) packetIO.inject(std::vector<std::uint8_t>(i, i));
+		std::vector<vpn::PacketBuffer> readBatch;
+		for (int i = 0; i < 2; ++i) readBatch.emplace_back(8, packetIO.mtu());
+		ASSERT(packetIO.read(readBatch, std::chrono::milliseconds(0)) == 2, "A read should take one batch of the ready packets");
+		ASSERT(readBatch[1].size() == 2 && readBatch[1].data()[0] == 2 && readBatch[1].headroom() == 8, "Packets should land after the headroom");
+		ASSERT(packetIO.read(readBatch, std::chrono::milliseconds(0)) == 1 && readBatch[0].size() == 3, "The next read should take the rest");
+		Poco::Thread waker;
+		waker.startFunc([&packetIO]() { packetIO.wakeUp(); });
+		ASSERT(packetIO.read(readBatch, std::chrono::milliseconds(10000)) == 0, "wakeUp should end a waiting read");
+		waker.join();
+		packetIO.write(readBatch[0].view());
+		const auto written = packetIO.takeWritten(1, std::chrono::milliseconds(0));
+		ASSERT(written.size() == 1 && written.front() == std::vector<std::uint8_t>(3, 3), "Written packets should be kept");
+	}
+
+	TEST_SUITE(ClientPacketIO) {
+		// packets injected into the device go out through the client and
+		// come back echoed by the server, written to the same device
+		writeTestCredentials();
+		vpn::VpnServer server(testServerConfig(vpn::ServerMode::REACTOR));
+		server.start();
+		vpn::VpnClient client(testClientConfig(server.port()));
+		client.connect();
+		vpn::MemoryPacketIO device(1400);
+		client.startPacketIO(device);
+		const std::size_t count = 16;
+		for (std::size_t i = 0; i < count; ++i) {
+			device.inject(std::vector<std::uint8_t>(60 + i, static_cast<std::uint8_t>(i)));
+		}
+		const auto echoed = device.takeWritten(count, std::chrono::milliseconds(5000));
+		ASSERT(echoed.size() == count, "Every injected packet should come back");
+		ASSERT(echoed.back() == std::vector<std::uint8_t>(60 + count - 1, static_cast<std::uint8_t>(count - 1)), "Packets should come back intact and in order");
+		client.disconnect();
+		ASSERT(!client.asyncRunning(), "disconnect should stop the packet threads");
+		server.stop();
+		Poco::File(kTestCredentials).remove();
+	}
+
+	TEST_SUITE(ClientPacketIOError) {
+		// a failed device read ends the connection, so sends fail instead of
+		// completing on a tunnel that no longer carries the device's traffic
+		writeTestCredentials();
+		vpn::VpnServer server(testServerConfig(vpn::ServerMode::REACTOR));
+		server.start();
+		vpn::VpnClient client(testClientConfig(server.port()));
+		client.connect();
+		FailingPacketIO device;
+		client.startPacketIO(device);
+		std::string error;
+		for (int i = 0; i < 250 && error.empty(); ++i) {
+			try {
+				client.sendAsync(std::vector<unsigned char>(32, 1)).get();
+				Poco::Thread::sleep(20);
+			} catch (const std::runtime_error& ex) {
+				error = ex.what();
+			}
+		}
+		ASSERT(error.find("device gone") != std::string::npos, "A failed device read should fail pending sends");
+		client.disconnect();
+		ASSERT(!client.asyncRunning(), "disconnect should stop the packet threads");
+		server.stop();
+		Poco::File(kTestCredentials).remove();
+	}
+
+	TEST_SUITE(VirtualNetwork) {
+		// Routing: longest prefix wins, and removing a route uncovers the next shorter one
+		auto first = std::make_shared<vpn::SessionEntry>("id-1", "alice", nullptr);
+		auto second = std::make_shared<vpn::SessionEntry>("id-2", "alice", nullptr);
+		vpn::RoutingTable routes;
+		const Poco::Net::IPAddress host("10.8.1.7");
+		const auto* hostBytes = static_cast<const std::uint8_t*>(host.addr());
+		routes.add(Poco::Net::IPAddress("10.0.0.0"), 8, first);
+		routes.add(Poco::Net::IPAddress("10.8.0.0"), 14, second);
+		ASSERT(routes.lookup(hostBytes, false) == second, "The longest matching prefix should win");
+		routes.add(host, 32, first);
+		ASSERT(routes.lookup(hostBytes, false) == first, "A host route should beat its network");
+		routes.remove(host, 32);
+		routes.remove(Poco::Net::IPAddress("10.8.0.0"), 14);
+		ASSERT(routes.lookup(hostBytes, false) == first, "Removing routes should fall back to shorter prefixes");
+		auto removed = std::make_shared<vpn::SessionEntry>("id-x", "erin", nullptr);
+		const std::weak_ptr<vpn::SessionEntry> removedRef = removed;
+		routes.add(host, 32, removed);
+		ASSERT(routes.lookup(hostBytes, false) == removed, "A new route should be looked up");
+		routes.remove(host, 32);
+		removed.reset();
+		ASSERT(removedRef.expired(), "A thread's cached snapshot should not keep removed sessions alive");
+
+		// Virtual network: addresses from the pool, packets forwarded by destination
+		vpn::VirtualNetwork network("10.9.0.0/24", "");
+		auto sender = std::make_shared<vpn::SessionEntry>("id-s", "carol", nullptr);
+		auto receiver = std::make_shared<vpn::SessionEntry>("id-r", "dave", nullptr);
+		network.attach(sender);
+		network.attach(receiver);
+		ASSERT(sender->virtualAddresses().front().address.toString() == "10.9.0.2", "Sessions should get addresses after the server's");
+		std::vector<std::uint8_t> packet(28, 0);
+		packet[0] = 0x45;
+		std::memcpy(&packet[12], sender->virtualAddresses().front().address.addr(), 4);
+		std::memcpy(&packet[16], receiver->virtualAddresses().front().address.addr(), 4);
+		ASSERT(network.forward(*sender, vpn::ByteView{packet.data(), packet.size()}), "Should forward to the destination's session");
+		ASSERT(!network.forward(*receiver, vpn::ByteView{packet.data(), packet.size()}), "Should drop packets with a foreign source");
+		std::vector<vpn::PacketBuffer> delivered;
+		receiver->takeDelivered(delivered);
+		ASSERT(delivered.size() == 1 && delivered.front().size() == packet.size(), "The receiver should get the packet once");
+		ASSERT(std::equal(packet.begin(), packet.end(), delivered.front().data()), "The delivered packet should be unchanged");
+		ASSERT(delivered.front().headroom() >= vpn::Tunnel::kFrameHeaderLen, "Delivered packets should have room for the frame header");
+		network.detach(*receiver);
+		ASSERT(!network.forward(*sender, vpn::ByteView{packet.data(), packet.size()}) && network.stats().unroutable == 1, "Detached sessions should not be routed to");
+	}
+
+	TEST_SUITE(VirtualNetworkForwarding) {
+		// two clients of one server reach each other by their virtual addresses,
+		// in the thread-per-connection mode and through the reactor
+		writeTestCredentials();
+		for (const auto mode : {vpn::ServerMode::THREADED, vpn::ServerMode::REACTOR}) {
+			vpn::ServerConfig config = testServerConfig(mode);
+			config.virtualNetwork = "10.8.0.0/24";
+			vpn::VpnServer server(config);
+			server.start();
+			vpn::VpnClient alice(testClientConfig(server.port()));
+			vpn::VpnClient bob(testClientConfig(server.port()));
+			alice.connect();
+			bob.connect();
+			ASSERT(alice.virtualAddresses().size() == 1 && bob.virtualAddresses().size() == 1, "Each client should get an address");
+			const std::string& from = alice.virtualAddresses().front();
+			const std::string& to = bob.virtualAddresses().front();
+			const Poco::Net::IPAddress source(from.substr(0, from.find('/')));
+			const Poco::Net::IPAddress destination(to.substr(0, to.find('/')));
+			std::vector<unsigned char> packet(40, 0xAB);
+			packet[0] = 0x45;
+			std::memcpy(&packet[12], source.addr(), 4);
+			std::memcpy(&packet[16], destination.addr(), 4);
+			alice.send(packet);
+			ASSERT(bob.receive() == packet, "A packet should reach the session owning its destination");
+			const auto stats = server.virtualNetwork()->stats();
+			ASSERT(stats.spoofed == 0 && stats.unroutable == 0, "Nothing should be dropped");
+			alice.disconnect();
+			bob.disconnect();
+			server.stop();
+		}
+		Poco::File(kTestCredentials).remove();
+	}
+
+	TEST_SUITE(SessionRegistry) {
+		// By ID and by user, with close requests reaching the driver
+		vpn::SessionRegistry registry(4);
+		auto first = std::make_shared<vpn::SessionEntry>("id-1", "alice", nullptr);
+		auto second = std::make_shared<vpn::SessionEntry>("id-2", "alice", nullptr);
+		ASSERT(registry.add(first) && registry.add(second), "Should register sessions");
+		ASSERT(!registry.add(std::make_shared<vpn::SessionEntry>("id-1", "bob", nullptr)), "Should refuse a taken session ID");
+		ASSERT(registry.find("id-2") == second && !registry.find("id-3"), "Should find sessions by ID");
+		ASSERT(registry.sessionsOfUser("alice") == 2 && registry.sessionsOfUser("bob") == 0, "Should count sessions by user");
+		bool woken = false;
+		first->setWakeup([&woken]() { woken = true; });
+		for (const auto& entry : registry.findByUser("alice")) entry->requestClose();
+		ASSERT(woken && second->closeRequested(), "Close requests should wake the driver");
+		registry.remove(*first);
+		ASSERT(registry.size() == 1 && registry.findByUser("alice").size() == 1, "Removed sessions should leave both indexes");
+	}
+
+	TEST_SUITE(ReactorServer) {
+		writeTestCredentials();
+		vpn::VpnServer server(testServerConfig(vpn::ServerMode::REACTOR));
+		server.start();
+		ASSERT(server.port() != 0, "The server should report the port it was given");
+		vpn::VpnClient client(testClientConfig(server.port()));
+		client.connect();
+		const std::vector<unsigned char> packet = {0x45, 1, 2, 3, 4};
+		client.send(packet);
+		ASSERT(client.receive() == packet, "A reactor session should echo packets");
+		ASSERT(server.sessions().size() == 1, "The session should be registered");
+		client.disconnect();
+		server.stop();
+		Poco::File(kTestCredentials).remove();
+	}
+
+	TEST_SUITE(ShardedServer) {
+		writeTestCredentials();
+		vpn::VpnServer server(testServerConfig(vpn::ServerMode::SHARDED));
+		server.start();
+		// the kernel picks a shard per connection; each must serve its own
+		std::vector<std::unique_ptr<vpn::VpnClient>> clients;
+		for (int i = 0; i < 4; ++i) {
+			clients.push_back(std::make_unique<vpn::VpnClient>(testClientConfig(server.port())));
+			clients.back()->connect();
+		}
+		for (std::size_t i = 0; i < clients.size(); ++i) {
+			const std::vector<unsigned char> packet(64, static_cast<unsigned char>(i));
+			clients[i]->send(packet);
+			ASSERT(clients[i]->receive() == packet, "Every sharded session should echo its packets");
+		}
+		ASSERT(server.sessions().size() == clients.size(), "The shards should share one session registry");
+		for (auto& client : clients) client->disconnect();
+		server.stop();
+		Poco::File(kTestCredentials).remove();
+	}
+
+	TEST_SUITE(HandshakeAdmission) {
+		writeTestCredentials();
+		vpn::ServerConfig config = testServerConfig(vpn::ServerMode::REACTOR);
+		config.maxPendingHandshakes = 1;
+		vpn::VpnServer server(config);
+		server.start();
+		// a connection that never starts TLS holds the only handshake slot
+		Poco::Net::StreamSocket idle(Poco::Net::SocketAddress("127.0.0.1", server.port()));
+		vpn::VpnClient client(testClientConfig(server.port()));
+		Poco::Event connected;
+		std::string error;
+		Poco::Thread connector;
+		connector.startFunc([&client, &connected, &error]() {
+			try {
+				client.connect();
+			} catch (const std::exception& ex) {
+				error = ex.what();
+			}
+			connected.set();
+		});
+		ASSERT(!connected.tryWait(300), "A connection beyond maxPendingHandshakes should wait in the backlog");
+		idle.close();
+		ASSERT(connected.tryWait(10000) && error.empty(), "The waiting connection should be admitted once the slot frees");
+		connector.join();
+		const std::vector<unsigned char> packet = {0x45, 7, 7, 7};
+		client.send(packet);
+		ASSERT(client.receive() == packet, "The admitted session should echo packets");
+		client.disconnect();
+		server.stop();
+		Poco::File(kTestCredentials).remove();
+	}
+
+	TEST_SUITE(AsyncClient) {
+		writeTestCredentials();
+		vpn::VpnServer server(testServerConfig(vpn::ServerMode::THREADED));
+		server.start();
+		vpn::VpnClient client(testClientConfig(server.port()));
+		client.connect();
+		const std::size_t count = 8;
+		Poco::FastMutex mutex;
+		std::vector<std::vector<unsigned char>> echoed;
+		Poco::Event allEchoed;
+		client.startAsync([&](vpn::ByteView packet) {
+			Poco::FastMutex::ScopedLock lock(mutex);
+			echoed.emplace_back(packet.data, packet.data + packet.size);
+			if (echoed.size() == count) allEchoed.set();
+		});
+		ASSERT(client.asyncRunning(), "startAsync should start the I/O thread");
+		std::vector<std::future<void>> sent;
+		for (std::size_t i = 0; i < count; ++i) {
+			sent.push_back(client.sendAsync(std::vector<unsigned char>(100 + i, static_cast<unsigned char>(i))));
+		}
+		for (auto& done : sent) done.get();
+		ASSERT(allEchoed.tryWait(5000), "Every echoed packet should reach the handler");
+		{
+			Poco::FastMutex::ScopedLock lock(mutex);
+			ASSERT(echoed[3] == std::vector<unsigned char>(103, 3), "Echoes should arrive in the order sent");
+		}
+		client.disconnect();
+		ASSERT(!client.asyncRunning(), "disconnect should join the I/O thread");
+		server.stop();
+		Poco::File(kTestCredentials).remove();
 	}
 }
 
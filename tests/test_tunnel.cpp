@@ -1,10 +1,13 @@
 #include "vpn/tunnel.h"
+#include "vpn/stream_mux.h"
 #include <Poco/Net/StreamSocket.h>
 #include <Poco/Net/ServerSocket.h>
 #include <Poco/Net/SocketAddress.h>
 #include <Poco/Thread.h>
+#include <algorithm>
 #include <vector>
 #include <memory>
+#include <stdexcept>
 
 // Mock socket pair for testing
 class MockSocketPair {
@@ -20,6 +23,19 @@ public:
 	}
 };
 
+// Runs HELLO between two tunnels with the options each side has set
+static void handshake(vpn::Tunnel& clientTunnel, vpn::Tunnel& serverTunnel) {
+	std::string serverId, clientId;
+	std::vector<std::uint8_t> clientNonce, serverNonce, keySeed;
+	std::vector<std::uint8_t> clientNonceOut, serverNonceOut, keySeedOut;
+	Poco::Thread clientThread;
+	clientThread.startFunc([&]() {
+		clientTunnel.clientHandshake("client-123", clientNonce, serverId, serverNonce, keySeed);
+	});
+	serverTunnel.serverHandshake("server-456", clientId, clientNonceOut, serverNonceOut, keySeedOut);
+	clientThread.join();
+}
+
 void test_tunnel() {
 	TEST_SUITE(Tunnel) {
 		// Test frame send/receive
@@ -39,6 +55,32 @@ void test_tunnel() {
 		bool gotHeartbeat = serverTunnel.receiveHeartbeat(std::chrono::milliseconds(1000));
 		ASSERT(gotHeartbeat, "Should receive heartbeat");
 		
+		// Test batched ENCRYPTED_DATA frames: one write, read back frame by frame
+		std::vector<vpn::PacketBuffer> batch;
+		for (std::uint8_t i = 1; i <= 3; ++i) {
+			vpn::PacketBuffer buf(vpn::Tunnel::kFrameHeaderLen, 4);
+			std::vector<std::uint8_t> bytes(i, i);
+			buf.assign(bytes.data(), bytes.size());
+			batch.push_back(buf);
+		}
+		clientTunnel.sendEncryptedBatch(batch);
+		for (std::uint8_t i = 1; i <= 3; ++i) {
+			auto frame = serverTunnel.receiveEncrypted(std::chrono::milliseconds(1000));
+			ASSERT(frame == std::vector<std::uint8_t>(i, i), "Batched frames should arrive in order");
+		}
+		// a record-sized payload in a batch is written from its buffer, between the queued small ones
+		std::vector<vpn::PacketBuffer> mixed(3);
+		for (std::size_t i = 0; i < mixed.size(); ++i) {
+			std::vector<std::uint8_t> bytes(i == 1 ? 40000 : 100, static_cast<std::uint8_t>(i + 7));
+			mixed[i] = vpn::PacketBuffer(vpn::Tunnel::kFrameHeaderLen, bytes.size());
+			mixed[i].assign(bytes.data(), bytes.size());
+		}
+		clientTunnel.sendEncryptedBatch(mixed);
+		for (std::size_t i = 0; i < mixed.size(); ++i) {
+			auto frame = serverTunnel.receiveEncrypted(std::chrono::milliseconds(1000));
+			ASSERT(frame == std::vector<std::uint8_t>(mixed[i].data(), mixed[i].data() + mixed[i].size()), "Large batched payloads should keep their place");
+		}
+
 		// Test handshake
 		std::string clientId = "client-123";
 		std::string serverId;
@@ -59,6 +101,296 @@ void test_tunnel() {
 		ASSERT(clientIdOut == clientId, "Client ID should match");
 		ASSERT(serverId == serverIdOut, "Server ID should match");
 		ASSERT(!keySeed.empty(), "Key seed should be generated");
+		ASSERT(clientTunnel.handshakeResult().cipherSuite == serverTunnel.handshakeResult().cipherSuite,
+			"Both sides should agree on the cipher suite");
+		ASSERT(clientTunnel.handshakeResult().cipherSuite == vpn::defaultCipherSuites().front(),
+			"Server should pick its preferred suite when offered");
+
+		// Server restricted to the legacy suite
+		vpn::HandshakeOptions legacyOnly;
+		legacyOnly.cipherSuites = {vpn::CipherSuite::AES_256_CBC_HMAC_SHA256};
+		serverTunnel.setHandshakeOptions(legacyOnly);
+		Poco::Thread legacyThread;
+		legacyThread.startFunc([&]() {
+			clientTunnel.clientHandshake(clientId, clientNonce, serverId, serverNonce, keySeed);
+		});
+		serverTunnel.serverHandshake(serverIdOut, clientIdOut, clientNonceOut, serverNonceOut, keySeedOut);
+		legacyThread.join();
+		ASSERT(clientTunnel.handshakeResult().cipherSuite == vpn::CipherSuite::AES_256_CBC_HMAC_SHA256,
+			"Client should fall back to CBC+HMAC");
+
+		// Non-blocking mode: frames queue, flush() writes what the socket takes, receives never wait
+		pair.clientSock.setBlocking(false);
+		pair.serverSock.setBlocking(false);
+		vpn::Tunnel nbClient(pair.clientSock);
+		vpn::Tunnel nbServer(pair.serverSock);
+		nbClient.setNonBlocking(true);
+		nbServer.setNonBlocking(true);
+		vpn::FrameView view;
+		ASSERT(!nbServer.receiveFrame(view, std::chrono::milliseconds(0)) && !nbServer.closed(),
+			"An empty socket should neither block nor close the tunnel");
+		const int burst = 256;
+		for (int i = 0; i < burst; ++i) nbClient.sendData(std::vector<std::uint8_t>(16384, static_cast<std::uint8_t>(i)));
+		ASSERT(nbClient.pendingBytes() > 0, "A full socket should leave frames queued");
+		int drained = 0;
+		bool inOrder = true;
+		for (int round = 0; drained < burst && round < 100000; ++round) {
+			nbClient.flush();
+			while (nbServer.receiveFrame(view, std::chrono::milliseconds(0))) {
+				inOrder = inOrder && view.payload.size == 16384 && view.payload.data[0] == static_cast<std::uint8_t>(drained);
+				++drained;
+			}
+		}
+		ASSERT(drained == burst && inOrder && nbClient.pendingBytes() == 0, "Queued frames should drain in order");
+		nbServer.releaseBuffers();
+		nbClient.sendHeartbeat();
+		bool heartbeat = false;
+		for (int round = 0; !heartbeat && round < 100000; ++round) {
+			heartbeat = nbServer.receiveFrame(view, std::chrono::milliseconds(0)) && view.type == vpn::FrameType::HEARTBEAT;
+		}
+		ASSERT(heartbeat, "A tunnel should receive again after releasing its buffers");
+	}
+
+	TEST_SUITE(TunnelStats) {
+		// Both ends count frames and bytes, headers included
+		MockSocketPair pair;
+		vpn::Tunnel clientTunnel(pair.clientSock);
+		vpn::Tunnel serverTunnel(pair.serverSock);
+		const std::vector<std::uint8_t> testData = {'T', 'e', 's', 't'};
+		clientTunnel.sendData(testData);
+		ASSERT(serverTunnel.receiveData(std::chrono::milliseconds(1000)) == testData, "Should receive data");
+		ASSERT(clientTunnel.stats().framesSent == 1 && clientTunnel.stats().bytesSent == vpn::Tunnel::kFrameHeaderLen + testData.size(),
+			"Sent frames should be counted");
+		ASSERT(serverTunnel.stats().framesReceived == 1 && serverTunnel.stats().bytesReceived == clientTunnel.stats().bytesSent,
+			"Received frames should be counted");
+		clientTunnel.sendHeartbeat();
+		ASSERT(serverTunnel.receiveHeartbeat(std::chrono::milliseconds(1000)), "Should receive heartbeat");
+		ASSERT(clientTunnel.stats().framesSent == 2 && serverTunnel.stats().framesReceived == 2 &&
+			serverTunnel.stats().bytesReceived == clientTunnel.stats().bytesSent, "Empty frames should count their headers");
+		ASSERT(serverTunnel.stats().framesSent == 0 && serverTunnel.stats().bytesSent == 0, "Counters should be per direction");
+	}
+
+	TEST_SUITE(TunnelCoalescing) {
+		// Coalesced frames stay queued until the threshold or an explicit flush
+		MockSocketPair pair;
+		vpn::Tunnel clientTunnel(pair.clientSock);
+		vpn::Tunnel serverTunnel(pair.serverSock);
+		const std::vector<std::uint8_t> testData = {'T', 'e', 's', 't'};
+		vpn::CoalescingOptions coalescing;
+		coalescing.flushBytes = 4096;
+		coalescing.maxDelay = std::chrono::microseconds(10000000);
+		clientTunnel.setCoalescing(coalescing);
+		clientTunnel.sendData(testData);
+		clientTunnel.sendHeartbeat();
+		ASSERT(clientTunnel.pendingBytes() == 2 * vpn::Tunnel::kFrameHeaderLen + testData.size(), "Frames should be queued");
+		ASSERT(serverTunnel.receiveData(std::chrono::milliseconds(50)).empty(), "Queued frames should not be sent yet");
+		clientTunnel.flush();
+		ASSERT(clientTunnel.pendingBytes() == 0, "Flush should empty the queue");
+		ASSERT(serverTunnel.receiveData(std::chrono::milliseconds(1000)) == testData, "Flush should deliver queued data");
+		ASSERT(serverTunnel.receiveHeartbeat(std::chrono::milliseconds(1000)), "Flush should deliver frames in order");
+		// reaching the threshold writes the queue without a flush
+		clientTunnel.sendData(std::vector<std::uint8_t>(coalescing.flushBytes, 1));
+		ASSERT(clientTunnel.pendingBytes() == 0, "Reaching the threshold should write the queue");
+		ASSERT(serverTunnel.receiveData(std::chrono::milliseconds(1000)).size() == coalescing.flushBytes, "Frames past the threshold should be sent");
+	}
+
+	TEST_SUITE(TunnelPartialFrame) {
+		// A timeout in the middle of a frame keeps the partial bytes buffered
+		MockSocketPair pair;
+		vpn::Tunnel serverTunnel(pair.serverSock);
+		const std::uint8_t partial[] = {0, 0, 0, 3, static_cast<std::uint8_t>(vpn::FrameType::DATA), 'o'};
+		pair.clientSock.sendBytes(partial, sizeof(partial));
+		ASSERT(serverTunnel.receiveData(std::chrono::milliseconds(50)).empty(), "Incomplete frame should not be returned");
+		pair.clientSock.sendBytes("k", 1);
+		ASSERT(serverTunnel.receiveData(std::chrono::milliseconds(1000)) == std::vector<std::uint8_t>({'o', 'k'}),
+			"Frame should complete after the rest arrives");
+		// the buffered frame does not swallow the one behind it
+		vpn::Tunnel clientTunnel(pair.clientSock);
+		clientTunnel.sendHeartbeat();
+		ASSERT(serverTunnel.receiveHeartbeat(std::chrono::milliseconds(1000)), "The next frame should follow");
+	}
+
+	TEST_SUITE(TlsOnlyData) {
+		// TLS-only data needs both the client's offer and the server's policy
+		MockSocketPair pair;
+		vpn::Tunnel clientTunnel(pair.clientSock);
+		vpn::Tunnel serverTunnel(pair.serverSock);
+		vpn::HandshakeOptions tlsOnly;
+		tlsOnly.tlsOnlyData = true;
+		serverTunnel.setHandshakeOptions(tlsOnly);
+		handshake(clientTunnel, serverTunnel);
+		ASSERT(!clientTunnel.handshakeResult().tlsOnlyData && !serverTunnel.handshakeResult().tlsOnlyData,
+			"TLS-only data should be off unless the client offers it");
+		clientTunnel.setHandshakeOptions(tlsOnly);
+		handshake(clientTunnel, serverTunnel);
+		ASSERT(clientTunnel.handshakeResult().tlsOnlyData && serverTunnel.handshakeResult().tlsOnlyData,
+			"Both sides should enable TLS-only data");
+		serverTunnel.setHandshakeOptions(vpn::HandshakeOptions{});
+		handshake(clientTunnel, serverTunnel);
+		ASSERT(!clientTunnel.handshakeResult().tlsOnlyData && !serverTunnel.handshakeResult().tlsOnlyData,
+			"TLS-only data should be off unless the server allows it");
+	}
+
+	TEST_SUITE(TunnelCompression) {
+		// Compression is used only when both sides offer a common codec
+		MockSocketPair pair;
+		vpn::Tunnel clientTunnel(pair.clientSock);
+		vpn::Tunnel serverTunnel(pair.serverSock);
+		handshake(clientTunnel, serverTunnel);
+		ASSERT(clientTunnel.handshakeResult().compression == vpn::CompressionCodec::NONE,
+			"Compression should be off by default");
+		vpn::HandshakeOptions zlib;
+		zlib.compression = {vpn::CompressionCodec::ZLIB};
+		clientTunnel.setHandshakeOptions(zlib);
+		handshake(clientTunnel, serverTunnel);
+		ASSERT(clientTunnel.handshakeResult().compression == vpn::CompressionCodec::NONE &&
+			serverTunnel.handshakeResult().compression == vpn::CompressionCodec::NONE,
+			"A server without codecs should leave compression off");
+		serverTunnel.setHandshakeOptions(zlib);
+		handshake(clientTunnel, serverTunnel);
+		ASSERT(clientTunnel.handshakeResult().compression == vpn::CompressionCodec::ZLIB &&
+			serverTunnel.handshakeResult().compression == vpn::CompressionCodec::ZLIB,
+			"Both sides should agree on compression");
+		// a compressed frame carries its flag to the receiver
+		std::vector<std::uint8_t> text(1000, 'a');
+		vpn::PacketBuffer buf(vpn::Tunnel::kFrameHeaderLen, text.size());
+		buf.assign(text.data(), text.size());
+		vpn::PayloadCompressor compressor(vpn::CompressionCodec::ZLIB);
+		ASSERT(compressor.compress(buf) && buf.size() < text.size(), "Repetitive data should compress");
+		clientTunnel.sendFrame(vpn::FrameType::DATA, buf, true);
+		vpn::FrameView view;
+		ASSERT(serverTunnel.receiveFrame(view, std::chrono::milliseconds(1000)) && view.compressed, "The frame should arrive flagged");
+		const vpn::ByteView plain = compressor.decompress(view.payload);
+		ASSERT(plain.size == text.size() && std::equal(text.begin(), text.end(), plain.data), "The payload should decompress intact");
+	}
+
+	TEST_SUITE(TunnelFragmentation) {
+		// Payloads above the peer's announced frame limit arrive as fragments and are reassembled
+		MockSocketPair pair;
+		vpn::Tunnel clientTunnel(pair.clientSock);
+		vpn::Tunnel serverTunnel(pair.serverSock);
+		vpn::HandshakeOptions smallFrames;
+		smallFrames.maxFrameLen = vpn::kMinMaxFrameLen;
+		smallFrames.maxMessageLen = 8192;
+		serverTunnel.setHandshakeOptions(smallFrames);
+		handshake(clientTunnel, serverTunnel);
+		ASSERT(clientTunnel.handshakeResult().peerMaxFrameLen == vpn::kMinMaxFrameLen, "Client should learn the server's frame limit");
+		std::vector<std::uint8_t> large(5000);
+		for (std::size_t i = 0; i < large.size(); ++i) large[i] = static_cast<std::uint8_t>(i);
+		const auto framesBefore = clientTunnel.stats().framesSent;
+		clientTunnel.sendData(large);
+		ASSERT(serverTunnel.receiveData(std::chrono::milliseconds(1000)) == large, "Fragments should be reassembled");
+		const std::size_t fragments = (large.size() + vpn::kMinMaxFrameLen - 2) / (vpn::kMinMaxFrameLen - 1);
+		ASSERT(clientTunnel.stats().framesSent - framesBefore == fragments, "Each fragment should fit the peer's frame limit");
+		bool rejected = false;
+		try {
+			clientTunnel.sendData(std::vector<std::uint8_t>(8193));
+		} catch (const std::runtime_error&) {
+			rejected = true;
+		}
+		ASSERT(rejected, "Payloads above the peer's message limit should not be sent");
+	}
+
+	TEST_SUITE(StreamMux) {
+		MockSocketPair pair;
+		vpn::Tunnel clientTunnel(pair.clientSock);
+		vpn::Tunnel serverTunnel(pair.serverSock);
+		vpn::StreamMux client(clientTunnel, nullptr, true);
+		vpn::StreamMux server(serverTunnel, nullptr, false, vpn::StreamMux::kInitialWindow);
+		auto deliver = [](vpn::Tunnel& tunnel, vpn::StreamMux& mux) {
+			vpn::FrameView frame;
+			while (tunnel.receiveFrame(frame, std::chrono::milliseconds(50))) mux.handleFrame(frame);
+		};
+
+		std::uint32_t id = client.open();
+		ASSERT(id % 2 == 1, "Client streams should use odd ids");
+		const std::vector<std::uint8_t> hello = {'h', 'i'};
+		client.write(id, hello.data(), hello.size());
+		deliver(serverTunnel, server);
+		ASSERT(server.acceptStreams() == std::vector<std::uint32_t>{id}, "Server should accept the stream");
+		std::uint8_t buf[8];
+		ASSERT(server.read(id, buf, sizeof(buf)) == 2 && buf[0] == 'h', "Stream data should arrive");
+
+		// Sending stops at the credit the peer granted and resumes on window updates
+		deliver(clientTunnel, client);
+		ASSERT(client.sendCredit(id) == vpn::StreamMux::kInitialWindow - hello.size(), "Credit should match the server's window");
+		std::vector<std::uint8_t> bulk(vpn::StreamMux::kInitialWindow + 1000, 0x5A);
+		client.write(id, bulk.data(), bulk.size());
+		ASSERT(client.pending(id) == 1000 + hello.size(), "Data beyond the credit should stay queued");
+		std::vector<std::uint8_t> sink(bulk.size());
+		std::size_t got = 0;
+		while (client.pending(id) > 0) {
+			deliver(serverTunnel, server);
+			got += server.read(id, sink.data(), sink.size());
+			deliver(clientTunnel, client);
+		}
+		deliver(serverTunnel, server);
+		got += server.read(id, sink.data(), sink.size());
+		ASSERT(got == bulk.size(), "All queued data should arrive after window updates");
+
+		client.close(id);
+		deliver(serverTunnel, server);
+		ASSERT(server.remoteClosed(id), "Server should see the half-close");
+		server.close(id);
+		deliver(clientTunnel, client);
+		ASSERT(!client.exists(id) && !server.exists(id), "Closed streams should be retired");
+
+		// A peer may not hold more than maxStreams open
+		vpn::StreamMux limited(serverTunnel, nullptr, false, vpn::StreamMux::kDefaultWindow, 2);
+		client.open();
+		client.open();
+		deliver(serverTunnel, limited);
+		ASSERT(limited.acceptStreams().size() == 2, "Streams up to the limit should be accepted");
+		client.open();
+		bool rejected = false;
+		try {
+			deliver(serverTunnel, limited);
+		} catch (const std::runtime_error&) {
+			rejected = true;
+		}
+		ASSERT(rejected, "A stream beyond the limit should be a protocol error");
+	}
+
+	TEST_SUITE(BufferPool) {
+		vpn::BufferPool pool;
+		for (int i = 0; i < 10; ++i) {
+			vpn::PacketBuffer buf(pool, vpn::Tunnel::kFrameHeaderLen, 1400);
+			buf.assign(reinterpret_cast<const std::uint8_t*>("ping"), 4);
+		}
+		auto small = pool.stats(vpn::BufferPool::SMALL);
+		ASSERT(small.misses == 1 && small.hits == 9, "Released blocks should be reused");
+		ASSERT(small.highWater == 1 && small.inUse == 0, "Only one block should have been in use");
+
+		// Copies are deep; growing past the small class moves to a bulk block
+		vpn::PacketBuffer a(pool, 8, 16);
+		a.assign(reinterpret_cast<const std::uint8_t*>("abc"), 3);
+		vpn::PacketBuffer b = a;
+		b.data()[0] = 'x';
+		ASSERT(a.data()[0] == 'a', "Copy should not share storage");
+		std::vector<std::uint8_t> bulk(4096, 7);
+		a.assign(bulk.data(), bulk.size());
+		ASSERT(a.headroom() == 8 && a.size() == bulk.size(), "Growth should keep headroom and payload");
+		ASSERT(pool.stats(vpn::BufferPool::BULK).misses == 1, "Growth should take a bulk block");
+
+		// A receive buffer grown for an oversized frame goes back to a pooled block
+		MockSocketPair pair;
+		vpn::Tunnel sender(pair.clientSock);
+		vpn::Tunnel receiver(pair.serverSock);
+		vpn::HandshakeOptions limits;
+		limits.maxFrameLen = 256 * 1024;
+		limits.maxMessageLen = 256 * 1024;
+		receiver.setHandshakeOptions(limits);
+		const auto before = vpn::BufferPool::forThread().stats(vpn::BufferPool::BULK);
+		std::vector<std::uint8_t> large(100 * 1024, 3);
+		Poco::Thread writer; // more than the socket buffers may hold
+		writer.startFunc([&sender, &large]() { sender.sendData(large); });
+		const bool receivedLarge = receiver.receiveData(std::chrono::milliseconds(1000)) == large;
+		writer.join();
+		ASSERT(receivedLarge, "Should receive a frame larger than a bulk block");
+		sender.sendData(std::vector<std::uint8_t>(16, 4));
+		ASSERT(receiver.receiveData(std::chrono::milliseconds(1000)).size() == 16, "Should receive after an oversized frame");
+		const auto after = vpn::BufferPool::forThread().stats(vpn::BufferPool::BULK);
+		ASSERT(after.inUse == before.inUse + 1 && after.hits > before.hits, "The receive buffer should come from the pool again");
 	}
 }
 